@@ -0,0 +1,126 @@
+#!/bin/bash
+# Benchmark harness for ntx: builds deterministic synthetic stores, then
+# times each command against them with the real ntx binary. Results are
+# printed as one JSON object per line for each store size and command,
+# so that the output of two builds can be compared with compare.sh.
+#
+# Note IDs are four hex digits, so no store can hold more than 65536
+# notes; ntx add needs free IDs, so the largest default store is 60000.
+#
+# Environment:
+#   BENCH_SIZES   Store sizes, in notes.       (1000 10000 60000)
+#   BENCH_RUNS    Timed runs of each command.  (20)
+#   BENCH_TAGS    Distinct tags in the store.  (200)
+#   BENCH_PER     Tags per note.               (3)
+#   BENCH_SEED    Seed for the generator.      (1)
+
+NTX=`pwd`/../ntx
+SIZES=${BENCH_SIZES:-"1000 10000 60000"}
+RUNS=${BENCH_RUNS:-20}
+TAGS=${BENCH_TAGS:-200}
+PER=${BENCH_PER:-3}
+SEED=${BENCH_SEED:-1}
+WORK=`mktemp -d`
+export NTXROOT=$WORK/ntx
+
+trap "rm -rf $WORK" EXIT
+
+# Write 'notes' notes, with tag popularity following Zipf's law, into the
+# notes and refs of an empty store; ntx reindex then derives the rest. A
+# Park-Miller generator keeps the store identical across awk versions.
+function generate {
+  rm -rf $NTXROOT
+  mkdir -p $NTXROOT/notes $NTXROOT/tags $NTXROOT/refs
+  awk -v notes=$1 -v tags=$TAGS -v per=$PER -v seed=$SEED \
+      -v root=$NTXROOT 'function rnd() {
+      seed = (seed * 16807) % 2147483647
+      return seed / 2147483647
+    }
+    function zipf(  u, lo, hi, mid) {
+      u = rnd() * cdf[tags - 1]
+      lo = 0
+      hi = tags - 1
+      while(lo < hi) {
+        mid = int((lo + hi) / 2)
+        if(cdf[mid] < u) lo = mid + 1; else hi = mid
+      }
+      return lo
+    }
+    BEGIN {
+      for(k = 0; k < tags; k++) cdf[k] = (k ? cdf[k - 1] : 0) + 1 / (k + 1)
+      for(i = 0; i < notes; i++) {
+        id = sprintf("%04x", i)
+        file = root "/notes/" id
+        printf("Synthetic note %d about topic %d\n\n", i, zipf()) > file
+        printf("Body of note %d, with some text to store.\n", i) > file
+        close(file)
+
+        line = id "\t"
+        delete seen
+        for(j = 0; j < per && j < tags; ) {
+          t = zipf()
+          if(t in seen) continue
+          seen[t] = 1
+          line = line "t" t ";"
+          j++
+        }
+        print line > (root "/refs." substr(id, 1, 2))
+      }
+    }'
+  for f in $NTXROOT/refs.*; do
+    gzip -c $f > $NTXROOT/refs/${f##*.}
+    rm $f
+  done
+  $NTX reindex > /dev/null || exit 1
+}
+
+# Time a command over RUNS runs; Each run is timed separately. The
+# command is given the run number, to vary its arguments.
+function measure {
+  local name=$1 notes=$2 cmd=$3 i start end
+  local times=$WORK/times
+
+  : > $times
+  for i in `seq 1 $RUNS`; do
+    start=$EPOCHREALTIME
+    $cmd $i > /dev/null 2>&1 || { echo "$name failed on run $i." >&2; exit 1; }
+    end=$EPOCHREALTIME
+    echo "$start $end" | awk '{ printf("%.3f\n", ($2 - $1) * 1000) }' >> $times
+  done
+
+  sort -n $times | awk -v name=$name -v notes=$notes '{ t[NR] = $1; s += $1 }
+    END {
+      printf("{\"notes\":%d,\"op\":\"%s\",\"runs\":%d,", notes, name, NR)
+      printf("\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,",
+             t[int((NR - 1) * 0.5) + 1], t[int((NR - 1) * 0.9) + 1],
+             t[int((NR - 1) * 0.99) + 1])
+      printf("\"max_ms\":%.3f,\"ops_per_s\":%.1f}\n", t[NR], NR * 1000 / s)
+    }'
+}
+
+# The commands to time; Each picks a note from the run number.
+function id_of { printf "%04x" $(( ($1 * 7919) % NOTES )); }
+
+function op_list_all  { $NTX list; }
+function op_list_one  { $NTX list t0; }
+function op_list_two  { $NTX list t0 t1; }
+function op_list_three { $NTX list t0 t1 t2; }
+function op_list_rare { $NTX list t0 t$(( TAGS - 1 )); }
+function op_put       { $NTX put `id_of $1`; }
+function op_tags      { $NTX tag `id_of $1`; }
+function op_retag     { $NTX tag `id_of $1` t1 t$(( $1 % TAGS )); }
+function op_edit      { echo "Edited note $1" | $NTX edit `id_of $1`; }
+function op_add       { echo "Added note $1" | $NTX add t0 t$(( $1 % TAGS )); }
+function op_rm        { $NTX rm `id_of $(( $1 + RUNS ))`; }
+function op_fsck      { $NTX fsck; }
+function op_reindex   { $NTX reindex; }
+
+for NOTES in $SIZES; do
+  generate $NOTES
+
+  # Read-only commands first, then those which alter the store.
+  for op in list_all list_one list_two list_three list_rare put tags \
+            fsck reindex retag edit add rm; do
+    measure $op $NOTES op_$op
+  done
+done
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Compare two sets of results from bench.sh, such as those of two builds.
+# Prints the median and p90 latency of each command in both, and the
+# ratio of the new median to the old; Ratios above 1 are slowdowns.
+#
+# Usage: bash compare.sh old.txt new.txt
+
+if [ $# -ne 2 ]; then
+  echo "Usage: $0 old.txt new.txt"
+  exit 1
+fi
+
+awk 'function field(name,  re) {
+    re = "\"" name "\":\"?[^,\"}]*"
+    if(!match($0, re)) return ""
+    re = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+    sub(/^"/, "", re)
+    return re
+  }
+  { key = field("notes") " " field("op") }
+  FNR == NR { p50[key] = field("p50_ms"); p90[key] = field("p90_ms"); next }
+  key in p50 {
+    ratio = p50[key] > 0 ? field("p50_ms") / p50[key] : 0
+    printf("%-24s %10.3f %10.3f  ->  %10.3f %10.3f  x%.2f\n", key,
+           p50[key], p90[key], field("p50_ms"), field("p90_ms"), ratio)
+  }' "$1" "$2"
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Scaling benchmark for the task scheduler: times a multi-tag 'ntx list'
+# over a synthetic store with 1 to N threads. Note IDs are four hex digits,
+# so a store holds at most 65536 notes; 16 tags over every note give the
+# intersection 1M postings to inflate and check.
+#
+# Usage: bash sched.sh [threads] [runs]
+
+NTX=`pwd`/../ntx
+MAXJOBS=${1:-`getconf _NPROCESSORS_ONLN`}
+RUNS=${2:-5}
+NOTES=65536
+TAGS=16
+export NTXROOT=`mktemp -d`/ntx_bench
+
+mkdir -p $NTXROOT/tags $NTXROOT/refs $NTXROOT/notes
+
+# Every note is in every tag, so no tag short-circuits the intersection.
+awk -v n=$NOTES 'BEGIN {
+  for(i = 0; i < n; i++) printf("%04x\tSynthetic note number %d\n", i, i)
+}' > $NTXROOT/postings
+for t in `seq 1 $TAGS`; do
+  gzip -c $NTXROOT/postings > $NTXROOT/tags/t$t
+  ARGS="$ARGS t$t"
+done
+gzip -c $NTXROOT/postings > $NTXROOT/index
+rm $NTXROOT/postings
+
+function now { date +%s%N; }
+
+echo "# threads	best_ms	mean_ms"
+JOBS=1
+while [ $JOBS -le $MAXJOBS ]; do
+  BEST=0; TOTAL=0
+  for r in `seq 1 $RUNS`; do
+    START=`now`
+    NTX_THREADS=$JOBS $NTX list $ARGS > /dev/null || exit 1
+    MS=$(( (`now` - START) / 1000000 ))
+    TOTAL=$(( TOTAL + MS ))
+    if [ $BEST -eq 0 ] || [ $MS -lt $BEST ]; then BEST=$MS; fi
+  done
+  echo "$JOBS	$BEST	$(( TOTAL / RUNS ))"
+  if [ $JOBS -lt $MAXJOBS ] && [ $(( JOBS * 2 )) -gt $MAXJOBS ]; then
+    JOBS=$MAXJOBS
+  else
+    JOBS=$(( JOBS * 2 ))
+  fi
+done
+
+rm -r `dirname $NTXROOT`
@@ -0,0 +1,248 @@
+/*
+ * Cached results of ntx list, for intersections of several tags.
+ *
+ * An entry is named by a checksum of its sorted, distinct tags, and starts
+ * with its key: those tags on one line, then the checksum and length of
+ * each tag file, as recorded in the manifest, on the next. Every change to
+ * a tag file changes its checksum, so an entry is only used while all of
+ * its tag files are exactly as they were when it was written. The result
+ * follows the key, uncompressed, so that a hit costs a single small read.
+ *
+ * CACHE_DIR/lru logs the entries as they are used, most recent last, so
+ * a hit only appends a line to it. Storing an entry trims the log to the
+ * NTX_CACHE (CACHE_ENTRIES by default) most recently used, and removes the
+ * rest; Hits alone trim it only once it has grown well past that. Setting
+ * NTX_CACHE=0 disables the cache. Failing to write to the cache is never
+ * an error, as the result has already been computed.
+ *
+ * CACHE_INDEX is the index inflated, for listing every note with a single
+ * copy to STDOUT. It starts with a line of the length and modification
+ * time of the index it was made from, and ntx removes it before writing
+ * to the index at all, so the stamp only has to catch other writers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "crc32c.h"
+#include "ntx.h"
+
+#define CACHE_LRU     CACHE_DIR"/lru"
+#define CACHE_INDEX   CACHE_DIR"/index"
+
+/* The name of an entry: Eight hex digits. */
+#define CACHE_NAME_LENGTH 8
+
+static unsigned int cache_limit(void)
+{
+  char *env = getenv("NTX_CACHE");
+  return env ? (unsigned int)atoi(env) : CACHE_ENTRIES;
+}
+
+static int cache_sorttag(const void *a, const void *b)
+{
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+/* Name the entry for a key, by the checksum of its line of tags. */
+static void cache_name(char *key, char *name)
+{
+  unsigned long crc = crc32c(0, key, strchr(key, '\n') - key);
+  seprintf(name, CACHE_NAME_LENGTH + 1, "%08lx", crc);
+}
+
+/* Build the key of an intersection of 'tags'. Returns NULL if it can't *
+ * be cached, as some tag file has no checksum or has changed since it  *
+ * was recorded, or if the cache is disabled.                           */
+char *cache_key(char **tags, unsigned int tagc)
+{
+  char file[FILE_MAX], **sorted, *key;
+  unsigned long crc, len;
+  unsigned int i, n, size, pos;
+
+  if(!cache_limit()) return NULL;
+
+  sorted = alloc(tagc * sizeof(char *));
+  memcpy(sorted, tags, tagc * sizeof(char *));
+  qsort(sorted, tagc, sizeof(char *), cache_sorttag);
+  for(i = n = 0; i < tagc; i++)
+    if(!n || strcmp(sorted[n - 1], sorted[i])) sorted[n++] = sorted[i];
+
+  /* Each tag and its separator, then its checksum, length and separator. */
+  for(i = 0, size = 3; i < n; i++) size += strlen(sorted[i]) + 1 + 30;
+  key = alloc(size);
+
+  for(i = pos = 0; i < n; i++)
+    pos += seprintf(key + pos, size - pos, "%s%s", sorted[i], FIELD_SEP);
+  pos += seprintf(key + pos, size - pos, "\n");
+
+  for(i = 0; i < n; i++) {
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", sorted[i]);
+    if(!manifest_lookup(file, &crc, &len) || ntx_flen(file) != (long)len) {
+      release(key);
+      release(sorted);
+      return NULL;
+    }
+    pos += seprintf(key + pos, size - pos, "%08lx %lu%s",
+                    crc, len, FIELD_SEP);
+  }
+  seprintf(key + pos, size - pos, "\n");
+
+  release(sorted);
+  return key;
+}
+
+/* Rewrite the LRU log with just the most recently used entries, least *
+ * recent first, removing any which fall beyond the limit.             */
+static void cache_trim(void)
+{
+  char file[FILE_MAX], *buf, *line, *end, **kept;
+  unsigned int count = 0, limit = cache_limit(), i;
+  FILE *f;
+
+  buf  = ntx_buffer(CACHE_LRU);
+  kept = alloc(limit * sizeof(char *));
+
+  /* From the most recent, keep each entry the first time it is seen. */
+  for(end = buf + strlen(buf); end > buf; end = line) {
+    if(end[-1] == '\n') *--end = '\0';
+    for(line = end; line > buf && line[-1] != '\n'; line--);
+    if(strlen(line) != CACHE_NAME_LENGTH) continue;
+
+    for(i = 0; i < count && strcmp(kept[i], line); i++);
+    if(i < count) continue;
+    if(count < limit) kept[count++] = line;
+    else {
+      seprintf(file, FILE_MAX, CACHE_DIR"/%s", line);
+      remove(file);
+    }
+  }
+
+  f = raw_open(CACHE_LRU".new", "w");
+  while(count--) fprintf(f, "%s\n", kept[count]);
+  if(fflush(f) != 0 || ferror(f)) {
+    release(f);
+    remove(CACHE_LRU".new");
+  } else {
+    release(f);
+    rename(CACHE_LRU".new", CACHE_LRU);
+  }
+  release(kept);
+  release(buf);
+}
+
+/* Log that an entry has just been used, trimming the log if it has been *
+ * 'stored', or has grown to twice the lines it would be trimmed to.     */
+static void cache_touch(char *name, int stored)
+{
+  long int most = 2L * cache_limit() * (CACHE_NAME_LENGTH + 1);
+  FILE *f;
+
+  f = raw_open(CACHE_LRU, "a");
+  fprintf(f, "%s\n", name);
+  release(f);
+  if(stored || ntx_flen(CACHE_LRU) > most) cache_trim();
+}
+
+/* Return the cached result for 'key', or NULL if there is none. */
+char *cache_lookup(char *key)
+{
+  char name[CACHE_NAME_LENGTH + 1], file[FILE_MAX], *buf = NULL;
+  unsigned int len = strlen(key);
+  exception_t exc;
+
+  cache_name(key, name);
+  seprintf(file, FILE_MAX, CACHE_DIR"/%s", name);
+
+  /* An unreadable entry is just a miss. */
+  try buf = ntx_buffer(file);
+  catch(exc) return NULL;
+
+  if(strncmp(buf, key, len) != 0) {
+    release(buf);
+    return NULL;
+  }
+  memmove(buf, buf + len, strlen(buf + len) + 1);
+
+  try cache_touch(name, 0);
+  catch(exc) { /* The order of the LRU log is only a hint. */ }
+  return buf;
+}
+
+/* Store the result for 'key', replacing any older entry for its tags. */
+void cache_store(char *key, char *result)
+{
+  char name[CACHE_NAME_LENGTH + 1], file[FILE_MAX], tmp[FILE_MAX];
+  exception_t exc;
+  FILE *f;
+  int err;
+
+  cache_name(key, name);
+  seprintf(file, FILE_MAX, CACHE_DIR"/%s", name);
+  seprintf(tmp, FILE_MAX, CACHE_DIR"/%s.new", name);
+  if(ntx_mkdir(CACHE_DIR) != 0) return;
+
+  try {
+    f = raw_open(tmp, "w");
+    fputs(key, f);
+    fputs(result, f);
+    err = fflush(f) != 0 || ferror(f);
+    release(f);
+
+    if(err || rename(tmp, file) != 0) remove(tmp);
+    else cache_touch(name, 1);
+  } catch(exc) remove(tmp);
+}
+
+/* Write out every note from CACHE_INDEX; 0 if it isn't current. */
+int cache_index(void)
+{
+  char head[64], stamp[64];
+  exception_t exc;
+  long int size;
+  FILE *f;
+
+  if(!cache_limit()) return 0;
+  try {
+    seprintf(stamp, sizeof(stamp), "%ld %ld\n",
+             ntx_flen(INDEX_FILE), ntx_ftime(INDEX_FILE));
+    size = ntx_flen(CACHE_INDEX);
+    f = raw_open(CACHE_INDEX, "rb");
+  } catch(exc) return 0;
+
+  if(!raw_getl(f, head, sizeof(head)) || strcmp(head, stamp)) {
+    release(f);
+    return 0;
+  }
+  out_file(NULL, f, strlen(head), size - strlen(head));
+  release(f);
+  return 1;
+}
+
+/* Keep the index, as just read whole, for cache_index. */
+void cache_keepindex(char *buf)
+{
+  exception_t exc;
+  FILE *f;
+  int err;
+
+  if(!cache_limit() || ntx_mkdir(CACHE_DIR) != 0) return;
+  try {
+    f = raw_open(CACHE_INDEX".new", "w");
+    fprintf(f, "%ld %ld\n", ntx_flen(INDEX_FILE), ntx_ftime(INDEX_FILE));
+    fputs(buf, f);
+    err = fflush(f) != 0 || ferror(f);
+    release(f);
+
+    if(err || rename(CACHE_INDEX".new", CACHE_INDEX) != 0)
+      remove(CACHE_INDEX".new");
+  } catch(exc) remove(CACHE_INDEX".new");
+}
+
+/* Forget the inflated index, before the index is written. */
+void cache_dropindex(void)
+{
+  remove(CACHE_INDEX);
+}
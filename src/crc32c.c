@@ -0,0 +1,117 @@
+/*
+ * CRC-32C (Castagnoli), as used for the checksums in the manifest.
+ *
+ * x86-64 processors with SSE4.2 compute this in hardware, which we use
+ * when the processor supports it; Otherwise we fall back to a table.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+static const unsigned long crc32c_table[256] = {
+  0x00000000UL, 0xf26b8303UL, 0xe13b70f7UL, 0x1350f3f4UL,
+  0xc79a971fUL, 0x35f1141cUL, 0x26a1e7e8UL, 0xd4ca64ebUL,
+  0x8ad958cfUL, 0x78b2dbccUL, 0x6be22838UL, 0x9989ab3bUL,
+  0x4d43cfd0UL, 0xbf284cd3UL, 0xac78bf27UL, 0x5e133c24UL,
+  0x105ec76fUL, 0xe235446cUL, 0xf165b798UL, 0x030e349bUL,
+  0xd7c45070UL, 0x25afd373UL, 0x36ff2087UL, 0xc494a384UL,
+  0x9a879fa0UL, 0x68ec1ca3UL, 0x7bbcef57UL, 0x89d76c54UL,
+  0x5d1d08bfUL, 0xaf768bbcUL, 0xbc267848UL, 0x4e4dfb4bUL,
+  0x20bd8edeUL, 0xd2d60dddUL, 0xc186fe29UL, 0x33ed7d2aUL,
+  0xe72719c1UL, 0x154c9ac2UL, 0x061c6936UL, 0xf477ea35UL,
+  0xaa64d611UL, 0x580f5512UL, 0x4b5fa6e6UL, 0xb93425e5UL,
+  0x6dfe410eUL, 0x9f95c20dUL, 0x8cc531f9UL, 0x7eaeb2faUL,
+  0x30e349b1UL, 0xc288cab2UL, 0xd1d83946UL, 0x23b3ba45UL,
+  0xf779deaeUL, 0x05125dadUL, 0x1642ae59UL, 0xe4292d5aUL,
+  0xba3a117eUL, 0x4851927dUL, 0x5b016189UL, 0xa96ae28aUL,
+  0x7da08661UL, 0x8fcb0562UL, 0x9c9bf696UL, 0x6ef07595UL,
+  0x417b1dbcUL, 0xb3109ebfUL, 0xa0406d4bUL, 0x522bee48UL,
+  0x86e18aa3UL, 0x748a09a0UL, 0x67dafa54UL, 0x95b17957UL,
+  0xcba24573UL, 0x39c9c670UL, 0x2a993584UL, 0xd8f2b687UL,
+  0x0c38d26cUL, 0xfe53516fUL, 0xed03a29bUL, 0x1f682198UL,
+  0x5125dad3UL, 0xa34e59d0UL, 0xb01eaa24UL, 0x42752927UL,
+  0x96bf4dccUL, 0x64d4cecfUL, 0x77843d3bUL, 0x85efbe38UL,
+  0xdbfc821cUL, 0x2997011fUL, 0x3ac7f2ebUL, 0xc8ac71e8UL,
+  0x1c661503UL, 0xee0d9600UL, 0xfd5d65f4UL, 0x0f36e6f7UL,
+  0x61c69362UL, 0x93ad1061UL, 0x80fde395UL, 0x72966096UL,
+  0xa65c047dUL, 0x5437877eUL, 0x4767748aUL, 0xb50cf789UL,
+  0xeb1fcbadUL, 0x197448aeUL, 0x0a24bb5aUL, 0xf84f3859UL,
+  0x2c855cb2UL, 0xdeeedfb1UL, 0xcdbe2c45UL, 0x3fd5af46UL,
+  0x7198540dUL, 0x83f3d70eUL, 0x90a324faUL, 0x62c8a7f9UL,
+  0xb602c312UL, 0x44694011UL, 0x5739b3e5UL, 0xa55230e6UL,
+  0xfb410cc2UL, 0x092a8fc1UL, 0x1a7a7c35UL, 0xe811ff36UL,
+  0x3cdb9bddUL, 0xceb018deUL, 0xdde0eb2aUL, 0x2f8b6829UL,
+  0x82f63b78UL, 0x709db87bUL, 0x63cd4b8fUL, 0x91a6c88cUL,
+  0x456cac67UL, 0xb7072f64UL, 0xa457dc90UL, 0x563c5f93UL,
+  0x082f63b7UL, 0xfa44e0b4UL, 0xe9141340UL, 0x1b7f9043UL,
+  0xcfb5f4a8UL, 0x3dde77abUL, 0x2e8e845fUL, 0xdce5075cUL,
+  0x92a8fc17UL, 0x60c37f14UL, 0x73938ce0UL, 0x81f80fe3UL,
+  0x55326b08UL, 0xa759e80bUL, 0xb4091bffUL, 0x466298fcUL,
+  0x1871a4d8UL, 0xea1a27dbUL, 0xf94ad42fUL, 0x0b21572cUL,
+  0xdfeb33c7UL, 0x2d80b0c4UL, 0x3ed04330UL, 0xccbbc033UL,
+  0xa24bb5a6UL, 0x502036a5UL, 0x4370c551UL, 0xb11b4652UL,
+  0x65d122b9UL, 0x97baa1baUL, 0x84ea524eUL, 0x7681d14dUL,
+  0x2892ed69UL, 0xdaf96e6aUL, 0xc9a99d9eUL, 0x3bc21e9dUL,
+  0xef087a76UL, 0x1d63f975UL, 0x0e330a81UL, 0xfc588982UL,
+  0xb21572c9UL, 0x407ef1caUL, 0x532e023eUL, 0xa145813dUL,
+  0x758fe5d6UL, 0x87e466d5UL, 0x94b49521UL, 0x66df1622UL,
+  0x38cc2a06UL, 0xcaa7a905UL, 0xd9f75af1UL, 0x2b9cd9f2UL,
+  0xff56bd19UL, 0x0d3d3e1aUL, 0x1e6dcdeeUL, 0xec064eedUL,
+  0xc38d26c4UL, 0x31e6a5c7UL, 0x22b65633UL, 0xd0ddd530UL,
+  0x0417b1dbUL, 0xf67c32d8UL, 0xe52cc12cUL, 0x1747422fUL,
+  0x49547e0bUL, 0xbb3ffd08UL, 0xa86f0efcUL, 0x5a048dffUL,
+  0x8ecee914UL, 0x7ca56a17UL, 0x6ff599e3UL, 0x9d9e1ae0UL,
+  0xd3d3e1abUL, 0x21b862a8UL, 0x32e8915cUL, 0xc083125fUL,
+  0x144976b4UL, 0xe622f5b7UL, 0xf5720643UL, 0x07198540UL,
+  0x590ab964UL, 0xab613a67UL, 0xb831c993UL, 0x4a5a4a90UL,
+  0x9e902e7bUL, 0x6cfbad78UL, 0x7fab5e8cUL, 0x8dc0dd8fUL,
+  0xe330a81aUL, 0x115b2b19UL, 0x020bd8edUL, 0xf0605beeUL,
+  0x24aa3f05UL, 0xd6c1bc06UL, 0xc5914ff2UL, 0x37faccf1UL,
+  0x69e9f0d5UL, 0x9b8273d6UL, 0x88d28022UL, 0x7ab90321UL,
+  0xae7367caUL, 0x5c18e4c9UL, 0x4f48173dUL, 0xbd23943eUL,
+  0xf36e6f75UL, 0x0105ec76UL, 0x12551f82UL, 0xe03e9c81UL,
+  0x34f4f86aUL, 0xc69f7b69UL, 0xd5cf889dUL, 0x27a40b9eUL,
+  0x79b737baUL, 0x8bdcb4b9UL, 0x988c474dUL, 0x6ae7c44eUL,
+  0xbe2da0a5UL, 0x4c4623a6UL, 0x5f16d052UL, 0xad7d5351UL
+};
+
+static unsigned long crc32c_sw(unsigned long crc, const unsigned char *p,
+                               unsigned long len)
+{
+  while(len--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HW
+
+__attribute__((target("sse4.2")))
+static unsigned long crc32c_hw(unsigned long crc, const unsigned char *p,
+                               unsigned long len)
+{
+  unsigned long long c = crc;
+  uint64_t word;
+
+  for(; len && ((uintptr_t)p & 7); len--) c = __builtin_ia32_crc32qi(c, *p++);
+  for(; len >= 8; len -= 8, p += 8) {
+    memcpy(&word, p, 8);
+    c = __builtin_ia32_crc32di(c, word);
+  }
+  for(; len; len--) c = __builtin_ia32_crc32qi(c, *p++);
+
+  return (unsigned long)c;
+}
+#endif
+
+unsigned long crc32c(unsigned long crc, const void *buf, unsigned long len)
+{
+  crc = ~crc & 0xffffffffUL;
+
+#ifdef CRC32C_HW
+  if(__builtin_cpu_supports("sse4.2"))
+    return ~crc32c_hw(crc, buf, len) & 0xffffffffUL;
+#endif
+
+  return ~crc32c_sw(crc, buf, len) & 0xffffffffUL;
+}
@@ -0,0 +1,8 @@
+#ifndef CRC32C__H
+#define CRC32C__H
+
+/* CRC-32C (Castagnoli) of 'len' bytes, continuing from 'crc'. As with   *
+ * zlib's crc32(), pass 0 to begin, and the result to continue.          */
+unsigned long crc32c(unsigned long crc, const void *buf, unsigned long len);
+
+#endif
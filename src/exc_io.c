@@ -5,12 +5,16 @@
 #include <zlib.h>
 #include <errno.h>
 #include "except.h"
+#include "stats.h"
+
+int ntx_freadv(char **files, unsigned int n, char **bufs, long int *lens);
 
 FILE *raw_open(char *file, char *mode)
 {
   FILE *f = fopen(file, mode);
   if(!f) throw(E_FACCESS, file);
   resource(f, (resource_handler)fclose);
+  STAT(ST_FOPEN, 1);
   return f;
 }
 
@@ -18,14 +22,34 @@ char* raw_getl(FILE *f, char *buf, unsigned int max)
 {
   char *b = fgets(buf, max, f);
   if(!b && ferror(f) != 0) throw(E_FIOERR, f);
+  if(b) STAT(ST_RAW_READ, strlen(b));
   return b;
 }
 
+/* Read the whole of several files at once, where the system can; Returns *
+ * -1 if it can't, for them to be read one at a time. A file which can't  *
+ * be read is left NULL, with a length of -1.                             */
+int raw_readall(char **files, unsigned int n, char **bufs, long int *lens)
+{
+  unsigned int i;
+
+  if(ntx_freadv(files, n, bufs, lens) != 0) return -1;
+  for(i = 0; i < n; i++) {
+    if(!bufs[i]) continue;
+    resource(bufs[i], free);
+    STAT(ST_FOPEN, 1);
+    STAT(ST_RAW_READ, lens[i]);
+  }
+  return 0;
+}
+
 void *alloc(unsigned int size)
 {
   void *buf = malloc(size);
   if(!buf) throw(E_NOMEM, NULL);
   resource(buf, free);
+  STAT(ST_ALLOCS, 1);
+  STAT(ST_ALLOC_BYTES, size);
   return buf;
 }
 
@@ -37,6 +61,8 @@ void *ralloc(void *buf, unsigned int size)
     release_pop(buf, 0);
     resource(tmp, free);
   }
+  STAT(ST_ALLOCS, 1);
+  STAT(ST_ALLOC_BYTES, size);
   return tmp;
 }
 
@@ -45,6 +71,8 @@ char *strdupe(char *buf)
   char *b = strdup(buf);
   if(!b) throw(E_NOMEM, NULL);
   resource(b, free);
+  STAT(ST_ALLOCS, 1);
+  STAT(ST_ALLOC_BYTES, strlen(b) + 1);
   return b;
 }
 
@@ -60,6 +88,20 @@ unsigned int seprintf(char *buf, unsigned int max, char *fmt, ...)
   return (unsigned int)len;
 }
 
+/* Close a gzip file, counting the compressed bytes it read or wrote. */
+static void gzf_close(void *f)
+{
+  long int offset;
+
+  if(!stats_on) {
+    gzclose(f);
+    return;
+  }
+  offset = gzoffset(f);
+  gzclose(f);
+  stats_gzclose(f, offset);
+}
+
 gzFile *gzf_open(char *file, char *mode)
 {
   gzFile *f = gzopen(file, mode);
@@ -67,7 +109,8 @@ gzFile *gzf_open(char *file, char *mode)
     if(errno) throw(E_FACCESS, file);
     else throw(E_NOMEM, NULL);
   }
-  resource(f, (resource_handler)gzclose);
+  resource(f, gzf_close);
+  if(stats_on) stats_gzopen(f, file, mode);
   return f;
 }
 
@@ -75,6 +118,7 @@ unsigned int gzf_write(gzFile *f, void *buf, unsigned int max)
 {
   unsigned int len = gzwrite(f, buf, max);
   if(!len && max != len) throw(E_GZFIOERR, f);
+  STAT(ST_GZ_WRITTEN, len);
   return len;
 }
 
@@ -82,6 +126,7 @@ unsigned int gzf_read(gzFile *f, void *buf, unsigned int max)
 {
   int len = gzread(f, buf, max);
   if(len < 0) throw(E_GZFIOERR, f);
+  STAT(ST_GZ_READ, len);
   return (unsigned int)len;
 }
 
@@ -89,6 +134,7 @@ unsigned int gzf_putl(gzFile *f, char *buf)
 {
   int len = gzputs(f, buf);
   if(len < 0) throw(E_GZFIOERR, f);
+  STAT(ST_GZ_WRITTEN, len);
   return (unsigned int)len;
 }
 
@@ -96,5 +142,47 @@ char *gzf_getl(gzFile *f, void *buf, unsigned int max)
 {
   char *b = gzgets(f, buf, max);
   if(b == Z_NULL && !gzeof(f)) throw(E_GZFIOERR, f);
+  if(b) STAT(ST_GZ_READ, strlen(b));
   return b;
 }
+
+/* Inflate a whole gzip file which has already been read, as gzread would: *
+ * Any number of members, or text which isn't compressed at all.          */
+char *gzb_inflate(char *raw, unsigned long len, char *file)
+{
+  unsigned long size = 2 * len + BUFSIZ, pos = 0;
+  char *out = alloc(size);
+  z_stream z;
+  int ret = Z_OK;
+
+  if(len < 2 || (unsigned char)raw[0] != 0x1f || (unsigned char)raw[1] != 0x8b) {
+    memcpy(out, raw, len);
+    out[len] = '\0';
+    return out;
+  }
+
+  memset(&z, 0, sizeof(z));
+  if(inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) throw(E_NOMEM, NULL);
+  z.next_in  = (Bytef*)raw;
+  z.avail_in = len;
+
+  while(z.avail_in) {
+    if(size - pos - 1 < BUFSIZ) out = ralloc(out, size *= 2);
+    z.next_out  = (Bytef*)out + pos;
+    z.avail_out = size - pos - 1;
+    ret = inflate(&z, Z_NO_FLUSH);
+    pos = size - 1 - z.avail_out;
+
+    /* Appending to a file starts another member. */
+    if(ret == Z_STREAM_END) {
+      if(z.avail_in < 2 || z.next_in[0] != 0x1f || z.next_in[1] != 0x8b) break;
+      inflateReset(&z);
+    } else if(ret != Z_OK && ret != Z_BUF_ERROR) break;
+  }
+  inflateEnd(&z);
+
+  if(ret != Z_STREAM_END) throw(E_INVAL, file);
+  STAT(ST_GZ_READ, pos);
+  out[pos] = '\0';
+  return out;
+}
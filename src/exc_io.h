@@ -6,6 +6,7 @@
 
 FILE *raw_open(char *file, char *mode);
 char* raw_getl(FILE *f, char *buf, unsigned int max);
+int raw_readall(char **files, unsigned int n, char **bufs, long int *lens);
 
 void *alloc(unsigned int size);
 void *ralloc(void *buf, unsigned int size);
@@ -18,5 +19,6 @@ unsigned int gzf_write(gzFile *f, void *buf, unsigned int max);
 unsigned int gzf_read(gzFile *f, void *buf, unsigned int max);
 unsigned int gzf_putl(gzFile *f, char *buf);
 char *gzf_getl(gzFile *f, void *buf, unsigned int max);
+char *gzb_inflate(char *raw, unsigned long len, char *file);
 
 #endif
@@ -3,7 +3,7 @@
 #include "except.h"
 
 /* Modify this to suit your context model. Be sure to initialize it. */
-struct exception_context the_exception_context[1] = {
+THREAD_LOCAL struct exception_context the_exception_context[1] = {
   {NULL, NULL, {E_NONE, NULL}, 0}
 };
 
@@ -32,10 +32,11 @@ void resource(void *r, void (*f)(void *))
   if(the_exception_context->last) the_exception_context->last->resources++;
 }
 
-void release_pop(void *r, unsigned int rel)
+static resource_handler unlink_pop(void *r, unsigned int rel)
 {
   /* Release a resource from the current lexical state. */
   struct resource__state *last = NULL, *res;
+  resource_handler handler;
   struct exception__state *state = the_exception_context->last;
   unsigned int count;
 
@@ -61,7 +62,20 @@ void release_pop(void *r, unsigned int rel)
   else the_exception_context->alloc = res->next;
   if(state) state->resources--;
   if(rel) res->rel(res->res);
+  handler = res->rel;
   free(res);
+  return handler;
+}
+
+void release_pop(void *r, unsigned int rel)
+{
+  unlink_pop(r, rel);
+}
+
+resource_handler disown(void *r)
+{
+  /* Forget a resource without releasing it, for handing to another thread. */
+  return unlink_pop(r, 0);
 }
 
 void throw(enum EXCEPTION_TYPE type, void *value)
@@ -101,4 +115,5 @@ void release_all()
     temp = res->next;
     free(res);
   }
+  the_exception_context->alloc = NULL;
 }
@@ -14,7 +14,14 @@ Cosmin Truta <cosmin@cs.toronto.edu>.
     responsible for any damage resulting from its use.
 
 Modified (hacked) by Brendan MacDonell 05/11/2007 to provide simple
-exceptions to single-threaded programs. For the original version, see
+exceptions with automatic resource management. The context is per-thread
+(THREAD_LOCAL): Each thread has its own stack of try blocks and list of
+resources, a throw only unwinds the try blocks of its own thread, and it
+releases only the resources which that thread registered since the try
+began. A resource which must outlive the try it was made in, such as one
+handed to another thread or kept in a static cache, is disown()ed first,
+after which it is the holder's to free (or to register again).
+For the original version, see
 
     http://cexcept.sourceforge.net
 
@@ -118,8 +125,17 @@ struct exception_context {
 /* rather than jump into the loop using a switch statement, to        */
 /* appease compilers that warn about jumping into loops.              */
 
+/* Storage class for per-thread data; Each thread has its own context. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 /* Alter this to suit your context model. */
-extern struct exception_context the_exception_context[1];
+extern THREAD_LOCAL struct exception_context the_exception_context[1];
 
 void init_exception_context(struct exception_context *e);
 void resource(void *r, void (*f)(void *));
@@ -130,4 +146,9 @@ void throw(enum EXCEPTION_TYPE t, void *value);
 
 typedef void (*resource_handler)(void *);
 
+/* Resources belong to the thread which registered them. To hand one to *
+ * another thread, disown it, pass the pointer and handler across, and  *
+ * register it again with resource() from the receiving thread.         */
+resource_handler disown(void *r);
+
 #endif /* CEXCEPT_H */
@@ -0,0 +1,158 @@
+/*
+ * ntx count and ntx facets: How many notes have some tags, and of those,
+ * how many have each other tag.
+ *
+ * Only the IDs of the notes selected are kept. Their tags are then read
+ * from just the refs buckets which hold one of them, so the counts cost
+ * the selection and those buckets, without formatting a single summary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "hash_table.h"
+#include "ntx.h"
+
+struct facet { /* A tag, and the number of the notes selected which have it. */
+  char *tag;
+  unsigned int count;
+};
+
+static unsigned long hash_facet(void *v)
+{
+  char *tag = ((struct facet*)v)->tag;
+  return hasht_hash(tag, strlen(tag), 0);
+}
+
+static unsigned long hash_tag(void *v)
+{
+  return hasht_hash(v, strlen(v), 0);
+}
+
+static int cmp_facet(void *a, void *b)
+{
+  return strcmp(((struct facet*)a)->tag, ((struct facet*)b)->tag);
+}
+
+static int cmp_tag(void *a, void *b)
+{
+  return strcmp(((struct facet*)a)->tag, b);
+}
+
+/* The most common first, then by name. */
+static int ntx_sortfacet(const void *a, const void *b)
+{
+  const struct facet *x = *(struct facet**)a, *y = *(struct facet**)b;
+
+  if(x->count != y->count) return (x->count < y->count) - (x->count > y->count);
+  return strcmp(x->tag, y->tag);
+}
+
+/* The lines of the notes with every tag, as ntx list finds them; A view *
+ * (@name) or the index stand in for a single tag, or none.             */
+static char *ntx_facetselect(char **tags, unsigned int tagc)
+{
+  char file[FILE_MAX], *buf = NULL;
+  exception_t exc;
+
+  if(tagc > 127) die("Too many (more than 127) tags.");
+  if(tagc > 1 || (tagc == 1 && **tags != '@')) return ntx_select(tags, tagc);
+
+  if(tagc == 0) seprintf(file, FILE_MAX, INDEX_FILE);
+  else if(!view_file(*tags + 1, file)) *file = '\0';
+
+  if(*file) {
+    try buf = ntx_buffer(file);
+    catch(exc) if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+  }
+  if(!buf) {
+    buf = alloc(1);
+    *buf = '\0';
+  }
+  return buf;
+}
+
+void ntx_count(char **tags, unsigned int tagc)
+{
+  char *result = ntx_facetselect(tags, tagc);
+
+  out_count(ntx_lines(result, tagc ? TAGS_DIR : INDEX_FILE), NULL);
+  release(result);
+}
+
+/* Print how many of the notes with every tag have each other tag. */
+void ntx_facets(char **tags, unsigned int tagc)
+{
+  char file[FILE_MAX], *result, *buf, *line, *end, *tag, *next;
+  unsigned char *sel, buckets[256];
+  unsigned int id, i, n;
+  struct facet **sorted, *f;
+  hash_t *facets;
+
+  sel = alloc(65536 / 8);
+  memset(sel, 0, 65536 / 8);
+  memset(buckets, 0, sizeof(buckets));
+
+  /* Keep just the IDs of the notes selected. */
+  result = ntx_facetselect(tags, tagc);
+  for(line = result; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, TAGS_DIR);
+    id = strtol(line, NULL, 16) & 0xffff;
+    sel[id / 8] |= 1 << (id % 8);
+    buckets[id >> 8] = 1;
+  }
+  release(result);
+
+  facets = hasht_init(64, free, hash_facet, hash_tag,
+                      cmp_facet, cmp_tag);
+  if(!facets) throw(E_NOMEM, NULL);
+  resource(facets, (resource_handler)hasht_free);
+
+  /* Count the tags of those notes, from the buckets which hold them. */
+  for(i = 0; i < 256; i++) {
+    if(!buckets[i]) continue;
+    seprintf(file, FILE_MAX, REFS_DIR"/%02x", i);
+    buf = ntx_buffer(file);
+
+    for(line = buf; *line; line = end + 1) {
+      if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+      id = strtol(line, NULL, 16) & 0xffff;
+      if(end - line < SUMMARY_OFFSET || !(sel[id / 8] & (1 << (id % 8))))
+        continue;
+
+      *end = '\0';
+      for(tag = line + SUMMARY_OFFSET; *tag; tag = next) {
+        if((next = strchr(tag, *FIELD_SEP))) *next++ = '\0';
+        else next = tag + strlen(tag);
+
+        if(!(f = hasht_get(facets, tag))) {
+          /* The name follows the facet, so the two are freed at once. */
+          if(!(f = malloc(sizeof(struct facet) + strlen(tag) + 1)))
+            throw(E_NOMEM, NULL);
+          f->tag = (char*)(f + 1);
+          strcpy(f->tag, tag);
+          f->count = 0;
+          hasht_add(facets, f);
+        }
+        f->count++;
+      }
+    }
+    release(buf);
+  }
+
+  /* The tags asked for are had by every note, so are left out. */
+  sorted = alloc((facets->used ? facets->used : 1) * sizeof(struct facet *));
+  for(n = 0; (f = hasht_next(facets)); ) {
+    for(i = 0; i < tagc && strcmp(f->tag, tags[i]); i++);
+    if(i == tagc) sorted[n++] = f;
+  }
+  qsort(sorted, n, sizeof(struct facet *), ntx_sortfacet);
+  out_begin();
+  for(i = 0; i < n; i++) out_count(sorted[i]->count, sorted[i]->tag);
+
+  release(sorted);
+  release(facets);
+  release(sel);
+}
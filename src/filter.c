@@ -0,0 +1,241 @@
+/*
+ * Bloom filters of the tag files, to rule notes out of an intersection.
+ *
+ * FILTERS_DIR/<tag> starts with a line giving the checksum and length of
+ * tags/<tag> when the filter was written, as recorded in the manifest, the
+ * number of notes added and the size of the filter in bits; The bits
+ * follow. A filter is only used while its tag file is exactly as it was,
+ * so a store written by an older ntx is never misread; One which is stale
+ * is rebuilt from its tag file by the next change to that tag.
+ *
+ * Removing a note leaves its bits set, which can only let through more
+ * notes for the tag files to reject; ntx reindex rebuilds every filter.
+ * Filters are sized to a power of two, so a larger one can be folded in
+ * half until it matches a smaller, and the two compared bit by bit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "stats.h"
+#include "ntx.h"
+
+/* Bits per note, and bits set by each; About one note in 400 gets past. */
+#define FILTER_BITS   16
+#define FILTER_HASHES 4
+
+/* Bounds on the size of a filter, in bits. */
+#define FILTER_MIN    512
+#define FILTER_MAX    (1UL << 20)
+
+#define FILTER_HEADER 64
+
+/* Mix the bits of an ID, so that consecutive IDs are spread apart. */
+static unsigned long filter_hash(unsigned int id)
+{
+  unsigned long h = id + 0x9e3779b9UL;
+
+  h = ((h ^ (h >> 16)) * 0x85ebca6bUL) & 0xffffffffUL;
+  h = ((h ^ (h >> 13)) * 0xc2b2ae35UL) & 0xffffffffUL;
+  return h ^ (h >> 16);
+}
+
+static unsigned long filter_size(unsigned int count)
+{
+  unsigned long bits = FILTER_MIN;
+
+  /* Leave room for the tag to double before it must be rebuilt. */
+  while(bits < FILTER_MAX && bits < 2UL * FILTER_BITS * count) bits *= 2;
+  return bits;
+}
+
+static void filter_set(struct filter *f, unsigned int id)
+{
+  unsigned long h = filter_hash(id), step = (h >> 16) | 1, i, bit;
+
+  for(i = 0; i < FILTER_HASHES; i++, h += step) {
+    bit = h & (f->bits - 1);
+    f->map[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+/* Test whether a note may be in the tag; 0 if it certainly isn't. */
+int filter_test(struct filter *f, unsigned int id)
+{
+  unsigned long h = filter_hash(id), step = (h >> 16) | 1, i, bit;
+
+  for(i = 0; i < FILTER_HASHES; i++, h += step) {
+    bit = h & (f->bits - 1);
+    if(!(f->map[bit / 8] & (1 << (bit % 8)))) return 0;
+  }
+  return 1;
+}
+
+/* Load the filter of 'tag' before it is changed. It is marked invalid *
+ * if it is missing, or out of date with the tag file.                 */
+struct filter *filter_begin(char *tag)
+{
+  struct filter *f = alloc(sizeof(struct filter));
+  char file[FILE_MAX], head[FILTER_HEADER];
+  unsigned long crc, len;
+  exception_t exc;
+  FILE *in = NULL;
+
+  seprintf(f->tag, FILE_MAX, TAGS_DIR"/%s", tag);
+  f->map   = NULL;
+  f->valid = 0;
+  f->count = 0;
+  f->bits  = 0;
+
+  seprintf(file, FILE_MAX, FILTERS_DIR"/%s", tag);
+  try in = raw_open(file, "rb");
+  catch(exc) return f; /* A missing filter is just rebuilt. */
+
+  if(raw_getl(in, head, FILTER_HEADER) &&
+     sscanf(head, "%lx %lu %u %lu", &f->crc, &f->len, &f->count, &f->bits) == 4 &&
+     f->bits >= FILTER_MIN && f->bits <= FILTER_MAX &&
+     !(f->bits & (f->bits - 1)) &&
+     manifest_lookup(f->tag, &crc, &len) && crc == f->crc && len == f->len &&
+     ntx_flen(f->tag) == (long)len) {
+    f->map = alloc(f->bits / 8);
+    if(fread(f->map, 1, f->bits / 8, in) == f->bits / 8) f->valid = 1;
+    STAT(ST_RAW_READ, f->bits / 8);
+  }
+  release(in);
+  return f;
+}
+
+/* Fill in a filter from every note of its tag file. */
+static void filter_build(struct filter *f)
+{
+  char *buf, *line;
+  unsigned int count = 0;
+
+  buf = ntx_buffer(f->tag);
+  for(line = buf; *line; line = strchr(line, '\n') + 1, count++)
+    if(!strchr(line, '\n')) throw(E_INVAL, f->tag);
+
+  if(f->map) release(f->map);
+  f->count = count;
+  f->bits  = filter_size(count);
+  f->map   = alloc(f->bits / 8);
+  memset(f->map, 0, f->bits / 8);
+
+  for(line = buf; *line; line = strchr(line, '\n') + 1)
+    filter_set(f, strtol(line, NULL, 16) & 0xffff);
+  release(buf);
+}
+
+/* Write a filter, stamped with its tag file as it now is. */
+static void filter_write(struct filter *f, char *file)
+{
+  char tmp[FILE_MAX];
+  unsigned long crc, len;
+  FILE *out;
+  int err;
+
+  if(!manifest_lookup(f->tag, &crc, &len)) return;
+  seprintf(tmp, FILE_MAX, "%s.new", file);
+
+  out = raw_open(tmp, "wb");
+  fprintf(out, "%08lx %lu %u %lu\n", crc, len, f->count, f->bits);
+  fwrite(f->map, 1, f->bits / 8, out);
+  err = fflush(out) != 0 || ferror(out);
+  release(out);
+
+  if(err || rename(tmp, file) != 0) remove(tmp);
+}
+
+/* Note that the note 'id' has been added to the tag of 'f', before *
+ * filter_end; For adding several at once.                         */
+void filter_add(struct filter *f, unsigned int id)
+{
+  if(!f->valid) return;
+  filter_set(f, id);
+  f->count++;
+}
+
+/* Finish a change to the tag of 'f', having added the note 'id' if it is *
+ * not NULL. Filters which were invalid, or are now too full, are rebuilt *
+ * from the tag file. As the tag file has already been written, failing   *
+ * to keep its filter just leaves it stale.                               */
+void filter_end(struct filter *f, char *id)
+{
+  char file[FILE_MAX];
+  exception_t exc;
+
+  seprintf(file, FILE_MAX, FILTERS_DIR"/%s", f->tag + strlen(TAGS_DIR) + 1);
+  /* The tag file is removed along with its last note. */
+  try ntx_flen(f->tag);
+  catch(exc) if(exc.type == E_FACCESS) {
+    remove(file);
+    filter_free(f);
+    return;
+  }
+
+  try {
+    if(ntx_mkdir(FILTERS_DIR) == 0) {
+      if(f->valid && id) {
+        filter_set(f, strtol(id, NULL, 16) & 0xffff);
+        f->count++;
+      }
+      if(!f->valid || f->count * FILTER_BITS > f->bits) filter_build(f);
+      filter_write(f, file);
+    }
+  } catch(exc) remove(file);
+
+  filter_free(f);
+}
+
+void filter_free(struct filter *f)
+{
+  if(f->map) release(f->map);
+  release(f);
+}
+
+/* Write the filter of a tag from its notes, as ntx reindex does. */
+void filter_write_ids(char *tag, unsigned short *ids, unsigned int count)
+{
+  struct filter f;
+  char file[FILE_MAX];
+  unsigned int i;
+
+  seprintf(f.tag, FILE_MAX, TAGS_DIR"/%s", tag);
+  seprintf(file, FILE_MAX, FILTERS_DIR"/%s", tag);
+  f.count = count;
+  f.bits  = filter_size(count);
+  f.map   = alloc(f.bits / 8);
+  memset(f.map, 0, f.bits / 8);
+
+  for(i = 0; i < count; i++) filter_set(&f, ids[i]);
+  filter_write(&f, file);
+  release(f.map);
+}
+
+/* Check whether the tags of every filter could share a note at all, by *
+ * folding each down to the size of the smallest and comparing them.    */
+int filter_disjoint(struct filter **fs, unsigned int n)
+{
+  unsigned long bits = FILTER_MAX, i, j, b;
+  unsigned char *and, *fold;
+  int empty = 1;
+
+  for(i = 0; i < n; i++) if(fs[i]->bits < bits) bits = fs[i]->bits;
+  and  = alloc(bits / 8);
+  fold = alloc(bits / 8);
+  memset(and, 0xff, bits / 8);
+
+  for(i = 0; i < n; i++) {
+    memset(fold, 0, bits / 8);
+    for(j = 0; j < fs[i]->bits / 8; j += bits / 8)
+      for(b = 0; b < bits / 8; b++) fold[b] |= fs[i]->map[j + b];
+    for(b = 0; b < bits / 8; b++) and[b] &= fold[b];
+  }
+
+  for(b = 0; b < bits / 8 && empty; b++) if(and[b]) empty = 0;
+  release(fold);
+  release(and);
+  return empty;
+}
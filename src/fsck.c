@@ -0,0 +1,322 @@
+/*
+ * ntx fsck: Check that the index, tags, refs and notes agree.
+ *
+ * Every derived file is loaded and checksummed at once on the task
+ * scheduler, while the notes are summarized. The relationships between
+ * them are then checked with a hash of every (tag, note) pair named by
+ * the refs, against which each tag file is compared. Repairs keep every
+ * tag a note is found with, in either its refs or a tag file, and then
+ * rebuild the derived files with ntx reindex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <zlib.h>
+#include "except.h"
+#include "exc_io.h"
+#include "hash_table.h"
+#include "sched.h"
+#include "ntx.h"
+
+/* Number of notes to summarize per task. */
+#define SUMMARY_GRAIN 64
+
+/* Flags for where each note has been found. */
+#define IN_INDEX 1
+#define IN_REFS  2
+
+struct dfile { /* A derived file, loaded and checksummed on a worker thread. */
+  char path[FILE_MAX];
+  char *buf;
+  unsigned long crc, len;
+  exception_t exc;
+};
+
+struct fnote {
+  char id[ID_LENGTH + 1];
+  char summary[SUMMARY_LENGTH + PADDING_LENGTH];
+  enum EXCEPTION_TYPE err;
+  unsigned int flags;
+};
+
+struct pair { /* A note and one of its tags, as named by its refs. */
+  char *tag, *id;
+  unsigned int seen;
+};
+
+static struct fnote *fnotes;
+static unsigned int problems = 0;
+
+void ntx_problem(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  putchar('\n');
+  problems++;
+}
+
+unsigned long hash_pair(void *v)
+{
+  struct pair *p = v;
+  return hasht_hash(p->id, ID_LENGTH, hasht_hash(p->tag, strlen(p->tag), 0));
+}
+
+int cmp_pair(void *a, void *b)
+{
+  return strncmp(((struct pair*)a)->id, ((struct pair*)b)->id, ID_LENGTH) ||
+         strcmp(((struct pair*)a)->tag, ((struct pair*)b)->tag);
+}
+
+void ntx_loadfile(void *v)
+{
+  struct dfile *d = v;
+
+  d->buf = NULL;
+  d->exc.type = E_NONE;
+
+  try {
+    ntx_checksum(d->path, 0, &d->crc, &d->len);
+    d->buf = ntx_buffer(d->path);
+    disown(d->buf);
+  } catch(d->exc) d->buf = NULL;
+}
+
+void ntx_fsummarize(void *v, unsigned int lo, unsigned int hi)
+{
+  char file[FILE_MAX];
+  exception_t exc;
+
+  for(; lo < hi; lo++) {
+    fnotes[lo].err = E_NONE;
+    try {
+      seprintf(file, FILE_MAX, NOTES_DIR"/%s", fnotes[lo].id);
+      note_summary(file, fnotes[lo].summary);
+    } catch(exc) fnotes[lo].err = exc.type;
+  }
+}
+
+/* Split off the next line of a buffer, and check its ID; Returns the *
+ * note it names, if it exists, with 'line' advanced past the line.   */
+struct fnote *ntx_nextline(char **line, char **rest, char *file,
+                           unsigned int *found)
+{
+  char *end, id[ID_LENGTH + 1];
+  unsigned int n;
+
+  if((end = strchr(*line, '\n'))) *end++ = '\0';
+  else {
+    ntx_problem("%s: The last line is unterminated.", file);
+    end = *line + strlen(*line);
+  }
+  *rest = end;
+
+  if(strlen(*line) < SUMMARY_OFFSET || (*line)[ID_LENGTH] != ID_SEP) {
+    ntx_problem("%s: Malformed line '%s'.", file, *line);
+    return NULL;
+  }
+
+  strncpy(id, *line, ID_LENGTH);
+  id[ID_LENGTH] = '\0';
+  if(!ntx_isid(id)) {
+    ntx_problem("%s: Malformed ID '%s'.", file, id);
+    return NULL;
+  }
+  if(!(n = found[strtol(id, NULL, 16)])) {
+    ntx_problem("%s: Note %s has no note file.", file, id);
+    return NULL;
+  }
+  return fnotes + n - 1;
+}
+
+/* Check the summary of an index or tag file line against its note. */
+void ntx_checksummary(char *line, struct fnote *n, char *file)
+{
+  unsigned int len = strlen(n->summary) - 1; /* Less the newline. */
+
+  if(n->err != E_NONE) return;
+  if(strlen(line + SUMMARY_OFFSET) != len ||
+     strncmp(line + SUMMARY_OFFSET, n->summary, len))
+    ntx_problem("%s: The summary of note %s is stale.", file, n->id);
+}
+
+void ntx_fsck(int repair)
+{
+  struct dfile *files;
+  struct fnote *n;
+  struct pair *pairs, key, *p;
+  hash_t *table;
+  exception_t exc;
+  n_dir dir;
+  char *name, *line, *end, *tok, *state, *path;
+  unsigned int *found, nfiles = 0, fsize = 512, count = 0;
+  unsigned int npairs = 0, unrecorded = 0, i;
+  unsigned short *ids;
+  unsigned long crc, len;
+
+  /* Find every note, packed or not, and every derived file. */
+  dir = ntx_dopen(NOTES_DIR);
+  while((name = ntx_dread(dir)))
+    if(name[0] != '.' && !ntx_isid(name))
+      ntx_problem(NOTES_DIR"/%s: Not a note.", name);
+  ntx_dclose(dir);
+
+  ids = note_ids(&count);
+  fnotes = alloc((count ? count : 1) * sizeof(struct fnote));
+  for(i = 0; i < count; i++) {
+    seprintf(fnotes[i].id, ID_LENGTH + 1, "%04x", ids[i]);
+    fnotes[i].flags = 0;
+  }
+  release(ids);
+
+  files = alloc(fsize * sizeof(struct dfile));
+  strcpy(files[nfiles++].path, INDEX_FILE);
+  for(i = 0; i < 2; i++) {
+    dir = ntx_dopen(i ? REFS_DIR : TAGS_DIR);
+    while((name = ntx_dread(dir))) {
+      if(name[0] == '.') continue;
+      if(nfiles == fsize)
+        files = ralloc(files, (fsize *= 2) * sizeof(struct dfile));
+      seprintf(files[nfiles++].path, FILE_MAX, "%s/%s",
+               i ? REFS_DIR : TAGS_DIR, name);
+    }
+    ntx_dclose(dir);
+  }
+
+  /* Load everything at once. */
+  sched_for(0, count, SUMMARY_GRAIN, ntx_fsummarize, NULL);
+  sched_each(ntx_loadfile, files, sizeof(struct dfile), nfiles);
+
+  found = alloc(65536 * sizeof(unsigned int));
+  memset(found, 0, 65536 * sizeof(unsigned int));
+  for(i = 0; i < count; i++) {
+    found[strtol(fnotes[i].id, NULL, 16)] = i + 1;
+    if(fnotes[i].err == E_INVAL)
+      ntx_problem(NOTES_DIR"/%s: The note is empty.", fnotes[i].id);
+    else if(fnotes[i].err != E_NONE)
+      ntx_problem(NOTES_DIR"/%s: The note is unreadable.", fnotes[i].id);
+  }
+
+  for(i = 0; i < nfiles; i++) {
+    if(files[i].buf) resource(files[i].buf, free);
+    if(files[i].exc.type == E_FACCESS && i == 0) continue; /* No notes. */
+    if(files[i].exc.type != E_NONE)
+      ntx_problem("%s: The file is unreadable.", files[i].path);
+    else if(!manifest_lookup(files[i].path, &crc, &len)) unrecorded++;
+    else if(crc != files[i].crc || len != files[i].len)
+      ntx_problem("%s: The file does not match its checksum.", files[i].path);
+  }
+
+  /* Files which were recorded, but are gone. */
+  while((path = manifest_next())) {
+    try ntx_flen(path);
+    catch(exc) ntx_problem("%s: The file is missing.", path);
+  }
+
+  /* Check the index against the notes. */
+  for(line = files[0].buf; line && *line; line = end) {
+    if(!(n = ntx_nextline(&line, &end, INDEX_FILE, found))) continue;
+    if(n->flags & IN_INDEX)
+      ntx_problem(INDEX_FILE": Note %s is listed twice.", n->id);
+    n->flags |= IN_INDEX;
+    ntx_checksummary(line, n, INDEX_FILE);
+  }
+
+  /* Collect every (tag, note) pair named by the refs. */
+  for(i = 1; i < nfiles; i++) {
+    if(strncmp(files[i].path, REFS_DIR"/", strlen(REFS_DIR) + 1)) continue;
+    for(line = files[i].buf, npairs++; line && *line; line++)
+      if(*line == *FIELD_SEP || *line == '\n') npairs++;
+  }
+  pairs = alloc((npairs ? npairs : 1) * sizeof(struct pair));
+  table = hasht_init(npairs, NULL, hash_pair, hash_pair, cmp_pair, cmp_pair);
+  if(!table) throw(E_NOMEM, NULL);
+  resource(table, (resource_handler)hasht_free);
+
+  for(npairs = 0, i = 1; i < nfiles; i++) {
+    name = files[i].path + strlen(REFS_DIR) + 1;
+    if(strncmp(files[i].path, REFS_DIR"/", strlen(REFS_DIR) + 1)) continue;
+
+    for(line = files[i].buf; line && *line; line = end) {
+      if(!(n = ntx_nextline(&line, &end, files[i].path, found))) continue;
+      if(strncmp(n->id, name, 2) || strlen(name) != 2)
+        ntx_problem("%s: Note %s is in the wrong file.", files[i].path, n->id);
+      if(n->flags & IN_REFS)
+        ntx_problem("%s: Note %s is listed twice.", files[i].path, n->id);
+      n->flags |= IN_REFS;
+
+      for(tok = strrtok(line + SUMMARY_OFFSET, &state, FIELD_SEP);
+          tok != NULL;
+          tok = strrtok(NULL, &state, FIELD_SEP)) {
+        pairs[npairs].tag  = tok;
+        pairs[npairs].id   = n->id;
+        pairs[npairs].seen = 0;
+        if(!hasht_get(table, pairs + npairs))
+          hasht_add(table, pairs + npairs++);
+      }
+    }
+  }
+
+  for(i = 0; i < count; i++) {
+    if(!(fnotes[i].flags & IN_INDEX))
+      ntx_problem(INDEX_FILE": Note %s is missing.", fnotes[i].id);
+    if(!(fnotes[i].flags & IN_REFS))
+      ntx_problem(REFS_DIR"/%.2s: Note %s is missing.",
+                  fnotes[i].id, fnotes[i].id);
+  }
+
+  /* Compare each tag file with the pairs. */
+  for(i = 1; i < nfiles; i++) {
+    if(strncmp(files[i].path, TAGS_DIR"/", strlen(TAGS_DIR) + 1)) continue;
+    key.tag = files[i].path + strlen(TAGS_DIR) + 1;
+
+    for(line = files[i].buf; line && *line; line = end) {
+      if(!(n = ntx_nextline(&line, &end, files[i].path, found))) continue;
+      ntx_checksummary(line, n, files[i].path);
+
+      key.id = n->id;
+      if(!(p = hasht_get(table, &key))) {
+        ntx_problem("%s: Note %s is not tagged %s in "REFS_DIR"/%.2s.",
+                    files[i].path, n->id, key.tag, n->id);
+
+        /* Keep the tag when repairing, by adding it to the refs. */
+        if(repair) {
+          char ref[FILE_MAX], tags[FILE_MAX];
+
+          seprintf(ref, FILE_MAX, REFS_DIR"/%.2s", n->id);
+          seprintf(tags, FILE_MAX, "%s%c%s%s\n",
+                   n->id, ID_SEP, key.tag, FIELD_SEP);
+          ntx_append(ref, tags);
+        }
+      } else if(p->seen++)
+        ntx_problem("%s: Note %s is listed twice.", files[i].path, n->id);
+    }
+  }
+
+  for(i = 0; i < npairs; i++)
+    if(!pairs[i].seen)
+      ntx_problem(TAGS_DIR"/%s: Note %s is missing.", pairs[i].tag, pairs[i].id);
+
+  release(table);
+  release(pairs);
+  release(found);
+  for(i = 0; i < nfiles; i++) if(files[i].buf) release(files[i].buf);
+  release(files);
+  release(fnotes);
+
+  if(repair && (problems || unrecorded)) {
+    ntx_reindex();
+    if(problems) printf("Repaired %u problems.\n", problems);
+  } else if(problems) {
+    fflush(stdout);
+    die("%u problems found; Run 'ntx fsck --repair' to repair them.",
+        problems);
+  } else if(unrecorded) {
+    printf("%u files have no checksum; 'ntx fsck --repair' records them.\n",
+           unrecorded);
+  }
+}
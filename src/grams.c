@@ -0,0 +1,333 @@
+/*
+ * ntx find: Find the notes whose summaries contain some text, or nearly.
+ *
+ * Every trigram of each summary, in lower case, is posted as a line of
+ * the trigram and the note's ID to one of the GRAMS_BUCKETS files of
+ * GRAMS_DIR, chosen by a hash of the trigram. A search reads just the
+ * buckets of the trigrams of its text, and only the notes with enough of
+ * them are checked against their summaries: All of them to contain the
+ * text, or for a fuzzy search, as many as q-grams allow within 'k' edits
+ * (a summary within k edits shares at least (m - 2) - 3k of the m - 2
+ * trigrams of the text). Text too short for that is checked against
+ * every summary.
+ *
+ * Postings are only ever appended, by add and by an edit which changes a
+ * summary; As candidates are checked against their current summaries,
+ * postings left by an old summary or a removed note only cost a check.
+ * The index is built by the first ntx find, and ntx reindex rebuilds it
+ * without them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "except.h"
+#include "exc_io.h"
+#include "ntx.h"
+
+#define GRAMS_BUCKETS 256
+
+/* A posting, as the trigram and the ID in hex. */
+#define GRAMS_POSTING 11
+
+/* More candidates than this are checked by reading the index instead. */
+#define GRAMS_SCAN    256
+
+/* Edits allowed by --fuzzy, unless told otherwise. */
+#define GRAMS_FUZZY   1
+
+static unsigned int grams_bucket(unsigned long tri)
+{
+  return ((tri * 2654435761UL) & 0xffffffffUL) >> 24;
+}
+
+/* The distinct trigrams of a string in lower case, and how often each *
+ * occurs if 'weights' is given; Returns the number found.             */
+static unsigned int grams_split(char *s, unsigned int len,
+                                unsigned long *tris, unsigned int *weights)
+{
+  unsigned long tri;
+  unsigned int i, k, n = 0;
+
+  for(i = 0; i + 3 <= len; i++) {
+    tri = (unsigned long)tolower((unsigned char)s[i]) << 16 |
+          tolower((unsigned char)s[i + 1]) << 8 |
+          tolower((unsigned char)s[i + 2]);
+    for(k = 0; k < n && tris[k] != tri; k++);
+    if(k == n) {
+      tris[n] = tri;
+      if(weights) weights[n] = 0;
+      n++;
+    }
+    if(weights) weights[k]++;
+  }
+  return n;
+}
+
+/* The summary of a line of the index or a tag, and its length. */
+static char *grams_summary(char *line, unsigned int *len)
+{
+  char *end = strchr(line, '\n');
+
+  *len = (end ? end : line + strlen(line)) - line - SUMMARY_OFFSET;
+  return line + SUMMARY_OFFSET;
+}
+
+static int grams_exists(void)
+{
+  exception_t exc;
+  n_dir dir;
+
+  try dir = ntx_dopen(GRAMS_DIR);
+  catch(exc) return 0;
+  ntx_dclose(dir);
+  return 1;
+}
+
+/* Post the trigrams of a line of the index, if the index of them exists. */
+void grams_add(char *line)
+{
+  char file[FILE_MAX], *posts, *pos;
+  unsigned long tris[SUMREC_LENGTH];
+  unsigned int n, i, k, b, len;
+  char *summary;
+
+  if(!grams_exists()) return;
+  summary = grams_summary(line, &len);
+  n = grams_split(summary, len, tris, NULL);
+
+  /* Each bucket is appended to once; Trigrams posted are zeroed, as no *
+   * summary has a NUL.                                                 */
+  posts = alloc(n * GRAMS_POSTING + 1);
+  for(i = 0; i < n; i++) {
+    if(!tris[i]) continue;
+    b = grams_bucket(tris[i]);
+    for(pos = posts, k = i; k < n; k++) {
+      if(grams_bucket(tris[k]) != b) continue;
+      pos += seprintf(pos, GRAMS_POSTING + 1, "%06lx%.4s\n", tris[k], line);
+      tris[k] = 0;
+    }
+    seprintf(file, FILE_MAX, GRAMS_DIR"/%02x", b);
+    ntx_append(file, posts);
+  }
+  release(posts);
+}
+
+struct gram { /* A posting, for sorting by bucket. */
+  unsigned long tri;
+  unsigned short id;
+};
+
+static int grams_sort(const void *a, const void *b)
+{
+  const struct gram *x = a, *y = b;
+  unsigned int bx = grams_bucket(x->tri), by = grams_bucket(y->tri);
+
+  if(bx != by) return bx < by ? -1 : 1;
+  if(x->tri != y->tri) return x->tri < y->tri ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+/* Write the postings of every summary in the index afresh. */
+void grams_build(void)
+{
+  char file[FILE_MAX], post[GRAMS_POSTING + 1], *buf = NULL, *line, *end;
+  char *summary;
+  unsigned long tris[SUMREC_LENGTH];
+  unsigned int count, size = 4096, n, i, len;
+  struct gram *grams;
+  exception_t exc;
+  gzFile *out = NULL;
+
+  if(ntx_mkdir(GRAMS_DIR) != 0) throw(E_FACCESS, GRAMS_DIR);
+  for(i = 0; i < GRAMS_BUCKETS; i++) {
+    seprintf(file, FILE_MAX, GRAMS_DIR"/%02x", i);
+    remove(file);
+    manifest_update(file);
+  }
+
+  try buf = ntx_buffer(INDEX_FILE);
+  catch(exc) if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+  if(!buf) return; /* There are no notes yet. */
+
+  grams = alloc(size * sizeof(struct gram));
+  for(count = 0, line = buf; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, INDEX_FILE);
+    summary = grams_summary(line, &len);
+    n = grams_split(summary, len, tris, NULL);
+    if(count + n > size)
+      grams = ralloc(grams, (size = 2 * (count + n)) * sizeof(struct gram));
+    for(i = 0; i < n; i++) {
+      grams[count].tri = tris[i];
+      grams[count++].id = strtol(line, NULL, 16) & 0xffff;
+    }
+  }
+  release(buf);
+
+  /* Then each bucket, once. */
+  qsort(grams, count, sizeof(struct gram), grams_sort);
+  for(i = 0; i < count; i++) {
+    if(!out || grams_bucket(grams[i].tri) != grams_bucket(grams[i - 1].tri)) {
+      if(out) {
+        release(out);
+        manifest_update(file);
+      }
+      seprintf(file, FILE_MAX, GRAMS_DIR"/%02x", grams_bucket(grams[i].tri));
+      out = gzf_open(file, "w");
+    }
+    len = seprintf(post, GRAMS_POSTING + 1, "%06lx%04x\n",
+                   grams[i].tri, grams[i].id);
+    gzf_write(out, post, len);
+  }
+  if(out) {
+    release(out);
+    manifest_update(file);
+  }
+  release(grams);
+}
+
+/* Rebuild the postings if they have been built before, as reindex does. */
+void grams_rebuild(void)
+{
+  if(grams_exists()) grams_build();
+}
+
+/* Whether the summary contains the text, ignoring case, or comes within *
+ * 'k' edits of it somewhere if 'k' isn't negative (Sellers' algorithm). */
+static int grams_match(char *text, unsigned int m, char *s, unsigned int len,
+                       int k, unsigned int *cols)
+{
+  unsigned int i, j, diag, up, best;
+
+  if(k < 0) {
+    for(i = 0; i + m <= len; i++) {
+      for(j = 0; j < m && tolower((unsigned char)s[i + j]) == text[j]; j++);
+      if(j == m) return 1;
+    }
+    return 0;
+  }
+
+  /* cols[j]: The fewest edits to match the first j of the text so far. */
+  for(j = 0; j <= m; j++) cols[j] = j;
+  if(m <= (unsigned int)k) return 1;
+  for(i = 0; i < len; i++) {
+    for(diag = 0, j = 1; j <= m; j++) {
+      up   = cols[j];
+      best = diag + (tolower((unsigned char)s[i]) != text[j - 1]);
+      if(up + 1 < best) best = up + 1;
+      if(cols[j - 1] + 1 < best) best = cols[j - 1] + 1;
+      diag    = up;
+      cols[j] = best;
+    }
+    if(cols[m] <= (unsigned int)k) return 1;
+  }
+  return 0;
+}
+
+/* ntx find [--fuzzy[=k]] <text> [tags ..]: List the notes with 'tags' *
+ * whose summaries contain 'text', or come within 'k' edits of it.     */
+void ntx_search(char **args, unsigned int argc)
+{
+  char file[FILE_MAX], line[SUMREC_LENGTH];
+  char *text, *buf = NULL, *cur, *end, *out, *pos, *summary, *posts;
+  unsigned long tris[SUMREC_LENGTH], tri;
+  unsigned int weights[SUMREC_LENGTH], *cols, *hits;
+  unsigned int n, m, i, len, id, need = 0, count = 0, b;
+  unsigned char buckets[GRAMS_BUCKETS];
+  exception_t exc;
+  int k = -1, scan;
+
+  if(argc && !strncmp(*args, "--fuzzy", 7)) {
+    if((*args)[7] == '=') k = atoi(*args + 8);
+    else if((*args)[7] == '\0') k = GRAMS_FUZZY;
+    else die("Unknown option %s.", *args);
+    if(k < 0) die("Invalid number of edits %s.", *args + 8);
+    args++;
+    argc--;
+  }
+  if(!argc) die("Give the text to find.");
+  if(argc - 1 > 127) die("Too many (more than 127) tags.");
+
+  text = *args++;
+  argc--;
+  if((m = strlen(text)) >= SUMREC_LENGTH) m = SUMREC_LENGTH - 1;
+  text = strdupe(text);
+  for(i = 0; i < m; i++) text[i] = tolower((unsigned char)text[i]);
+  text[m] = '\0';
+  cols = alloc((m + 1) * sizeof(unsigned int));
+  hits = alloc(65536 * sizeof(unsigned int));
+  memset(hits, 0, 65536 * sizeof(unsigned int));
+
+  /* Enough of the trigrams to be worth reading, or else every summary. */
+  n = grams_split(text, m, tris, weights);
+  scan = m < 3 || (k >= 0 && (int)(m - 2) - 3 * k <= 0);
+  if(!scan) {
+    need = k < 0 ? m - 2 : m - 2 - 3 * k;
+    if(!grams_exists()) grams_build();
+
+    memset(buckets, 0, sizeof(buckets));
+    for(i = 0; i < n; i++) buckets[grams_bucket(tris[i])] = 1;
+    for(b = 0; b < GRAMS_BUCKETS; b++) {
+      if(!buckets[b]) continue;
+      seprintf(file, FILE_MAX, GRAMS_DIR"/%02x", b);
+      try posts = ntx_buffer(file);
+      catch(exc) {
+        if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+        continue; /* No summary has a trigram of this bucket. */
+      }
+
+      /* A note posted again by an edit may count twice; That only costs *
+       * a check of its summary.                                          */
+      for(cur = posts; *cur; cur = end + 1) {
+        if(!(end = strchr(cur, '\n')) || end - cur != GRAMS_POSTING - 1)
+          throw(E_INVAL, file);
+        id = strtol(cur + 6, NULL, 16) & 0xffff;
+        cur[6] = '\0';
+        tri = strtoul(cur, NULL, 16);
+        for(i = 0; i < n && tris[i] != tri; i++);
+        if(i < n) hits[id] += weights[i];
+      }
+      release(posts);
+    }
+    for(id = 0; id < 65536; id++) count += hits[id] >= need;
+  }
+
+  /* Check the candidates against the lines of the tags, or the index, or *
+   * just their own summaries if they are few.                            */
+  if(argc) buf = ntx_select(args, argc);
+  else if(scan || count > GRAMS_SCAN) {
+    try buf = ntx_buffer(INDEX_FILE);
+    catch(exc) if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+  } else {
+    buf = alloc(count * SUMREC_LENGTH + 1);
+    for(pos = buf, id = 0; id < 65536; id++) {
+      if(hits[id] < need) continue;
+      seprintf(file, FILE_MAX, NOTES_DIR"/%04x", id);
+      if(!note_exists(file)) continue; /* It has since been removed. */
+      seprintf(line, SUMREC_LENGTH, "%04x%c", id, ID_SEP);
+      note_summary(file, line + SUMMARY_OFFSET);
+      pos += seprintf(pos, SUMREC_LENGTH, "%s", line);
+    }
+    *pos = '\0';
+  }
+
+  out = alloc((buf ? strlen(buf) : 0) + 1);
+  for(pos = out, cur = buf; cur && *cur; cur = end + 1) {
+    if(!(end = strchr(cur, '\n'))) throw(E_INVAL, INDEX_FILE);
+    if(!scan && hits[strtol(cur, NULL, 16) & 0xffff] < need) continue;
+    summary = grams_summary(cur, &len);
+    if(!grams_match(text, m, summary, len, k, cols)) continue;
+    memcpy(pos, cur, end - cur + 1);
+    pos += end - cur + 1;
+  }
+  *pos = '\0';
+
+  out_begin();
+  out_notes(out);
+  release(out);
+  if(buf) release(buf);
+  release(hits);
+  release(cols);
+  release(text);
+}
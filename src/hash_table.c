@@ -29,7 +29,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "hash_table.h"
+#include "stats.h"
 
 /* Use 66% of the table, to keep clustering down, */
 #define GET_SIZE(entries) (entries*3/2)
@@ -47,7 +49,7 @@ unsigned int _get_next_pwr_of_two(unsigned int number)
 {
   unsigned int shift = 1, next = number - 1;
 
-  for(; shift < sizeof(next); shift *= 2)
+  for(; shift < sizeof(next) * CHAR_BIT; shift *= 2)
     next = next | next >> shift;
 
   return next + 1;
@@ -84,9 +86,10 @@ hash_t *hasht_init(unsigned int entries, void (*free_e)(void *),
     return NULL;
   }
 
-  table->deleted = 0;
-  table->used    = 0;
-  table->free    = free_e;
+  table->deleted  = 0;
+  table->used     = 0;
+  table->rehashes = 0;
+  table->free     = free_e;
   table->hash_e  = hash_e;
   table->hash_v  = hash_v;
   table->cmp_ee  = cmp_ee;
@@ -102,6 +105,9 @@ void hasht_free(hash_t *table)
   void **v = table->table;
   void (*free_e)(void *) = table->free;
 
+#ifdef HASHT_TRACE
+  hasht_print(table, stderr, "free");
+#endif
   size = table->size;
 
   if(free_e != NULL)
@@ -137,8 +143,17 @@ int hasht_rehash(hash_t *table, unsigned int factor)
     return -2;
   }
 
-  /* Reset the deletions counter. */
+#ifdef HASHT_TRACE
+  fprintf(stderr, "hasht %p: rehash %u -> %u (%s), %u used, %u deleted\n",
+          (void*)table, size, table->size, factor > 1 ? "grow" : "tombstones",
+          table->used, table->deleted);
+#endif
+
+  /* Reset the counters; hasht_add counts the entries back in. */
   table->deleted = 0;
+  table->used    = 0;
+  table->rehashes++;
+  STAT(ST_REHASHES, 1);
 
   for(i = 0; i < size; i++)
     if(v[i] != EMPTY && v[i] != DELETED)
@@ -169,6 +184,8 @@ void *hasht_add(hash_t *table, void *entry)
       /* loop forever */ ;
       i = (i + 1) & mask)
   {
+    STAT(ST_PROBES, 1);
+
     /* Insert a new value into the hash. */
     if(v[i] == EMPTY || v[i] == DELETED) {
       v[i] = entry;
@@ -197,6 +214,7 @@ void *hasht_get(hash_t *table, void *value)
       v[i] != EMPTY;
       i = (i + 1) & mask)
   {
+    STAT(ST_PROBES, 1);
     if(v[i] == DELETED)
       continue;
 
@@ -221,12 +239,16 @@ void *hasht_del(hash_t *table, void *value)
       v[i] != EMPTY;
       i = (i + 1) & mask)
   {
+    STAT(ST_PROBES, 1);
     if(v[i] == DELETED)
       continue;
 
     if(cmp_ev(v[i], value) == 0) {
       void *removed = v[i];
 
+      /* Update the table used count, before any rehash recounts it. */
+      table->used--;
+
       /* Optimization: Don't add a DELETED unless we need to. */
       if(v[(i + 1) & mask] == EMPTY) {
         v[i] = (void*)EMPTY;
@@ -238,9 +260,6 @@ void *hasht_del(hash_t *table, void *value)
           hasht_rehash(table, 1);
       }
 
-      /* Update the table used count. */
-      table->used--;
-
       return removed;
     }
   }
@@ -269,3 +288,46 @@ void hasht_done(hash_t *table)
   table->iter = -1;
 }
 
+/* Measure how far each entry sits from its home slot. */
+void hasht_stats(hash_t *table, hasht_stats_t *stats)
+{
+  void **v = table->table;
+  unsigned int i, d, mask = table->size - 1;
+  double total = 0;
+
+  memset(stats, 0, sizeof(hasht_stats_t));
+  stats->size     = table->size;
+  stats->used     = table->used;
+  stats->deleted  = table->deleted;
+  stats->rehashes = table->rehashes;
+  stats->load       = (double)table->used / table->size;
+  stats->tombstones = (double)table->deleted / table->size;
+
+  for(i = 0; i < table->size; i++) {
+    if(v[i] == EMPTY || v[i] == DELETED)
+      continue;
+
+    d = (i - table->hash_e(v[i])) & mask;
+    if(d > stats->max_displacement) stats->max_displacement = d;
+    stats->histogram[d < HASHT_HISTOGRAM ? d : HASHT_HISTOGRAM - 1]++;
+    total += d;
+  }
+
+  if(table->used)
+    stats->mean_displacement = total / table->used;
+}
+
+void hasht_print(hash_t *table, FILE *stream, const char *name)
+{
+  hasht_stats_t st;
+  unsigned int i;
+
+  hasht_stats(table, &st);
+  fprintf(stream, "hasht %p (%s): %u/%u used (%.2f), %u deleted (%.2f), "
+          "%lu rehashes\n", (void*)table, name, st.used, st.size, st.load,
+          st.deleted, st.tombstones, st.rehashes);
+  fprintf(stream, "  displacement: mean %.2f, max %u; histogram",
+          st.mean_displacement, st.max_displacement);
+  for(i = 0; i < HASHT_HISTOGRAM; i++) fprintf(stream, " %u", st.histogram[i]);
+  fputc('\n', stream);
+}
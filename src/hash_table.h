@@ -30,8 +30,14 @@
 #ifndef HASH_TABLE__H
 #define HASH_TABLE__H
 
+#include <stdio.h>
+
+/* Define HASHT_TRACE when compiling hash_table.c to log every rehash, *
+ * and the statistics of every table as it is freed, to stderr.       */
+
 typedef struct {
 	unsigned int size, used, deleted;
+  unsigned long rehashes;
   long int iter;
   void **table;
 
@@ -42,6 +48,22 @@ typedef struct {
   void (*free)(void *);
 } hash_t;
 
+/* Displacements of HASHT_HISTOGRAM-1 slots or more share the last bucket. */
+#define HASHT_HISTOGRAM 16
+
+/* A snapshot of the shape of a table, from hasht_stats. The displacement *
+ * of an entry is how far it sits from its home slot, which is one less   *
+ * than the number of probes needed to find it.                           */
+typedef struct {
+  unsigned int size, used, deleted;
+  unsigned int max_displacement;
+  double mean_displacement;
+  double load;       /* used / size.    */
+  double tombstones; /* deleted / size. */
+  unsigned long rehashes;
+  unsigned int histogram[HASHT_HISTOGRAM];
+} hasht_stats_t;
+
 unsigned long hasht_hash(char *key, unsigned long length, unsigned long init);
 
 hash_t *hasht_init(unsigned int entries, void (*free_e)(void *),
@@ -59,4 +81,7 @@ void *hasht_del(hash_t *table, void *value);
 void *hasht_next(hash_t *table);
 void hasht_done(hash_t *table);
 
+void hasht_stats(hash_t *table, hasht_stats_t *stats);
+void hasht_print(hash_t *table, FILE *stream, const char *name);
+
 #endif
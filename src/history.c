@@ -0,0 +1,394 @@
+/*
+ * Earlier versions of the notes, kept as compressed deltas.
+ *
+ * Whenever a note is packed with new text, that text is also appended to
+ * the newest segment of HISTORY_DIR as its next revision, and a line of
+ * its ID, revision, time, segment, offset, length, size, checksum and kind
+ * is appended to HISTORY_MAP; A line of just the ID and '-' forgets the
+ * revisions of a removed note, so that a reused ID starts afresh.
+ *
+ * A revision is stored as a raw deflate stream primed with the revision
+ * before it, which deflate treats as text it has already seen, so that
+ * an edit costs little more than the lines it changed. Every
+ * HISTORY_SNAPSHOT revisions, and whenever the one before can't be
+ * vouched for by its checksum, one is stored whole, so that rebuilding
+ * any revision inflates at most HISTORY_SNAPSHOT streams.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "except.h"
+#include "exc_io.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "ntx.h"
+
+#define HISTORY_MAP     HISTORY_DIR"/map"
+
+/* Size at which a segment is complete. */
+#define HISTORY_SEGMENT (4 * 1024 * 1024)
+
+/* Revisions between those stored whole. */
+#define HISTORY_SNAPSHOT 16
+
+/* Deflate can refer back no further than its window. */
+#define HISTORY_WINDOW  32768
+
+#define HISTORY_LINE    128
+
+struct rev {
+  unsigned int id, rev;
+  long int time;
+  unsigned long seg, off, len, size, crc;
+  char kind; /* 'f' if stored whole, 'd' if against the revision before. */
+};
+
+/* Read the revisions of a note, or of every note if 'id' is -1, in the *
+ * order they were written, leaving out those which have been forgotten. */
+static struct rev *history_load(long int id, unsigned int *count)
+{
+  char *buf = NULL, *line, *end;
+  unsigned int n = 0, size = 64, i, j, *gone;
+  struct rev *revs, r;
+  exception_t exc;
+
+  *count = 0;
+  revs = alloc(size * sizeof(struct rev));
+  try buf = ntx_buffer(HISTORY_MAP);
+  catch(exc) {
+    if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+    return revs; /* No note has a history yet. */
+  }
+
+  /* Each note is forgotten from its last line of '-', if any. */
+  gone = alloc(65536 * sizeof(unsigned int));
+  memset(gone, 0, 65536 * sizeof(unsigned int));
+
+  for(line = buf; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, HISTORY_MAP);
+    *end = '\0';
+    if(end - line < SUMMARY_OFFSET || line[ID_LENGTH] != ID_SEP) continue;
+    r.id = strtol(line, NULL, 16) & 0xffff;
+    if(id != -1 && r.id != id) continue;
+
+    if(line[SUMMARY_OFFSET] == '-') gone[r.id] = n;
+    else if(sscanf(line + SUMMARY_OFFSET,
+                   "%u\t%ld\t%lx\t%lu\t%lu\t%lu\t%lx\t%c", &r.rev, &r.time,
+                   &r.seg, &r.off, &r.len, &r.size, &r.crc, &r.kind) == 8) {
+      if(n == size) revs = ralloc(revs, (size *= 2) * sizeof(struct rev));
+      revs[n++] = r;
+    }
+  }
+  release(buf);
+
+  for(i = j = 0; i < n; i++)
+    if(i >= gone[revs[i].id]) revs[j++] = revs[i];
+  release(gone);
+
+  *count = j;
+  return revs;
+}
+
+/* Deflate 'body', primed with the end of 'base' if it isn't NULL. */
+static char *history_deflate(char *base, unsigned int blen,
+                             char *body, unsigned int len, unsigned long *olen)
+{
+  z_stream z;
+  char *out;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                  MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw(E_NOMEM, NULL);
+  if(base) {
+    if(blen > HISTORY_WINDOW) {
+      base += blen - HISTORY_WINDOW;
+      blen  = HISTORY_WINDOW;
+    }
+    deflateSetDictionary(&z, (Bytef*)base, blen);
+  }
+
+  *olen = deflateBound(&z, len);
+  out = alloc(*olen);
+  z.next_in   = (Bytef*)body;
+  z.avail_in  = len;
+  z.next_out  = (Bytef*)out;
+  z.avail_out = *olen;
+  ret = deflate(&z, Z_FINISH);
+  deflateEnd(&z);
+
+  if(ret != Z_STREAM_END) throw(E_NOMEM, NULL);
+  *olen -= z.avail_out;
+  return out;
+}
+
+/* Read and inflate a revision, given the text of the one before if it *
+ * is a delta. The text is NUL-terminated.                             */
+static char *history_inflate(struct rev *r, char *base, unsigned int blen)
+{
+  char seg[FILE_MAX], *in, *out;
+  z_stream z;
+  FILE *f;
+  int ret;
+
+  seprintf(seg, FILE_MAX, HISTORY_DIR"/%08lx", r->seg);
+  f = raw_open(seg, "rb");
+  setvbuf(f, NULL, _IONBF, 0);
+  in = alloc(r->len + 1);
+  if(fseek(f, r->off, SEEK_SET) != 0 || fread(in, 1, r->len, f) != r->len)
+    throw(E_FIOERR, f);
+  release(f);
+  STAT(ST_RAW_READ, r->len);
+
+  memset(&z, 0, sizeof(z));
+  if(inflateInit2(&z, -MAX_WBITS) != Z_OK) throw(E_NOMEM, NULL);
+  if(r->kind == 'd') {
+    if(blen > HISTORY_WINDOW) {
+      base += blen - HISTORY_WINDOW;
+      blen  = HISTORY_WINDOW;
+    }
+    inflateSetDictionary(&z, (Bytef*)base, blen);
+  }
+
+  out = alloc(r->size + 1);
+  z.next_in   = (Bytef*)in;
+  z.avail_in  = r->len;
+  z.next_out  = (Bytef*)out;
+  z.avail_out = r->size;
+  ret = inflate(&z, Z_FINISH);
+  inflateEnd(&z);
+  release(in);
+
+  if(ret != Z_STREAM_END || z.avail_out != 0 ||
+     crc32c(0, out, r->size) != r->crc)
+    throw(E_INVAL, seg);
+  out[r->size] = '\0';
+  return out;
+}
+
+/* Rebuild revs[k] of a note, from the last revision stored whole. */
+static char *history_rebuild(struct rev *revs, unsigned int k)
+{
+  unsigned int s;
+  char *body = NULL, *next;
+
+  for(s = k; s > 0 && revs[s].kind != 'f'; s--);
+  for(; s <= k; s++) {
+    next = history_inflate(revs + s, body, body ? revs[s - 1].size : 0);
+    if(body) release(body);
+    body = next;
+  }
+  return body;
+}
+
+/* Format the line of HISTORY_MAP for a revision. */
+static unsigned int history_line(char *line, struct rev *r)
+{
+  return seprintf(line, HISTORY_LINE, "%04x%c%u\t%ld\t%08lx\t%lu\t%lu\t%lu"
+                  "\t%08lx\t%c\n", r->id, ID_SEP, r->rev, r->time, r->seg,
+                  r->off, r->len, r->size, r->crc, r->kind);
+}
+
+/* Append a revision to the newest segment, and record where it went. */
+static void history_append(struct rev *r, char *buf)
+{
+  char seg[FILE_MAX], line[HISTORY_LINE];
+  unsigned long *segs;
+  unsigned int count;
+  FILE *f;
+
+  if(ntx_mkdir(HISTORY_DIR) != 0) throw(E_FACCESS, HISTORY_DIR);
+  segs = ntx_segments(HISTORY_DIR, &count);
+  r->seg = count ? segs[count - 1] : 0;
+  release(segs);
+
+  seprintf(seg, FILE_MAX, HISTORY_DIR"/%08lx", r->seg);
+  if(count && ntx_flen(seg) >= HISTORY_SEGMENT)
+    seprintf(seg, FILE_MAX, HISTORY_DIR"/%08lx", ++r->seg);
+
+  f = raw_open(seg, "ab");
+  if(fseek(f, 0, SEEK_END) != 0) throw(E_FIOERR, f);
+  r->off = ftell(f);
+  if(fwrite(buf, 1, r->len, f) != r->len || fflush(f) != 0) throw(E_FIOERR, f);
+  release(f);
+
+  history_line(line, r);
+  ntx_append(HISTORY_MAP, line);
+}
+
+/* Record the new text of a note, as packed in place of 'old' (NULL if *
+ * it is new, or was never packed). A note which had no history yet    *
+ * first gets its old text, if known, as its first revision.           */
+void history_record(char *id, char *old, unsigned int olen,
+                    char *body, unsigned int len)
+{
+  unsigned int n;
+  unsigned long blen;
+  struct rev *revs, r, *last;
+  char *buf;
+
+  r.id = strtol(id, NULL, 16) & 0xffff;
+  revs = history_load(r.id, &n);
+  if(!n && old) {
+    history_record(id, NULL, 0, old, olen);
+    release(revs);
+    revs = history_load(r.id, &n);
+  }
+  last = n ? revs + n - 1 : NULL;
+
+  r.rev  = last ? last->rev + 1 : 1;
+  r.time = time(NULL);
+  r.size = len;
+  r.crc  = crc32c(0, body, len);
+
+  /* A delta is only as good as the revision it was made against. */
+  if(old && last && (r.rev - 1) % HISTORY_SNAPSHOT != 0 &&
+     last->size == olen && last->crc == crc32c(0, old, olen)) {
+    r.kind = 'd';
+    buf = history_deflate(old, olen, body, len, &blen);
+  } else {
+    r.kind = 'f';
+    buf = history_deflate(NULL, 0, body, len, &blen);
+  }
+  r.len = blen;
+
+  history_append(&r, buf);
+  release(buf);
+  release(revs);
+}
+
+static int history_exists(void)
+{
+  exception_t exc;
+
+  try ntx_flen(HISTORY_MAP);
+  catch(exc) return 0;
+  return 1;
+}
+
+/* Forget the revisions of a note which has been removed. */
+void history_drop(char *id)
+{
+  char line[HISTORY_LINE];
+
+  if(!history_exists()) return;
+  seprintf(line, HISTORY_LINE, "%s%c-\n", id, ID_SEP);
+  ntx_append(HISTORY_MAP, line);
+}
+
+/* Rebuild revision 'rev' of a note; NULL if it has no such revision. */
+char *history_read(char *id, unsigned int rev, unsigned int *len)
+{
+  unsigned int n, k;
+  struct rev *revs;
+  char *body = NULL;
+
+  revs = history_load(strtol(id, NULL, 16) & 0xffff, &n);
+  for(k = 0; k < n && revs[k].rev != rev; k++);
+  if(k < n) {
+    body = history_rebuild(revs, k);
+    *len = revs[k].size;
+  }
+  release(revs);
+  return body;
+}
+
+/* Print the revisions of a note, newest first, with their summaries. */
+void history_log(char *id)
+{
+  char summary[SUMMARY_LENGTH + PADDING_LENGTH], when[32], *body = NULL, *next;
+  char **lines, *end;
+  unsigned int n, k;
+  struct rev *revs;
+  time_t t;
+
+  revs = history_load(strtol(id, NULL, 16) & 0xffff, &n);
+  lines = alloc((n ? n : 1) * sizeof(char *));
+
+  /* Rebuild each revision from the one before, as they are stored. */
+  for(k = 0; k < n; k++) {
+    next = history_inflate(revs + k, body, k ? revs[k - 1].size : 0);
+    if(body) release(body);
+    body = next;
+
+    strncpy(summary, body, SUMMARY_LENGTH + PADDING_LENGTH - 1);
+    summary[SUMMARY_LENGTH + PADDING_LENGTH - 1] = '\0';
+    if(!*summary) strcpy(summary, "\n");
+    ntx_fmtsummary(id, summary);
+    if((end = strchr(summary, '\n'))) *end = '\0';
+
+    t = revs[k].time;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    lines[k] = alloc(HISTORY_LINE + sizeof(summary));
+    seprintf(lines[k], HISTORY_LINE + sizeof(summary), "%s@%u\t%s\t%s\n",
+             id, revs[k].rev, when, summary);
+  }
+  if(body) release(body);
+
+  for(k = n; k-- > 0; ) {
+    out_write(lines[k], strlen(lines[k]));
+    release(lines[k]);
+  }
+  release(lines);
+  release(revs);
+}
+
+/* Rewrite the segments without the revisions which were forgotten. */
+void history_compact(void)
+{
+  char seg[FILE_MAX], line[HISTORY_LINE], *buf;
+  unsigned long *segs, next;
+  unsigned int count, nsegs, i;
+  struct rev *revs, r;
+  gzFile *m;
+  FILE *in, *out = NULL;
+
+  if(!history_exists()) return;
+  revs = history_load(-1, &count);
+  segs = ntx_segments(HISTORY_DIR, &nsegs);
+  next = nsegs ? segs[nsegs - 1] + 1 : 0;
+  m = gzf_open(HISTORY_MAP".new", "w");
+
+  /* Copy each revision as it is stored, in the order it was written. */
+  for(i = 0; i < count; i++) {
+    r = revs[i];
+    seprintf(seg, FILE_MAX, HISTORY_DIR"/%08lx", r.seg);
+    in = raw_open(seg, "rb");
+    buf = alloc(r.len + 1);
+    if(fseek(in, r.off, SEEK_SET) != 0 || fread(buf, 1, r.len, in) != r.len)
+      throw(E_FIOERR, in);
+    release(in);
+
+    if(!out || ftell(out) >= HISTORY_SEGMENT) {
+      if(out) release(out);
+      seprintf(seg, FILE_MAX, HISTORY_DIR"/%08lx", next++);
+      out = raw_open(seg, "wb");
+    }
+    r.seg = next - 1;
+    r.off = ftell(out);
+    if(fwrite(buf, 1, r.len, out) != r.len) throw(E_FIOERR, out);
+    release(buf);
+
+    gzf_write(m, line, history_line(line, &r));
+  }
+  if(out) {
+    if(fflush(out) != 0) throw(E_FIOERR, out);
+    release(out);
+  }
+  release(m);
+  release(revs);
+
+  /* Only once the new map is in place are the old segments removed. */
+  if(rename(HISTORY_MAP".new", HISTORY_MAP) != 0)
+    throw(E_FACCESS, HISTORY_MAP);
+  manifest_update(HISTORY_MAP);
+  for(i = 0; i < nsegs; i++) {
+    seprintf(seg, FILE_MAX, HISTORY_DIR"/%08lx", segs[i]);
+    remove(seg);
+  }
+  release(segs);
+}
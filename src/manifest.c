@@ -0,0 +1,213 @@
+/*
+ * The manifest records the CRC-32C and length of each derived file (the
+ * index, tags and refs) as last written by ntx, for ntx fsck to verify.
+ *
+ * It is loaded on first use, kept in a hash table while a command runs,
+ * and written back once by manifest_flush if anything changed. Each line
+ * holds the checksum in hex, the length, and the path, separated by tabs.
+ * None of this is thread-safe; Only the main thread may use it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "except.h"
+#include "exc_io.h"
+#include "hash_table.h"
+#include "crc32c.h"
+#include "ntx.h"
+
+struct mfent {
+  char *path;
+  unsigned long crc, len;
+};
+
+static hash_t *manifest = NULL;
+static int dirty = 0;
+
+unsigned long hash_mfent(void *v)
+{
+  return hasht_hash(((struct mfent*)v)->path,
+                    strlen(((struct mfent*)v)->path), 0);
+}
+
+unsigned long hash_mfpath(void *v)
+{
+  return hasht_hash((char*)v, strlen((char*)v), 0);
+}
+
+int cmp_mfent(void *a, void *b)
+{
+  return strcmp(((struct mfent*)a)->path, ((struct mfent*)b)->path);
+}
+
+int cmp_mfpath(void *a, void *b)
+{
+  return strcmp(((struct mfent*)a)->path, (char*)b);
+}
+
+void free_mfent(void *v)
+{
+  free(((struct mfent*)v)->path);
+  free(v);
+}
+
+/* Checksum a whole file, or from 'off' onwards to extend 'crc'. */
+void ntx_checksum(char *file, unsigned long off,
+                  unsigned long *crc, unsigned long *len)
+{
+  char buf[BUFFER_MAX];
+  unsigned int n;
+  FILE *f = raw_open(file, "rb");
+
+  if(off && fseek(f, off, SEEK_SET) != 0) throw(E_FIOERR, f);
+  if(!off) *crc = *len = 0;
+
+  while((n = fread(buf, 1, BUFFER_MAX, f)) > 0) {
+    *crc  = crc32c(*crc, buf, n);
+    *len += n;
+  }
+  if(ferror(f)) throw(E_FIOERR, f);
+  release(f);
+}
+
+static void manifest_new(void)
+{
+  manifest = hasht_init(512, free_mfent, hash_mfent, hash_mfpath,
+                        cmp_mfent, cmp_mfpath);
+  if(!manifest) throw(E_NOMEM, NULL);
+}
+
+static void manifest_load(void)
+{
+  char line[FILE_MAX + 32], *path, *end;
+  struct mfent *e;
+  exception_t exc;
+  gzFile *f = NULL;
+
+  manifest_new();
+  try f = gzf_open(MANIFEST_FILE, "r");
+  catch(exc) {
+    if(exc.type == E_FACCESS) return; /* No checksums recorded yet. */
+    throw(exc.type, exc.value);
+  }
+
+  while(gzf_getl(f, line, sizeof(line))) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, MANIFEST_FILE);
+    *end = '\0';
+
+    if(!(path = strchr(line, '\t')) || !(path = strchr(path + 1, '\t')))
+      throw(E_INVAL, MANIFEST_FILE);
+    if(!(e = malloc(sizeof(struct mfent))) || !(e->path = strdup(path + 1)))
+      throw(E_NOMEM, NULL);
+    e->crc = strtoul(line, &end, 16);
+    e->len = strtoul(end + 1, NULL, 10);
+    if((e = hasht_add(manifest, e))) free_mfent(e);
+  }
+  release(f);
+}
+
+/* Look up the recorded checksum of a file; Returns 0 if it has none. */
+int manifest_lookup(char *file, unsigned long *crc, unsigned long *len)
+{
+  struct mfent *e;
+
+  if(!manifest) manifest_load();
+  if(!(e = hasht_get(manifest, file))) return 0;
+  *crc = e->crc;
+  *len = e->len;
+  return 1;
+}
+
+/* Iterate over the paths of the manifest, as hasht_next does. */
+char *manifest_next(void)
+{
+  struct mfent *e;
+
+  if(!manifest) manifest_load();
+  return (e = hasht_next(manifest)) ? e->path : NULL;
+}
+
+void manifest_record(char *file, unsigned long crc, unsigned long len)
+{
+  struct mfent *e;
+
+  if(!manifest) manifest_load();
+  if(!(e = hasht_get(manifest, file))) {
+    if(!(e = malloc(sizeof(struct mfent))) || !(e->path = strdup(file)))
+      throw(E_NOMEM, NULL);
+    hasht_add(manifest, e);
+  }
+  e->crc = crc;
+  e->len = len;
+  dirty  = 1;
+}
+
+void manifest_drop(char *file)
+{
+  struct mfent *e;
+
+  if(!manifest) manifest_load();
+  if((e = hasht_del(manifest, file))) {
+    free_mfent(e);
+    dirty = 1;
+  }
+}
+
+/* Forget every checksum, before recording a complete set of files. */
+void manifest_clear(void)
+{
+  if(manifest) hasht_free(manifest);
+  manifest_new();
+  dirty = 1;
+}
+
+/* Record the checksum of a file which has just been rewritten. */
+void manifest_update(char *file)
+{
+  unsigned long crc, len;
+  exception_t exc;
+
+  try ntx_checksum(file, 0, &crc, &len);
+  catch(exc) {
+    if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+    manifest_drop(file); /* It was removed. */
+    return;
+  }
+  manifest_record(file, crc, len);
+}
+
+/* Record the checksum of a file which has just been appended to. As the *
+ * old contents are unchanged, only the new bytes need to be read.       */
+void manifest_append(char *file)
+{
+  unsigned long crc, len;
+
+  if(!manifest_lookup(file, &crc, &len)) len = 0;
+  ntx_checksum(file, len, &crc, &len);
+  manifest_record(file, crc, len);
+}
+
+/* Write the manifest back if it has changed. */
+void manifest_flush(void)
+{
+  char line[FILE_MAX + 32];
+  struct mfent *e;
+  unsigned int len;
+  gzFile *f;
+
+  if(!manifest || !dirty) return;
+
+  f = gzf_open(MANIFEST_FILE".new", "w");
+  while((e = hasht_next(manifest))) {
+    len = seprintf(line, sizeof(line), "%08lx\t%lu\t%s\n",
+                   e->crc, e->len, e->path);
+    gzf_write(f, line, len);
+  }
+  release(f);
+
+  if(rename(MANIFEST_FILE".new", MANIFEST_FILE) != 0)
+    throw(E_FACCESS, MANIFEST_FILE);
+  dirty = 0;
+}
@@ -0,0 +1,404 @@
+/*
+ * ntx tag-rename and tag-merge: Move every note of some tags to another.
+ *
+ * The tags are read once, and the target written once, with each note
+ * only once however many of the tags it had. Each refs bucket holding
+ * one of those notes is then rewritten once, naming the target in place
+ * of the tags, which are finally removed along with their filters.
+ *
+ * ntx retag --where: Add and remove tags of every note with some tags.
+ *
+ * The notes are selected as ntx list would, then each refs bucket which
+ * holds one of them is rewritten once, finding which notes lack each tag
+ * to add and have each to remove. Each added tag is appended to once and
+ * each removed tag rewritten once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "ntx.h"
+
+#define HAS(set, id) ((set)[(id) / 8] & (1 << ((id) % 8)))
+#define SET(set, id) ((set)[(id) / 8] |= 1 << ((id) % 8))
+
+/* Write the lines of a tag file not already written, noting their IDs. */
+static void ntx_mergelines(gzFile *out, char *buf, char *file,
+                           unsigned char *has, unsigned char *moved,
+                           unsigned short *ids, unsigned int *count)
+{
+  unsigned int id;
+  char *end;
+
+  for(; *buf; buf = end + 1) {
+    if(!(end = strchr(buf, '\n'))) throw(E_INVAL, file);
+    id = strtol(buf, NULL, 16) & 0xffff;
+    if(moved) SET(moved, id);
+    if(HAS(has, id)) continue;
+
+    SET(has, id);
+    ids[(*count)++] = id;
+    gzf_write(out, buf, end - buf + 1);
+  }
+}
+
+typedef int (*retag_fn)(gzFile *out, unsigned int id, char *tags, void *arg);
+
+/* Rehash the tags of the notes of a bucket of refs which are in 'set'. */
+static void ntx_rehash(char *file, unsigned char *set)
+{
+  char id[ID_LENGTH + 1], *buf, *line, *end, **tagv;
+
+  buf = ntx_buffer(file);
+  for(line = buf; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+    if(end - line < SUMMARY_OFFSET) continue;
+    if(!HAS(set, strtol(line, NULL, 16) & 0xff)) continue;
+
+    *end = '\0';
+    seprintf(id, ID_LENGTH + 1, "%.4s", line);
+    tagv = strtokens(line + SUMMARY_OFFSET, FIELD_SEP);
+    related_update(id, tagv, 0);
+    release(tagv);
+  }
+  release(buf);
+}
+
+/* Rewrite each bucket of refs which holds a note of 'sel', writing the *
+ * tags of those notes through 'retag', which is given them as a single *
+ * string and returns whether it changed them. Returns how many it did. *
+ * The signatures of ntx related are rehashed for those which changed.  */
+static unsigned int ntx_retagrefs(unsigned char *sel, retag_fn retag, void *arg)
+{
+  char file[FILE_MAX], *buf, *line, *end;
+  unsigned int b, i, id, changed = 0;
+  unsigned char done[256 / 8];
+  int related = related_exists(), any;
+  gzFile *out;
+
+  for(b = 0; b < 256; b++) {
+    for(i = 0; i < 256 / 8 && !sel[b * 256 / 8 + i]; i++);
+    if(i == 256 / 8) continue;
+
+    seprintf(file, FILE_MAX, REFS_DIR"/%02x", b);
+    buf = ntx_buffer(file);
+    out = gzf_open(file, "w");
+    memset(done, 0, sizeof(done));
+    any = 0;
+
+    for(line = buf; *line; line = end + 1) {
+      if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+      id = strtol(line, NULL, 16) & 0xffff;
+      if(end - line < SUMMARY_OFFSET || !HAS(sel, id)) {
+        gzf_write(out, line, end - line + 1);
+        continue;
+      }
+
+      gzf_write(out, line, SUMMARY_OFFSET);
+      *end = '\0';
+      if(retag(out, id, line + SUMMARY_OFFSET, arg)) {
+        SET(done, id & 0xff);
+        changed++;
+        any = 1;
+      }
+      gzf_putl(out, "\n");
+    }
+
+    release(out);
+    release(buf);
+    manifest_update(file);
+    if(related && any) ntx_rehash(file, done);
+  }
+  return changed;
+}
+
+/* Cut the next tag from a list of them, returning the rest. */
+static char *ntx_nexttag(char *tag)
+{
+  char *next = strchr(tag, *FIELD_SEP);
+
+  if(!next) return tag + strlen(tag);
+  *next = '\0';
+  return next + 1;
+}
+
+struct merge { /* The tags of ntx_merge, for merge_retag. */
+  char **from, *to;
+  unsigned int n;
+};
+
+/* Name the target in place of any of the tags merged into it. */
+static int merge_retag(gzFile *out, unsigned int id, char *tags, void *arg)
+{
+  struct merge *m = arg;
+  unsigned int i, put = 0;
+  char *tag, *next;
+
+  /* Keep the order of the tags, with the target where the first was. */
+  for(tag = tags; *tag; tag = next) {
+    next = ntx_nexttag(tag);
+    for(i = 0; i < m->n && strcmp(tag, m->from[i]); i++);
+    if(i < m->n || !strcmp(tag, m->to)) {
+      if(put++) continue;
+      tag = m->to;
+    }
+    gzf_putl(out, tag);
+    gzf_putl(out, (char*)FIELD_SEP);
+  }
+  return 1;
+}
+
+/* Move the notes of the 'n' tags 'from' to the tag 'to', which must not *
+ * exist yet if 'fresh' is set.                                          */
+void ntx_merge(char **from, unsigned int n, char *to, int fresh)
+{
+  char file[FILE_MAX], *buf, **tags;
+  unsigned char *has, *moved;
+  unsigned short *ids;
+  unsigned int count = 0, i, j, k;
+  struct merge m;
+  exception_t exc;
+  gzFile *out;
+  int exists = 1;
+
+  ntx_tagname(to);
+  seprintf(file, FILE_MAX, TAGS_DIR"/%s", to);
+  try ntx_flen(file);
+  catch(exc) exists = 0;
+  if(fresh && exists) die("The tag %s already exists; Use tag-merge.", to);
+
+  /* Leave out the target, and any tag named twice. */
+  for(i = j = 0; i < n; i++) {
+    for(k = 0; k < j && strcmp(from[i], from[k]); k++);
+    if(k == j && strcmp(from[i], to)) from[j++] = from[i];
+  }
+  if(!(n = j)) die("Nothing to merge into %s.", to);
+
+  has   = alloc(65536 / 8);
+  moved = alloc(65536 / 8);
+  ids   = alloc(65536 * sizeof(unsigned short));
+  memset(has, 0, 65536 / 8);
+  memset(moved, 0, 65536 / 8);
+
+  /* Read every tag before writing anything, so a missing one stops it. */
+  for(i = 0; i < n; i++) {
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", from[i]);
+    ntx_flen(file);
+  }
+
+  /* Write the target, with the notes it already had first. */
+  seprintf(file, FILE_MAX, TAGS_DIR"/%s", to);
+  buf = exists ? ntx_buffer(file) : NULL;
+  out = gzf_open(file, "w");
+  if(buf) {
+    ntx_mergelines(out, buf, file, has, NULL, ids, &count);
+    release(buf);
+  }
+  for(i = 0; i < n; i++) {
+    char tag[FILE_MAX];
+
+    seprintf(tag, FILE_MAX, TAGS_DIR"/%s", from[i]);
+    buf = ntx_buffer(tag);
+    ntx_mergelines(out, buf, tag, has, moved, ids, &count);
+    release(buf);
+  }
+  release(out);
+  manifest_update(file);
+
+  /* Then each bucket of refs which holds a note that was moved. */
+  m.from = from;
+  m.n    = n;
+  m.to   = to;
+  ntx_retagrefs(moved, merge_retag, &m);
+
+  /* Finally remove the old tags, and filter the target afresh. */
+  for(i = 0; i < n; i++) {
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", from[i]);
+    remove(file);
+    manifest_drop(file);
+    seprintf(file, FILE_MAX, FILTERS_DIR"/%s", from[i]);
+    remove(file);
+  }
+  if(ntx_mkdir(FILTERS_DIR) == 0) filter_write_ids(to, ids, count);
+
+  /* The views of any of these tags are rebuilt, rather than patched. */
+  tags = alloc((n + 1) * sizeof(char *));
+  memcpy(tags, from, n * sizeof(char *));
+  tags[n] = to;
+  view_refresh(tags, n + 1);
+  release(tags);
+
+  for(i = j = 0; i < 65536; i++) j += HAS(moved, i) != 0;
+  printf("Moved %u notes to %s, which has %u.\n", j, to, count);
+
+  release(ids);
+  release(moved);
+  release(has);
+}
+
+struct bulk { /* The changes of ntx_bulktag, for bulk_retag. */
+  char **add, **del;
+  unsigned int nadd, ndel;
+
+  /* The notes which lacked each tag to add, then which had each to remove. */
+  unsigned char *sets;
+  char *found;
+};
+
+/* Add and remove the tags of a note, noting it in the set of each. */
+static int bulk_retag(gzFile *out, unsigned int id, char *tags, void *arg)
+{
+  struct bulk *bk = arg;
+  unsigned int i, change = 0;
+  char *tag, *next;
+
+  memset(bk->found, 0, bk->nadd);
+  for(tag = tags; *tag; tag = next) {
+    next = ntx_nexttag(tag);
+    for(i = 0; i < bk->ndel && strcmp(tag, bk->del[i]); i++);
+    if(i < bk->ndel) {
+      SET(bk->sets + (bk->nadd + i) * (65536 / 8), id);
+      change = 1;
+      continue;
+    }
+    for(i = 0; i < bk->nadd && strcmp(tag, bk->add[i]); i++);
+    if(i < bk->nadd) bk->found[i] = 1;
+    gzf_putl(out, tag);
+    gzf_putl(out, (char*)FIELD_SEP);
+  }
+  for(i = 0; i < bk->nadd; i++) {
+    if(bk->found[i]) continue;
+    SET(bk->sets + i * (65536 / 8), id);
+    gzf_putl(out, bk->add[i]);
+    gzf_putl(out, (char*)FIELD_SEP);
+    change = 1;
+  }
+  return change;
+}
+
+/* Remove the notes in 'set' from a tag file, and the file if it empties. */
+static void ntx_droplines(char *file, unsigned char *set)
+{
+  char *buf, *line, *end;
+  unsigned int written = 0;
+  gzFile *out;
+
+  buf = ntx_buffer(file);
+  out = gzf_open(file, "w");
+  for(line = buf; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+    if(!HAS(set, strtol(line, NULL, 16) & 0xffff))
+      written += gzf_write(out, line, end - line + 1);
+  }
+  release(out);
+  release(buf);
+
+  if(written == 0) remove(file);
+  manifest_update(file);
+}
+
+/* Retag every note with the tags of 'args' before the first +tag or -tag; *
+ * Each of those is then added to, or removed from, every such note.       */
+void ntx_bulktag(char **args, unsigned int argc)
+{
+  char file[FILE_MAX], **add, **del, **tags, *result, *line, *end, *lines, *pos;
+  unsigned char *sel, *sets, *set;
+  unsigned int where, nadd = 0, ndel = 0, i, j, id, n, changed;
+  struct filter *filter;
+  struct bulk bk;
+
+  for(where = 0; where < argc && *args[where] != '+' && *args[where] != '-';
+      where++);
+  if(!where || where == argc)
+    die("Give the tags to select by, then each +tag to add or -tag to remove.");
+
+  add = alloc(argc * sizeof(char *));
+  del = alloc(argc * sizeof(char *));
+  for(i = where; i < argc; i++) {
+    if(*args[i] != '+' && *args[i] != '-')
+      die("Expected +tag or -tag, not %s.", args[i]);
+    ntx_tagname(args[i] + 1);
+
+    /* Naming a tag twice is harmless, unless it is both added and removed. */
+    tags = *args[i] == '+' ? del : add;
+    n    = *args[i] == '+' ? ndel : nadd;
+    for(j = 0; j < n && strcmp(tags[j], args[i] + 1); j++);
+    if(j < n) die("The tag %s can't be both added and removed.", args[i] + 1);
+
+    tags = *args[i] == '+' ? add : del;
+    n    = *args[i] == '+' ? nadd : ndel;
+    for(j = 0; j < n && strcmp(tags[j], args[i] + 1); j++);
+    if(j < n) continue;
+    tags[n] = args[i] + 1;
+    if(*args[i] == '+') nadd++;
+    else ndel++;
+  }
+
+  sel  = alloc(65536 / 8);
+  sets = alloc((nadd + ndel) * (65536 / 8));
+  memset(sel, 0, 65536 / 8);
+  memset(sets, 0, (nadd + ndel) * (65536 / 8));
+
+  result = ntx_select(args, where);
+  for(line = result; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, TAGS_DIR);
+    SET(sel, strtol(line, NULL, 16) & 0xffff);
+  }
+
+  /* Each bucket of refs first, to find which tags each note had. */
+  bk.add   = add;
+  bk.del   = del;
+  bk.nadd  = nadd;
+  bk.ndel  = ndel;
+  bk.sets  = sets;
+  bk.found = alloc(nadd + 1);
+  changed = ntx_retagrefs(sel, bulk_retag, &bk);
+  release(bk.found);
+
+  /* Then add the notes which lacked each tag to it, at once. */
+  lines = alloc(strlen(result) + 1);
+  for(i = 0; i < nadd; i++) {
+    set = sets + i * (65536 / 8);
+    for(pos = lines, line = result; *line; line = end + 1) {
+      end = strchr(line, '\n');
+      if(!HAS(set, strtol(line, NULL, 16) & 0xffff)) continue;
+      memcpy(pos, line, end - line + 1);
+      pos += end - line + 1;
+    }
+    if(pos == lines) continue;
+    *pos = '\0';
+
+    filter = filter_begin(add[i]);
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", add[i]);
+    ntx_append(file, lines);
+    for(id = 0; id < 65536; id++) if(HAS(set, id)) filter_add(filter, id);
+    filter_end(filter, NULL);
+  }
+  release(lines);
+
+  /* And remove them from each tag which they had. */
+  for(i = 0; i < ndel; i++) {
+    set = sets + (nadd + i) * (65536 / 8);
+    for(id = 0; id < 65536 && !HAS(set, id); id++);
+    if(id == 65536) continue;
+
+    filter = filter_begin(del[i]);
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", del[i]);
+    ntx_droplines(file, set);
+    filter_end(filter, NULL);
+  }
+
+  /* The views of any of these tags are rebuilt, rather than patched. */
+  memcpy(add + nadd, del, ndel * sizeof(char *));
+  view_refresh(add, nadd + ndel);
+
+  printf("Changed the tags of %u notes.\n", changed);
+
+  release(result);
+  release(sets);
+  release(sel);
+  release(del);
+  release(add);
+}
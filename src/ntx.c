@@ -5,30 +5,13 @@
 #include <time.h>
 #include <zlib.h>
 #include <errno.h>
+#include <limits.h>
 #include "except.h"
 #include "exc_io.h"
 #include "hash_table.h"
-
-/* Buffer size definitions. */
-#define FILE_MAX      (FILENAME_MAX+1)
-#define BUFFER_MAX     8192
-
-/* ID: Four hexidecimal digits. */
-#define ID_LENGTH      4
-
-/* Single character seperator. */
-#define SEP_LENGTH     1
-
-/* Maximum summary length to read. */
-#define SUMMARY_LENGTH 58 
-
-/* "\n\0" line terminator. */
-#define PADDING_LENGTH 2    
-
-#define SUMREC_LENGTH  (ID_LENGTH + SEP_LENGTH + SUMMARY_LENGTH + PADDING_LENGTH)
-#define SUMBASE_LENGTH (ID_LENGTH + SEP_LENGTH + PADDING_LENGTH)
-#define SUMMARY_OFFSET (ID_LENGTH + SEP_LENGTH)
-
+#include "sched.h"
+#include "stats.h"
+#include "ntx.h"
 
 /* Default (_one character_) separators.            *
  * \n the a hard-coded record separator, due to the *
@@ -36,23 +19,7 @@
 const char  ID_SEP    = '\t';
 const char *FIELD_SEP = ";";
 
-
-/* Builtin Subdirectories. */
-#define TAGS_DIR   "tags"
-#define REFS_DIR   "refs"
-#define NOTES_DIR  "notes"
-#define INDEX_FILE "index"
-
-
-/* Prototypes of system-dependent functions. */
-void ntx_editor(char *file);
-void ntx_homedir(char *sub, ...);
-long int ntx_flen(char *file);
-
-typedef void * n_dir;
-n_dir ntx_dopen(char *dir);
-char *ntx_dread(n_dir dir);
-void ntx_dclose(n_dir dir);
+unsigned long ntx_budget = 0;
 
 
 void die(const char *fmt, ...)
@@ -106,13 +73,13 @@ char **strtokens(char *str, const char *delim)
       token != NULL;
       token = strrtok(NULL, &state, delim)) {
     if(curtoken == maxtokens)
-      tokens = ralloc(tokens, (maxtokens *= 2));
+      tokens = ralloc(tokens, (maxtokens *= 2) * sizeof(char *));
     tokens[curtoken++] = token;
   }
 
   /* Terminate with a NULL token. */
-  if(curtoken+1 == maxtokens)
-    tokens = ralloc(tokens, maxtokens+1);
+  if(curtoken == maxtokens)
+    tokens = ralloc(tokens, (maxtokens+1) * sizeof(char *));
   tokens[curtoken] = NULL;
 
   return tokens;
@@ -124,6 +91,22 @@ char **stratokens(const char *str, char **buffer, const char *delim)
   return strtokens(*buffer, delim);
 }
 
+/* Check that a string is a note ID, as generated by ntx_add. */
+int ntx_isid(char *id)
+{
+  return strlen(id) == ID_LENGTH && strspn(id, "0123456789abcdef") == ID_LENGTH;
+}
+
+/* Stop at a name which can't be used as a tag: One which is empty, would *
+ * leave the tags directory or split in the refs, or would be read as an  *
+ * option by ntx list.                                                    */
+void ntx_tagname(char *tag)
+{
+  if(!*tag || strchr(tag, '/') || strchr(tag, *FIELD_SEP) ||
+     !strncmp(tag, "--", 2))
+    die("Invalid tag %s.", tag);
+}
+
 /* 'buf' should be SUMMARY_LENGTH + PADDING_LENGTH bytes long. */
 void ntx_summary(char *file, char *buf)
 {
@@ -132,7 +115,16 @@ void ntx_summary(char *file, char *buf)
 
   temp = raw_getl(f, buf, SUMMARY_LENGTH + PADDING_LENGTH);
   release(f);
-  if(!temp || strlen(temp) == 0) throw(E_INVAL, file);
+  if(!temp) throw(E_INVAL, file);
+  ntx_fmtsummary(file, buf);
+}
+
+/* Format the first line of a note, as read into 'buf', as its summary. */
+void ntx_fmtsummary(char *file, char *buf)
+{
+  char *temp;
+
+  if(strlen(buf) == 0) throw(E_INVAL, file);
 
   /* Format the string into SUMMARY_LENGTH bytes. */
   if((temp = strchr(buf, '\n'))) temp[1] = '\0';
@@ -144,26 +136,101 @@ void ntx_summary(char *file, char *buf)
   }
 }
 
+static int ntx_sortseg(const void *a, const void *b)
+{
+  unsigned long x = *(unsigned long*)a, y = *(unsigned long*)b;
+  return (x > y) - (x < y);
+}
+
+/* List the numbered segments of 'dir', oldest first. */
+unsigned long *ntx_segments(char *dir, unsigned int *count)
+{
+  unsigned int size = 16;
+  unsigned long *segs = alloc(size * sizeof(unsigned long));
+  exception_t exc;
+  char *name;
+  n_dir d;
+
+  *count = 0;
+  try d = ntx_dopen(dir);
+  catch(exc) {
+    if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+    return segs; /* Nothing has been written yet. */
+  }
+
+  while((name = ntx_dread(d))) {
+    if(strlen(name) != SEGMENT_LENGTH ||
+       strspn(name, "0123456789abcdef") != SEGMENT_LENGTH)
+      continue;
+    if(*count == size)
+      segs = ralloc(segs, (size *= 2) * sizeof(unsigned long));
+    segs[(*count)++] = strtoul(name, NULL, 16);
+  }
+  ntx_dclose(d);
+
+  qsort(segs, *count, sizeof(unsigned long), ntx_sortseg);
+  return segs;
+}
+
 char *ntx_buffer(char *file)
 {
-  unsigned int blen = BUFFER_MAX, bpos = 0;
+  unsigned int blen = 2 * BUFFER_MAX, bpos = 0;
   unsigned int len;
   gzFile *f = gzf_open(file, "r");
   char *bbuf = alloc(blen);
 
   /* Read the entire file into the buffer. */
-  while((len = gzf_read(f, bbuf + bpos, BUFFER_MAX))) {
-    bpos += len;
+  do {
     if((blen - bpos - 1) < BUFFER_MAX) { /* The extra space is for the \0. */
-      blen += BUFFER_MAX;
+      blen *= 2;
       bbuf = ralloc(bbuf, blen);
     }
-  }
+    bpos += (len = gzf_read(f, bbuf + bpos, BUFFER_MAX));
+  } while(len);
   bbuf[bpos] = '\0'; /* NULL-terminate the input. */
   release(f);
   return bbuf;
 }
 
+/* Whether a file is too large to be read whole, under --memory. */
+int ntx_streams(char *file)
+{
+  exception_t exc;
+  long int size = 0;
+
+  if(!ntx_budget) return 0;
+  try size = ntx_flen(file);
+  catch(exc) return 0; /* Left for the reader to report. */
+  return (unsigned long)size > ntx_budget;
+}
+
+/* Read a whole line of any length into '*buf', which is grown as needed; *
+ * NULL at the end of the file. Every line must be terminated.            */
+char *ntx_getl(gzFile *f, char *file, char **buf, unsigned int *size)
+{
+  unsigned int len = 0;
+
+  while(gzf_getl(f, *buf + len, *size - len)) {
+    len += strlen(*buf + len);
+    if((*buf)[len - 1] == '\n') return *buf;
+    if(len == *size - 1) *buf = ralloc(*buf, *size *= 2);
+  }
+  if(len) throw(E_INVAL, file);
+  return NULL;
+}
+
+/* Write every line of a file as a note, a line at a time. */
+static void ntx_outlines(char *file)
+{
+  unsigned int size = BUFFER_MAX;
+  char *line = alloc(size);
+  gzFile *f = gzf_open(file, "r");
+
+  while(ntx_getl(f, file, &line, &size)) out_note(line, strlen(line));
+  release(f);
+  release(line);
+}
+
 char *ntx_tagstolist(char *id, char **tags)
 {
   char *list, *pos, **cur;
@@ -189,6 +256,35 @@ char *ntx_tagstolist(char *id, char **tags)
   return list;
 }
 
+/* As ntx_replace, but a line at a time, into a new file which then *
+ * replaces the old.                                                 */
+static int ntx_restream(char *file, char *id, char *fix)
+{
+  char tmp[FILE_MAX], *line;
+  unsigned int size = BUFFER_MAX, written = 0, found = 0;
+  gzFile *in, *out;
+
+  seprintf(tmp, FILE_MAX, "%s.new", file);
+  line = alloc(size);
+  in   = gzf_open(file, "r");
+  out  = gzf_open(tmp, "w");
+
+  while(ntx_getl(in, file, &line, &size)) {
+    if(strncmp(id, line, 4) == 0) {
+      if(fix) written += gzf_putl(out, fix);
+      found = 1;
+    } else written += gzf_putl(out, line);
+  }
+  release(out);
+  release(in);
+  release(line);
+
+  if(rename(tmp, file) != 0) throw(E_FACCESS, file);
+  if(written == 0) remove(file); /* Remove the file if it is empty. */
+  manifest_update(file);
+  return found;
+}
+
 /* Open the file, read the whole thing in a line at a time,
  * replacing the line beginning with the 4-digit hex 'id' with
  * the line 'fix'.
@@ -199,8 +295,17 @@ int ntx_replace(char *file, char *id, char *fix)
 {
   char *ptr, *end;
   unsigned int written, found = 0;
-  char *buf = ntx_buffer(file);
-  gzFile *f = gzf_open(file, "w");
+  char *buf;
+  gzFile *f;
+
+  stats_begin(PH_UPDATE);
+  if(ntx_streams(file)) {
+    found = ntx_restream(file, id, fix);
+    stats_end(PH_UPDATE);
+    return found;
+  }
+  buf = ntx_buffer(file);
+  f   = gzf_open(file, "w");
 
   /* Parse the buffer contents to find the given position. */
   for(ptr = buf; *ptr; ptr = end+1) {
@@ -215,13 +320,30 @@ int ntx_replace(char *file, char *id, char *fix)
   release(buf);
 
   if(written == 0) remove(file); /* Remove the file if it is empty. */
+  manifest_update(file);
+  stats_end(PH_UPDATE);
   return found;
 }
 
 char *ntx_find(char *file, char *id)
 {
-  char *buf = ntx_buffer(file);
-  char *ptr, *end;
+  char *buf, *ptr, *end;
+  unsigned int size = BUFFER_MAX;
+  gzFile *f;
+
+  if(ntx_streams(file)) {
+    buf = alloc(size);
+    f = gzf_open(file, "r");
+    while((ptr = ntx_getl(f, file, &buf, &size)) && strncmp(id, ptr, 4));
+    release(f);
+    if(!ptr) {
+      release(buf);
+      return NULL;
+    }
+    buf[strlen(buf) - 1] = '\0';
+    return buf;
+  }
+  buf = ntx_buffer(file);
 
   /* Parse the buffer contents to find the given position. */
   for(ptr = buf; *ptr; ptr = end + 1) {
@@ -240,29 +362,32 @@ char *ntx_find(char *file, char *id)
 
 void ntx_append(char *file, char *str)
 {
-  gzFile *f = gzf_open(file, "a");
+  gzFile *f;
+
+  stats_begin(PH_UPDATE);
+  f = gzf_open(file, "a");
   gzf_putl(f, str);
   release(f);
+  manifest_append(file);
+  stats_end(PH_UPDATE);
 }
 
 /* Front-end functions, user interaction. */
 void ntx_add(char **tags)
 {
-  char file[FILE_MAX], note[SUMREC_LENGTH];
+  char file[FILE_MAX], note[SUMREC_LENGTH], id[ID_LENGTH + 1];
   char **ptr, *tmp;
   unsigned int num;
   exception_t exc;
 
+  for(ptr = tags; *ptr != NULL; ptr++) ntx_tagname(*ptr);
+
   srand(time(NULL));
   num = rand() & 0xffff;
 
   while(1) {
-    FILE *nout = NULL;
-
     seprintf(file, FILE_MAX, NOTES_DIR"/%04x", num);
-    try nout = raw_open(file, "r");
-    catch(exc) if(exc.type == E_FACCESS) break;
-    release(nout);
+    if(!note_exists(file)) break;
     num = (num + 1) & 0xffff;
   }
 
@@ -279,17 +404,25 @@ void ntx_add(char **tags)
       exit(EXIT_SUCCESS);
     } else throw(exc.type, exc.value);
   }
+  note_store(file);
 
   /* Fill in the identification information. */
   strncpy(note, file + strlen(NOTES_DIR) + 1, ID_LENGTH);
   note[4] = ID_SEP;
 
   for(ptr = tags; *ptr != NULL; ptr++) {
+    struct filter *filter = filter_begin(*ptr);
+
     seprintf(file, FILE_MAX, TAGS_DIR"/%s", *ptr);
     ntx_append(file, note);
+    filter_end(filter, note);
   }
 
+  view_update(note, NULL, tags);
+  grams_add(note);
+
   /* Add the new note to the base index. */
+  cache_dropindex();
   ntx_append(INDEX_FILE, note);
 
   /* Append the tags to the backreference file. */
@@ -298,6 +431,12 @@ void ntx_add(char **tags)
   ntx_append(file, tmp);
   release(tmp);
 
+  /* Record when the note was created. */
+  strncpy(id, note, ID_LENGTH);
+  id[ID_LENGTH] = '\0';
+  times_record(id, 1);
+  related_update(id, tags, 1);
+
   /* Dump the summary to STDOUT as confirmation that everything went well. */
   fputs(note, stdout);
 }
@@ -306,20 +445,22 @@ void ntx_edit(char **ids)
 {
   char file[FILE_MAX], head[SUMMARY_LENGTH + PADDING_LENGTH];
   char note[SUMREC_LENGTH];
-  char *state = NULL;
+  int changed;
 
   for(; *ids != NULL; ids++) {
     seprintf(file, FILE_MAX, NOTES_DIR"/%s", *ids);
 
-    /* Check that the note exists first, then edit it. */
-    ntx_summary(file, head);
+    /* Check that the note exists first, then edit it as a file. */
+    note_summary(file, head);
+    note_checkout(file);
     ntx_editor(file);
 
     /* See if the header has changed; If so, rewrite the headers. */
     /* XXX: If we can't reread the file, do we need to take action? */
     ntx_summary(file, note + SUMMARY_OFFSET);
+    changed = note_store(file);
     if(strcmp(head, note + SUMMARY_OFFSET)) {
-      char *tags, *cur;
+      char *tags, **tagv, **cur;
 
       /* Fill in the identification information. */
       strncpy(note, *ids, ID_LENGTH);
@@ -329,21 +470,28 @@ void ntx_edit(char **ids)
       if(!(tags = ntx_find(file, *ids)))
         die("Unable to locate note %s in %s.", *ids, file);
 
-      for(cur = strrtok(tags + SUMMARY_OFFSET, &state, FIELD_SEP);
-          cur != NULL;
-          cur = strrtok(NULL, &state, FIELD_SEP))
-      {
+      tagv = strtokens(tags + SUMMARY_OFFSET, FIELD_SEP);
+      for(cur = tagv; *cur != NULL; cur++) {
         /* Update the tags - O(n) search through the affected indices. */
-        seprintf(file, FILE_MAX, TAGS_DIR"/%s", cur);
+        seprintf(file, FILE_MAX, TAGS_DIR"/%s", *cur);
         if(ntx_replace(file, *ids, note) == 0)
           die("Unable to locate note %s in %s.", *ids, file);
       }
+      view_update(note, tagv, tagv);
+      grams_add(note);
+      release(tagv);
       release(tags);
 
       /* Update the index file. */
+      cache_dropindex();
       if(ntx_replace(INDEX_FILE, *ids, note) == 0)
         die("Unable to locate note %s in %s.", *ids, file);
     }
+    /* An unchanged note keeps its modification time. */
+    if(changed) {
+      times_record(*ids, 0);
+      related_update(*ids, NULL, 1);
+    }
 
     /* Dump the summary to STDOUT as confirmation that everything went well. */
     fputs(note, stdout);
@@ -353,9 +501,24 @@ void ntx_edit(char **ids)
 
 /* Helper functions for calculating multi-tag intersection. */
 
-struct fstats { /* Structure for sorting files by size. */
+struct fstats { /* Structure for sorting and loading files by size. */
   char *path;
   unsigned int size;
+
+  /* The file as read by ntx_loadall; -1 if it couldn't be, and -2 if *
+   * it wasn't read ahead of inflating.                                */
+  char *raw;
+  long int rawlen;
+
+  /* Filled in by ntx_inflate. */
+  char *buf;
+  unsigned int len;
+  exception_t exc;
+};
+
+struct posting { /* A line of the driving tag, and the tags it was found in. */
+  char *line;
+  unsigned int len, refs;
 };
 
 int ntx_sortstat(const void *a, const void *b)
@@ -363,10 +526,60 @@ int ntx_sortstat(const void *a, const void *b)
   return ((struct fstats*)a)->size - ((struct fstats*)b)->size;
 }
 
+/* Read an entire tag file on a worker thread. Failures are kept in  *
+ * 'exc' for the caller to rethrow, and the buffer is disowned so that *
+ * the caller can take it over.                                        */
+void ntx_inflate(void *v)
+{
+  struct fstats *s = v;
+
+  s->buf = NULL;
+  s->exc.type = E_NONE;
+
+  try {
+    if(s->rawlen == -2) s->buf = ntx_buffer(s->path);
+    else if(s->rawlen == -1) throw(E_FACCESS, s->path);
+    else s->buf = gzb_inflate(s->raw, s->rawlen, s->path);
+    s->len = strlen(s->buf);
+    disown(s->buf);
+  } catch(s->exc) s->buf = NULL;
+}
+
+/* Files too small to be worth setting up a batch of reads for, in all. */
+#define READALL_MIN (64 * 1024)
+
+/* Inflate several tag files on the workers. Where the system can, they  *
+ * are all read at once beforehand, so that their latencies overlap, and *
+ * the workers only inflate them; Otherwise each worker reads its own.   */
+void ntx_loadall(struct fstats *files, unsigned int n)
+{
+  char **paths = alloc(n * sizeof(char *)), **raws = alloc(n * sizeof(char *));
+  long int *lens = alloc(n * sizeof(long int));
+  unsigned long total = 0;
+  unsigned int i;
+  int read;
+
+  for(i = 0; i < n; i++) {
+    paths[i] = files[i].path;
+    total += files[i].size;
+  }
+  read = n > 1 && total >= READALL_MIN && raw_readall(paths, n, raws, lens) == 0;
+  for(i = 0; i < n; i++) {
+    files[i].raw    = read ? raws[i] : NULL;
+    files[i].rawlen = read ? lens[i] : -2;
+  }
+
+  sched_each(ntx_inflate, files, sizeof(struct fstats), n);
+  for(i = 0; read && i < n; i++) if(raws[i]) release(raws[i]);
+  release(lens);
+  release(raws);
+  release(paths);
+}
+
 unsigned long hash_line(void *v)
 {
   /* Just hash the 4-char prefix. */
-  return hasht_hash(((char*)v)+1, 4, 0);
+  return hasht_hash(((struct posting*)v)->line, 4, 0);
 }
 
 unsigned long hash_val(void *v)
@@ -378,131 +591,639 @@ unsigned long hash_val(void *v)
 int cmp_line(void *a, void *b)
 {
   /* Just compare the 4-char prefix. */
-#define Cabv(v) (((char*)a)[v] == ((char*)b)[v])
-  return ((Cabv(1) && Cabv(2) && Cabv(3) && Cabv(4)) ? 0 : 1);
-#undef  Cabv
+  return strncmp(((struct posting*)a)->line, ((struct posting*)b)->line, 4);
 }
 
 int cmp_val(void *a, void *b)
 {
   /* Just compare the 4-char prefix. */
-#define Cabv(v) (((char*)a)[v] == ((char*)b)[v-1])
-  return ((Cabv(1) && Cabv(2) && Cabv(3) && Cabv(4)) ? 0 : 1);
-#undef  Cabv
+  return strncmp(((struct posting*)a)->line, (char*)b, 4);
+}
+
+/* Count the lines in a buffer, checking that each one is terminated. */
+unsigned int ntx_lines(char *buf, char *file)
+{
+  unsigned int lines = 0;
+  char *end;
+
+  for(; *buf; buf = end + 1, lines++)
+    if(!(end = strchr(buf, '\n'))) throw(E_INVAL, file);
+  return lines;
+}
+
+/* Intersect the loaded tag files, returning the lines of the first (the *
+ * smallest) which are in every one, or an empty string if there are none. */
+char *ntx_intersect(struct fstats *files, unsigned int tagc)
+{
+  char *ptr, *end, *result;
+  hash_t *table;
+  struct posting *postings, *p;
+  unsigned int i, n, len, exists = 1;
+
+  /* Now, hash the lines of the first, and check it with each buffer. */
+  n = ntx_lines(files[0].buf, files[0].path);
+  postings = alloc(sizeof(struct posting) * (n ? n : 1));
+  table = hasht_init(n, NULL, hash_line, hash_val, cmp_line, cmp_val);
+  if(!table) throw(E_NOMEM, NULL);
+  resource(table, (resource_handler)hasht_free);
+
+  for(p = postings, ptr = files[0].buf; *ptr; ptr = end + 1, p++) {
+    end = strchr(ptr, '\n');
+    p->line = ptr;
+    p->len  = end - ptr + 1;
+    p->refs = hasht_get(table, ptr) ? 0 : 1; /* Ignore duplicates. */
+    if(p->refs) hasht_add(table, p);
+  }
+
+  /* Check each buffer against the hash, incrementing found refs. *
+   * We will stop if exists == 0, meaning none were found.        */
+  for(i = 1; i < tagc && exists; i++) {
+    exists = 0;
+    ntx_lines(files[i].buf, files[i].path);
+
+    for(ptr = files[i].buf; *ptr; ptr = strchr(ptr, '\n') + 1) {
+      if((p = hasht_get(table, ptr)) && p->refs == i) {
+        p->refs++; /* Increment the refcount. */
+        exists = 1;
+      }
+    }
+  }
+  if(!exists) n = 0;
+
+  /* Gather all of the lines which had 'tagc' references, in order. */
+  for(i = len = 0; i < n; i++)
+    if(postings[i].refs == tagc) len += postings[i].len;
+  result = alloc(len + 1);
+
+  for(i = len = 0; i < n; i++) {
+    if(postings[i].refs != tagc) continue;
+    memcpy(result + len, postings[i].line, postings[i].len);
+    len += postings[i].len;
+  }
+  result[len] = '\0';
+
+  stats_table(table, "list");
+  release(table);
+  release(postings);
+  return result;
+}
+
+struct refs { /* The tags of notes, from their refs buckets as needed. */
+  char *buckets[256];
+  char **tagsof; /* Into the buckets, by ID; NULL for notes without any. */
+};
+
+void refs_begin(struct refs *r)
+{
+  memset(r->buckets, 0, sizeof(r->buckets));
+  r->tagsof = alloc(65536 * sizeof(char *));
+  memset(r->tagsof, 0, 65536 * sizeof(char *));
+}
+
+/* The tags of a note, as its refs list them, or NULL if it has none. */
+char *refs_tags(struct refs *r, unsigned int id)
+{
+  char file[FILE_MAX], *ref, *next;
+  exception_t exc;
+
+  if(!r->buckets[id >> 8]) { /* Load the bucket, and find each note's tags. */
+    seprintf(file, FILE_MAX, REFS_DIR"/%02x", id >> 8);
+    try r->buckets[id >> 8] = ntx_buffer(file);
+    catch(exc) {
+      if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+      r->buckets[id >> 8] = strdupe("");
+    }
+    for(ref = r->buckets[id >> 8]; *ref; ref = next + 1) {
+      if(!(next = strchr(ref, '\n'))) throw(E_INVAL, file);
+      *next = '\0';
+      if(next - ref >= SUMMARY_OFFSET && ref[ID_LENGTH] == ID_SEP)
+        r->tagsof[strtol(ref, NULL, 16) & 0xffff] = ref + SUMMARY_OFFSET;
+    }
+  }
+  return r->tagsof[id];
+}
+
+/* Whether 'tag' is a whole field of a list of tags from refs_tags. */
+int refs_has(char *tags, char *tag)
+{
+  unsigned int len = strlen(tag);
+  char *at;
+
+  for(at = tags; (at = strstr(at, tag)); at++)
+    if((at == tags || at[-1] == *FIELD_SEP) && at[len] == *FIELD_SEP) return 1;
+  return 0;
+}
+
+void refs_end(struct refs *r)
+{
+  unsigned int i;
+
+  for(i = 0; i < 256; i++) if(r->buckets[i]) release(r->buckets[i]);
+  release(r->tagsof);
+}
+
+/* Check the lines of the first tag against the refs of their notes,    *
+ * keeping those which name every other tag. This answers from the refs *
+ * alone, which agree with the tag files in any store ntx has written;  *
+ * Where they don't, ntx fsck reports it, and --repair gives each note  *
+ * every tag found in either.                                           */
+char *ntx_byrefs(char *buf, struct fstats *files, unsigned int tagc)
+{
+  char *line, *end, *tags;
+  unsigned int i, id, out = 0;
+  struct refs r;
+
+  refs_begin(&r);
+  for(line = buf; *line; line = end + 1) {
+    end = strchr(line, '\n');
+    id = strtol(line, NULL, 16) & 0xffff;
+
+    if(!(tags = refs_tags(&r, id))) continue;
+    for(i = 1; i < tagc; i++)
+      if(!refs_has(tags, files[i].path + strlen(TAGS_DIR) + 1)) break;
+    if(i < tagc) continue;
+
+    memmove(buf + out, line, end - line + 1);
+    out += end - line + 1;
+  }
+  buf[out] = '\0';
+
+  refs_end(&r);
+  return buf;
+}
+
+/* Intersect using the Bloom filters of the tags, if all are current. The *
+ * notes of the first tag which any other filter rules out are dropped    *
+ * before the other tag files are read, and if the rest are few, they are *
+ * checked against their refs, rather than reading the other tags at all. *
+ * Returns NULL, still loading, if the filters can't be used; Otherwise   *
+ * the intersection phase has begun.                                      */
+char *ntx_filtered(struct fstats *files, unsigned int tagc)
+{
+  struct filter **fs = alloc(tagc * sizeof(struct filter *));
+  char file[FILE_MAX], *buf, *ptr, *next, *out;
+  unsigned char buckets[256];
+  unsigned int i, id, valid = 1;
+  long int refs = 0, rest = 0, size;
+
+  for(i = 0; i < tagc; i++) {
+    fs[i] = filter_begin(files[i].path + strlen(TAGS_DIR) + 1);
+    if(!fs[i]->valid) valid = 0;
+  }
+
+  if(!valid) buf = NULL;
+  else if(filter_disjoint(fs, tagc)) { /* No note could have every tag. */
+    buf = strdupe("");
+    stats_end(PH_LOAD);
+    stats_begin(PH_INTERSECT);
+  } else {
+    buf = ntx_buffer(files[0].path);
+    ntx_lines(buf, files[0].path);
+    memset(buckets, 0, sizeof(buckets));
+
+    for(ptr = out = buf; *ptr; ptr = next) {
+      next = strchr(ptr, '\n') + 1;
+      id = strtol(ptr, NULL, 16) & 0xffff;
+      for(i = 1; i < tagc && filter_test(fs[i], id); i++);
+      if(i < tagc) {
+        STAT(ST_FILTERED, 1);
+        continue;
+      }
+      memmove(out, ptr, next - ptr);
+      out += next - ptr;
+      buckets[id >> 8] = 1;
+    }
+    *out = '\0';
+
+    /* Compare the compressed sizes of the refs and the other tag files. */
+    for(i = 0; i < 256; i++) {
+      if(!buckets[i]) continue;
+      seprintf(file, FILE_MAX, REFS_DIR"/%02x", i);
+      if((size = ntx_flen(file)) > 0) refs += size;
+    }
+    for(i = 1; i < tagc; i++) rest += files[i].size;
+
+    if(!*buf || refs < rest) {
+      stats_end(PH_LOAD);
+      stats_begin(PH_INTERSECT);
+      if(*buf) buf = ntx_byrefs(buf, files, tagc);
+    } else {
+      files[0].buf = buf;
+      ntx_loadall(files + 1, tagc - 1);
+      for(i = 1; i < tagc; i++) if(files[i].buf) resource(files[i].buf, free);
+      for(i = 1; i < tagc; i++)
+        if(files[i].exc.type != E_NONE)
+          throw(files[i].exc.type, files[i].exc.value);
+      stats_end(PH_LOAD);
+
+      stats_begin(PH_INTERSECT);
+      buf = ntx_intersect(files, tagc);
+      for(i = 0; i < tagc; i++) release(files[i].buf);
+    }
+  }
+
+  for(i = 0; i < tagc; i++) filter_free(fs[i]);
+  release(fs);
+  return buf;
+}
+
+/* Intersect tag files too large to load, a line at a time: Each tag but  *
+ * the smallest marks the IDs it has, and the lines of the smallest which  *
+ * every other tag marked are the result. Only a bit is kept for each ID.  */
+char *ntx_streamed(struct fstats *files, unsigned int tagc)
+{
+  unsigned char *all = alloc(65536 / 8), *has = alloc(65536 / 8);
+  unsigned int size = BUFFER_MAX, rsize = BUFFER_MAX, rlen = 0, len, i, b, id;
+  char *line = alloc(size), *result = alloc(rsize);
+  gzFile *f;
+
+  stats_end(PH_LOAD);
+  stats_begin(PH_INTERSECT);
+  memset(all, 0xff, 65536 / 8);
+
+  for(i = 1; i < tagc; i++) {
+    memset(has, 0, 65536 / 8);
+    f = gzf_open(files[i].path, "r");
+    while(ntx_getl(f, files[i].path, &line, &size)) {
+      id = strtol(line, NULL, 16) & 0xffff;
+      has[id / 8] |= 1 << (id % 8);
+    }
+    release(f);
+    for(b = 0; b < 65536 / 8; b++) all[b] &= has[b];
+  }
+
+  *result = '\0';
+  f = gzf_open(files[0].path, "r");
+  while(ntx_getl(f, files[0].path, &line, &size)) {
+    id = strtol(line, NULL, 16) & 0xffff;
+    if(!(all[id / 8] & (1 << (id % 8)))) continue;
+
+    len = strlen(line);
+    while(rlen + len >= rsize) result = ralloc(result, rsize *= 2);
+    memcpy(result + rlen, line, len + 1);
+    rlen += len;
+  }
+  release(f);
+
+  release(line);
+  release(has);
+  release(all);
+  return result;
+}
+
+/* Return the lines of the notes with every one of 'tags', from the cache *
+ * if possible. The load phase is begun here, and every phase is ended.   */
+char *ntx_select(char **tags, unsigned int tagc)
+{
+  char *name, *key, *result;
+  struct fstats *files;
+  unsigned int i, len;
+  long int size;
+
+  stats_begin(PH_LOAD);
+
+  if(tagc == 1) {
+    char file[FILE_MAX];
+
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", *tags);
+    result = ntx_buffer(file);
+    ntx_lines(result, file);
+    stats_end(PH_LOAD);
+    return result;
+  }
+
+  /* Sort the files; We'll likely be best starting with the smallest. */
+  /* Stat and load the files into the buffers for sorting. */
+  files = alloc(sizeof(struct fstats) * tagc);
+  for(i = 0; i < tagc; i++) {
+    len = 6 + strlen(tags[i]);
+    name = alloc(len);
+    seprintf(name, len, TAGS_DIR"/%s", tags[i]);
+
+    if((size = ntx_flen(name)) == -1) die("Unable to open %s.", name);
+    files[i].path = name;
+    files[i].size = size;
+  }
+
+  qsort(files, tagc, sizeof(struct fstats), ntx_sortstat);
+
+  /* Answer from the cache, unless one of the tag files has changed. */
+  if((key = cache_key(tags, tagc)) && (result = cache_lookup(key)))
+    stats_end(PH_LOAD);
+  else {
+    /* Under --memory, tags too large to load are streamed instead. */
+    if(ntx_budget && files[tagc - 1].size > ntx_budget)
+      result = ntx_streamed(files, tagc);
+    else if(!(result = ntx_filtered(files, tagc))) {
+      /* Inflate every file at once, then take over the buffers. */
+      ntx_loadall(files, tagc);
+      for(i = 0; i < tagc; i++) if(files[i].buf) resource(files[i].buf, free);
+      for(i = 0; i < tagc; i++)
+        if(files[i].exc.type != E_NONE)
+          throw(files[i].exc.type, files[i].exc.value);
+      stats_end(PH_LOAD);
+
+      stats_begin(PH_INTERSECT);
+      result = ntx_intersect(files, tagc);
+      for(i = 0; i < tagc; i++) release(files[i].buf);
+    }
+    if(key) cache_store(key, result);
+    stats_end(PH_INTERSECT);
+  }
+
+  /* Clean up the key and fstats structures. */
+  if(key) release(key);
+  for(i = 0; i < tagc; i++) release(files[i].path);
+  release(files);
+  return result;
+}
+
+/* Parse a time as seconds since the epoch (@N), or a local date and time *
+ * as YYYY-MM-DD, optionally followed by 'T' or a space and HH:MM[:SS].   */
+long int ntx_time(char *arg)
+{
+  struct tm tm;
+  char *end;
+  int n = 0, m = 0;
+
+  if(*arg == '@') {
+    long int t = strtol(arg + 1, &end, 10);
+    if(end == arg + 1 || *end) die("Invalid time %s.", arg);
+    return t;
+  }
+
+  memset(&tm, 0, sizeof(tm));
+  if(sscanf(arg, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3)
+    die("Invalid time %s.", arg);
+  if((arg[n] == 'T' || arg[n] == ' ') &&
+     sscanf(arg + n + 1, "%d:%d%n", &tm.tm_hour, &tm.tm_min, &m) == 2) {
+    n += m + 1;
+    if(arg[n] == ':' && sscanf(arg + n + 1, "%d%n", &tm.tm_sec, &m) == 1)
+      n += m + 1;
+  }
+  if(arg[n]) die("Invalid time %s.", arg);
+
+  tm.tm_year -= 1900;
+  tm.tm_mon  -= 1;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+struct span { /* The notes to list by time, from the options of ntx list. */
+  long int since, until;
+  unsigned int limit, count;
+  int reverse;
+
+  char **tags; /* The tags which each note listed must have. */
+  unsigned int tagc;
+  struct filter **fs; /* Their filters, if every one is current; Or NULL. */
+  struct refs *refs;
+  unsigned short *ids; /* For --reverse, each note found, newest first. */
+};
+
+/* Fill in the line of a note, returning 0 if it shouldn't be listed. */
+int ntx_timedline(struct span *sp, unsigned int id, char *line)
+{
+  char file[FILE_MAX], *tags;
+  exception_t exc;
+  unsigned int i;
+
+  /* The note must have every tag, which the filters may rule out first. */
+  if(sp->tagc) {
+    for(i = 0; sp->fs && i < sp->tagc; i++)
+      if(!filter_test(sp->fs[i], id)) {
+        STAT(ST_FILTERED, 1);
+        return 0;
+      }
+    if(!(tags = refs_tags(sp->refs, id))) return 0;
+    for(i = 0; i < sp->tagc; i++) if(!refs_has(tags, sp->tags[i])) return 0;
+  }
+
+  /* Any note which still exists is listed. */
+  seprintf(line, SUMREC_LENGTH, "%04x%c", id, ID_SEP);
+  seprintf(file, FILE_MAX, NOTES_DIR"/%04x", id);
+  try note_summary(file, line + SUMMARY_OFFSET);
+  catch(exc) return 0;
+  return 1;
+}
+
+int ntx_timednote(struct stamp *s, void *arg)
+{
+  struct span *sp = arg;
+  char line[SUMREC_LENGTH];
+  unsigned int id = strtol(s->id, NULL, 16);
+
+  /* The log is in order of time, so nothing after this is recent enough. */
+  if(s->modified < sp->since) return 0;
+  if(s->modified > sp->until) return 1;
+
+  if(sp->reverse) {
+    sp->ids[sp->count++] = id;
+    return 1;
+  }
+
+  if(!ntx_timedline(sp, id, line)) return 1;
+  out_note(line, strlen(line));
+  return ++sp->count != sp->limit;
+}
+
+/* List the notes with 'tags' from the most recently modified, stopping *
+ * as soon as enough have been found; --reverse lists the oldest first. *
+ * Rather than intersecting the tag files, each note is checked against *
+ * its refs as the log reaches it, so only the notes looked at cost.    */
+void ntx_timed(char **tags, unsigned int tagc, struct span *sp)
+{
+  char file[FILE_MAX], line[SUMREC_LENGTH];
+  struct filter **fs = NULL;
+  struct refs refs;
+  unsigned int i, n;
+
+  stats_begin(PH_LOAD);
+  sp->tags = tags;
+  sp->tagc = tagc;
+  if(tagc) {
+    fs = alloc(tagc * sizeof(struct filter *));
+    for(i = 0; i < tagc; i++) {
+      seprintf(file, FILE_MAX, TAGS_DIR"/%s", tags[i]);
+      ntx_flen(file); /* Every tag must exist. */
+      fs[i] = filter_begin(tags[i]);
+    }
+    for(i = 0; i < tagc && fs[i]->valid; i++);
+    if(i == tagc) sp->fs = fs;
+
+    refs_begin(&refs);
+    sp->refs = &refs;
+  }
+  stats_end(PH_LOAD);
+
+  if(sp->reverse) sp->ids = alloc(65536 * sizeof(unsigned short));
+
+  stats_begin(PH_OUTPUT);
+  times_walk(ntx_timednote, sp);
+
+  /* The oldest notes were found last. */
+  for(i = sp->count, n = 0; sp->reverse && i-- > 0 && n != sp->limit; )
+    if(ntx_timedline(sp, sp->ids[i], line)) {
+      out_note(line, strlen(line));
+      n++;
+    }
+  stats_end(PH_OUTPUT);
+
+  if(sp->ids) release(sp->ids);
+  if(tagc) {
+    refs_end(&refs);
+    for(i = 0; i < tagc; i++) filter_free(fs[i]);
+    release(fs);
+  }
+}
+
+/* Parse the number of notes given to --limit, which must be at least one. */
+static unsigned int ntx_limit(char *arg)
+{
+  unsigned long n;
+  char *end;
+
+  errno = 0;
+  n = strtoul(arg, &end, 10);
+  if(*arg < '0' || *arg > '9' || *end || !n || errno || n > UINT_MAX)
+    die("Invalid limit %s.", arg);
+  return n;
 }
 
 /* XXX: hasht_* error checking. */
 void ntx_list(char **tags, unsigned int tagc)
 {
-  char line[SUMREC_LENGTH];
   exception_t exc;
-  gzFile *f;
+  struct span span = {LONG_MIN, LONG_MAX, 0, 0, 0, NULL, 0, NULL, NULL, NULL};
+  int timed = 0;
+
+  out_begin();
+  /* Options, which list by time, come before the tags. */
+  while(tagc && !strncmp(*tags, "--", 2)) {
+    char *opt = *tags++;
+
+    tagc--;
+    timed = 1;
+    if(!strcmp(opt, "--reverse")) {
+      span.reverse = 1;
+      continue;
+    }
+
+    if(strcmp(opt, "--since") && strcmp(opt, "--until") &&
+       strcmp(opt, "--limit"))
+      die("Unknown option %s.", opt);
+    if(!tagc) die("Option %s needs a value.", opt);
+
+    if(opt[2] == 's')      span.since = ntx_time(*tags);
+    else if(opt[2] == 'u') span.until = ntx_time(*tags);
+    else                   span.limit = ntx_limit(*tags);
+    tags++;
+    tagc--;
+  }
 
   /* Too many tags for proper ref-counting, or even sane evaluation. */
   if(tagc > 127) die("Too many (more than 127) tags.");
+  if(timed) {
+    ntx_timed(tags, tagc, &span);
+    return;
+  }
 
+  /* Without an intersection, ntx list is all output. */
+  if(tagc < 2) stats_begin(PH_OUTPUT);
   if(tagc == 0) { /* No tags specified, open the index. */
+    char *buf = NULL;
+
+    /* Suppress errors due to a missing index, as this simply *
+     * means that there are no notes in the database.         */
     try {
-      /* Duplicate each line from the index to STDOUT. */
-      f = gzf_open(INDEX_FILE, "r");
-      while(gzf_getl(f, line, SUMREC_LENGTH)) fputs(line, stdout);
-      release(f);
-    } catch(exc) {
-      /* Suppress errors due to a missing index, as this simply *
-       * means that there are no notes in the database.         */
-      if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+      if(ntx_streams(INDEX_FILE)) ntx_outlines(INDEX_FILE);
+      else if(!out_plain() || !cache_index()) buf = ntx_buffer(INDEX_FILE);
+    } catch(exc) if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+    if(buf) {
+      out_notes(buf);
+      if(out_plain()) cache_keepindex(buf);
+      release(buf);
     }
   } else if(tagc == 1) { /* No need to calculate the intersection. */
-    char name[FILE_MAX];
+    char name[FILE_MAX], *buf;
 
-    seprintf(name, FILE_MAX, TAGS_DIR"/%s", *tags);
-    f = gzf_open(name, "r");
+    /* A view (@name) is read just as a tag is, if it has any notes. */
+    if(**tags != '@') seprintf(name, FILE_MAX, TAGS_DIR"/%s", *tags);
+    else if(!view_file(*tags + 1, name)) *name = '\0';
 
-    /* Duplicate each line from the index to STDOUT. */
-    while(gzgets(f, line, SUMREC_LENGTH)) fputs(line, stdout);
-    release(f);
-  } else { /* Calculate the union of the sets from the tag files. */
-    char *name;
-    hash_t *table;
-    struct fstats *files = alloc(sizeof(struct fstats) * tagc);
-    unsigned int i, len, exists;
-    long int size;
+    if(*name && ntx_streams(name)) ntx_outlines(name);
+    else if(*name) {
+      buf = ntx_buffer(name);
+      out_notes(buf);
+      release(buf);
+    }
+  } else { /* Calculate the intersection of the sets from the tag files. */
+    char *result = ntx_select(tags, tagc);
 
-    /* Sort the files; We'll likely be best starting with the smallest. */
-    /* Stat and load the files into the buffers for sorting. */
-    for(i = 0; i < tagc; i++) {
-      len = 6 + strlen(tags[i]);
-      name = alloc(len);
-      seprintf(name, len, TAGS_DIR"/%s", tags[i]);
+    stats_begin(PH_OUTPUT);
+    if(!*result) die("No notes exist in the intersection of those tags.");
+    out_notes(result);
+    release(result);
+  }
+  stats_end(PH_OUTPUT);
+}
 
-      if((size = ntx_flen(name)) == -1) die("Unable to open %s.", name);
-      files[i].path = name;
-      files[i].size = size;
-    }
+void ntx_put(char **ids)
+{
+  char file[FILE_MAX], *body, *rev, *end;
+  unsigned long n, off, size;
+  unsigned int len, i;
+  FILE *f;
 
-    qsort(files, tagc, sizeof(struct fstats), ntx_sortstat);
+  out_begin();
 
-    /* Now, load the first, and check it with each hash. */
-    f = gzf_open(files[0].path, "r");
-    table = hasht_init(120, release, hash_line, hash_val, cmp_line, cmp_val);
-    if(!table) return;
+  /* Ask for every note at once, so they are read ahead of being written. */
+  for(i = 0; ids[1] && ids[i]; i++) {
+    if(strchr(ids[i], '@')) continue;
+    seprintf(file, FILE_MAX, NOTES_DIR"/%s", ids[i]);
+    note_prefetch(file);
+  }
 
-    /* Read each line in the index into the hash. */
-    while(gzf_getl(f, line, SUMREC_LENGTH)) {
-      name = alloc(strlen(line) + 2); /* Save room for the ref and null. */
-      name[0] = 1;
-      strcpy(name+1, line);
-      if((name = hasht_add(table, name))) release(name);
+  for(; *ids; ids++) {
+    /* An earlier version is named by its revision, as "id@rev". */
+    if((rev = strchr(*ids, '@'))) {
+      *rev++ = '\0';
+      n = strtoul(rev, &end, 10);
+      if(!ntx_isid(*ids) || end == rev || *end ||
+         !(body = history_read(*ids, n, &len)))
+        die("Note %s has no revision %s.", *ids, rev);
+      out_body(*ids, body, len);
+      release(body);
+      continue;
     }
-    release(f);
-   
-    /* Load and check each hash against this one, incrementing found refs. *
-     * We will abort if exists == 0, meaning none were found.              */
-    for(i = 1; i < tagc; i++) {
-      exists = 0;
-      f = gzf_open(files[i].path, "r");
-
-      while(gzgets(f, line, SUMREC_LENGTH)) {
-        if((name = hasht_get(table, line))) {
-          name[0]++; /* Increment the refcount. */
-          exists = 1;
-        }
-      }
-      release(f);
+    seprintf(file, FILE_MAX, NOTES_DIR"/%s", *ids);
 
-      if(exists == 0) 
-        die("No notes exist in the intersection of those tags.");
+    /* Copy a note stored as it is straight out; Otherwise, read it whole. */
+    if((f = note_open(file, &off, &size))) {
+      out_file(*ids, f, off, size);
+      release(f);
+    } else {
+      body = note_read(file, &len);
+      out_body(*ids, body, len);
+      release(body);
     }
-
-    /* Print all of the tags which had 'tagc' references. */
-    while((name = hasht_next(table)))
-      if(name[0] == tagc) fputs(name+1, stdout);
-
-    /* Clean up the hash and fstats structures. */
-    hasht_free(table);
-    release(files);
   }
 }
 
-void ntx_put(char *id)
+/* List the revisions of a note, newest first. */
+void ntx_log(char *id)
 {
-  FILE *f;
   char file[FILE_MAX];
-  char buffer[BUFFER_MAX];
 
   seprintf(file, FILE_MAX, NOTES_DIR"/%s", id);
-  f = raw_open(file, "r");
-
-  /* Duplicate each line from the note to STDOUT. */
-  while(raw_getl(f, buffer, BUFFER_MAX)) fputs(buffer, stdout);
-  release(f);
+  if(!ntx_isid(id) || !note_exists(file)) die("Unable to locate note %s.", id);
+  history_log(id);
 }
 
 void ntx_del(char **ids)
 {
   char file[FILE_MAX];
-  char *buf, *cur;
-  char *state = NULL;
+  char *buf, **tagv, **cur;
 
   for(; *ids != NULL; ids++) {
     seprintf(file, FILE_MAX, REFS_DIR"/%.2s", *ids);
@@ -511,17 +1232,22 @@ void ntx_del(char **ids)
     if(!(buf = ntx_find(file, *ids)))
       die("Unable to locate note %s in %s.", *ids, file);
 
-    for(cur = strrtok(buf + SUMMARY_OFFSET, &state, FIELD_SEP);
-        cur != NULL;
-        cur = strrtok(NULL, &state, FIELD_SEP)) {
+    tagv = strtokens(buf + SUMMARY_OFFSET, FIELD_SEP);
+    for(cur = tagv; *cur != NULL; cur++) {
+      struct filter *filter = filter_begin(*cur);
+
       /* Delete the tags - O(n) search through the affected indices. */
-      seprintf(file, FILE_MAX, TAGS_DIR"/%s", cur);
+      seprintf(file, FILE_MAX, TAGS_DIR"/%s", *cur);
       if(ntx_replace(file, *ids, NULL) == 0)
         die("Problem removing info for note %s from %s.", *ids, file);
+      filter_end(filter, NULL);
     }
+    view_update(*ids, tagv, NULL);
+    release(tagv);
     release(buf);
 
     /* Remove it from the index. */
+    cache_dropindex();
     if(ntx_replace(INDEX_FILE, *ids, NULL) == 0)
       die("Problem removing info for note %s from index.", *ids);
 
@@ -529,21 +1255,24 @@ void ntx_del(char **ids)
     seprintf(file, FILE_MAX, REFS_DIR"/%.2s", *ids);
     if(ntx_replace(file, *ids, NULL) == 0)
       die("Problem removing info for note %s from %s.", *ids, file);
+    related_drop(*ids);
 
     /* Remove the note itself from NOTES_DIR. */
     seprintf(file, FILE_MAX, NOTES_DIR"/%s", *ids);
-    if(remove(file) != 0) die("Unable to remove note %s.", *ids);
+    if(note_remove(file) != 0) die("Unable to remove note %s.", *ids);
+    times_drop(*ids);
   }
 }
 
 void ntx_tags(char *id)
 {
+  out_begin();
   if(!id) { /* List all tags in the database. */
     char *name;
     n_dir dir = ntx_dopen(TAGS_DIR);
 
     if(!dir) die("Unable to read directory %s.", TAGS_DIR);
-    while((name = ntx_dread(dir))) if(name[0] != '.') puts(name);
+    while((name = ntx_dread(dir))) if(name[0] != '.') out_tag(name);
 
     ntx_dclose(dir);
   } else { /* List all tags of a note. */
@@ -558,7 +1287,7 @@ void ntx_tags(char *id)
     for(cur = strrtok(buf + SUMMARY_OFFSET, &state, FIELD_SEP);
         cur != NULL;
         cur = strrtok(NULL, &state, FIELD_SEP))
-      puts(cur);
+      out_tag(cur);
 
     release(buf);
   }
@@ -570,9 +1299,11 @@ void ntx_retag(char *id, char **tags)
   char **ntag, **otag, **otags;
   char *buffer;
 
+  for(ntag = tags; *ntag != NULL; ntag++) ntx_tagname(*ntag);
+
   /* Get the summary in case we need to write it. */
   seprintf(file, FILE_MAX, NOTES_DIR"/%s", id); 
-  ntx_summary(file, desc + SUMMARY_OFFSET);
+  note_summary(file, desc + SUMMARY_OFFSET);
 
   /* Fill in the identification information. */
   strncpy(desc, id, ID_LENGTH);
@@ -593,8 +1324,11 @@ void ntx_retag(char *id, char **tags)
         break;
 
     if(!*otag) { /* Add the tag to the file. */
+      struct filter *filter = filter_begin(*ntag);
+
       seprintf(file, FILE_MAX, TAGS_DIR"/%s", *ntag);
       ntx_append(file, desc);
+      filter_end(filter, desc);
     }
   }
 
@@ -605,12 +1339,16 @@ void ntx_retag(char *id, char **tags)
         break;
 
     if(!*ntag) { /* Remove deleted tag. */
+      struct filter *filter = filter_begin(*otag);
+
       seprintf(file, FILE_MAX, TAGS_DIR"/%s", *otag);
       if(ntx_replace(file, id, NULL) == 0)
         die("Unable to locate note %s in %s.", id, file);
+      filter_end(filter, NULL);
     }
   }
 
+  view_update(desc, otags, tags);
   release(otags);
   release(buffer);
 
@@ -621,21 +1359,78 @@ void ntx_retag(char *id, char **tags)
     die("Unable to locate note %s in %s.", id, file);
 
   release(buffer);
+  related_update(id, tags, 0);
 }
 
 void ntx_usage(int retcode)
 {
   /* Abbreviated usage information for ntx. */
-  puts("Usage:\tntx [mode] [arguments] ..\n");
+  puts("Usage:\tntx [options] [mode] [arguments] ..\n");
   puts("Modes:\tadd  [tags ..]\t\tAdd a note to the supplied tags.");
   puts("\tedit [hex ..]\t\tEdit the note(s) in the list of IDs 'hex'.");
   puts("\tlist <tags ..>\t\tList the notes in the intersection of 'tags'.");
-  puts("\tput  [hex]\t\tPrint the note with the ID 'hex' to STDOUT.");
+  puts("\tlist [opts] ..\t\tList them by time, newest first, with:");
+  puts("\t  --since <time>\tOnly notes modified at or after 'time',");
+  puts("\t  --until <time>\tor at or before it; 'time' is @<seconds>");
+  puts("\t\t\t\tor YYYY-MM-DD[THH:MM[:SS]], in local time.");
+  puts("\t  --limit <n>\t\tAt most 'n' notes.");
+  puts("\t  --reverse\t\tThe oldest first.");
+  puts("\tcount <tags ..>\t\tCount the notes in the intersection of 'tags'.");
+  puts("\tfacets <tags ..>\tCount how many of those notes have each other tag,");
+  puts("\t\t\t\tthe most common first.");
+  puts("\tfind [--fuzzy[=k]] [text] <tags ..>");
+  puts("\t\t\t\tList the notes (with 'tags') whose summaries contain");
+  puts("\t\t\t\t'text', ignoring case, or with --fuzzy, come within");
+  puts("\t\t\t\t'k' (or one) edits of it.");
+  puts("\tput  [hex ..]\t\tPrint the note(s) in the list of IDs 'hex' to");
+  puts("\t\t\t\tSTDOUT, or revision 'rev' of one given as 'hex@rev'.");
+  puts("\tlog  [hex]\t\tList the revisions of the note 'hex', newest first.");
+  puts("\trelated [hex] <n>\tList the 'n' (or ten) notes whose tags and text");
+  puts("\t\t\t\tare most like those of the note 'hex'.");
   puts("\trm   [hex ..]\t\tDelete the note(s) in the list of IDs 'hex'.");
   puts("\ttag  <hex>\t\tPrint all tags, or those attached to the ID 'hex'.\n");
   puts("\ttag  [hex] [tags ..]\tRe-tag 'hex' with the list 'tags'.");
+  puts("\ttag-rename [old] [new]\tRename the tag 'old' to 'new'.");
+  puts("\ttag-merge [tags ..] [to]\tMove the notes of 'tags' to the tag 'to'.");
+  puts("\tretag --where [tags ..] [+tag|-tag ..]\n"
+       "\t\t\t\tAdd or remove tags of every note with 'tags'.");
+  puts("\tview [create name tags ..|drop name]");
+  puts("\t\t\t\tList the views, or save the intersection of 'tags'");
+  puts("\t\t\t\tas one kept up to date, read by list @name.");
+  puts("\treindex\t\t\tRebuild the index, tags and refs from the notes,");
+  puts("\t\t\t\tand compact the packs of the notes themselves.");
+  puts("\ttrain [--none]\t\tCompress the notes with a dictionary of the lines");
+  puts("\t\t\t\tthey share, or (with --none) stop compressing them.");
+  puts("\tfsck [--repair]\t\tCheck (or repair) the consistency of the notes.");
   puts("\t-h or --help\t\tPrint this information.\n");
 
+  /* Global options. */
+  puts("Options:\t--format=<text|json|ndjson|nul>");
+  puts("\t\t\tWrite the output of list, tag and put as lines of");
+  puts("\t\t\ttext (the default), JSON, one JSON value per line,");
+  puts("\t\t\tor records terminated by NUL bytes.");
+  puts("\t--fields=<tags,times>\tAdd the tags, or the creation and");
+  puts("\t\t\tmodification times, of each note listed.");
+  puts("\t--memory=<bytes[k|m|g]>\tRead the index, tag and refs files which are");
+  puts("\t\t\tlarger than this (compressed) a line at a time,");
+  puts("\t\t\trather than whole.");
+  puts("\t--stats\t\t\tReport where the time went; See below.\n");
+
+  /* Statistics, for finding out where the time goes. */
+  puts("With --stats, ntx prints the time spent in each phase of the mode,");
+  puts("and counts of the I/O, allocations and hashing it did, to STDERR.");
+  puts("If NTX_STATS names a file, they are appended to it as a JSON line.\n");
+
+  /* The cache of intersections. */
+  puts("The results of listing several tags are cached until one of those");
+  printf("tags changes. NTX_CACHE sets how many are kept (by default, %d),\n",
+         CACHE_ENTRIES);
+  puts("and setting it to 0 disables the cache.\n");
+
+  /* Batched reads. */
+  puts("Where Linux supports io_uring, the tag files of a list are read all");
+  puts("at once; Setting NTX_URING to 0 reads them one at a time instead.\n");
+
   /* Explanation of the output of 'ntx list'. */
   puts("The focus of ntx is displaying tag intersections, as performed by");
   puts("'ntx list'. This outputs a four-byte hexidecimal ID, a tab, and");
@@ -654,18 +1449,51 @@ void ntx_usage(int retcode)
   exit(retcode);
 }
 
+/* Parse a size in bytes, optionally followed by k, m or g. */
+unsigned long ntx_size(char *arg)
+{
+  unsigned long n;
+  char *end;
+
+  n = strtoul(arg, &end, 10);
+  if(end == arg) die("Invalid size %s.", arg);
+  switch(*end) {
+    case 'g': case 'G': n *= 1024; /* Fall through. */
+    case 'm': case 'M': n *= 1024; /* Fall through. */
+    case 'k': case 'K': n *= 1024; end++;
+  }
+  if(*end) die("Invalid size %s.", arg);
+  return n;
+}
+
 /* Very few arguments, so we use a hand-written parser. */
 int main(int argc, char **argv)
 {
   exception_t exc;
   const char *error;
-  int errnum;
+  char *format = NULL, *fields = NULL;
+  int errnum, stats = 0;
 
+  /* Report statistics last, once release_all has closed every file. */
+  atexit(stats_report);
   atexit(release_all);
+  atexit(out_flush);
+
+  /* Global options come before the mode. */
+  for(; argc >= 2 && !strncmp(argv[1], "--", 2) && strcmp(argv[1], "--help");
+      argv++, argc--) {
+    if(!strcmp(argv[1], "--stats")) stats = 1;
+    else if(!strncmp(argv[1], "--format=", 9)) format = argv[1] + 9;
+    else if(!strncmp(argv[1], "--fields=", 9)) fields = argv[1] + 9;
+    else if(!strncmp(argv[1], "--memory=", 9)) ntx_budget = ntx_size(argv[1] + 9);
+    else ntx_usage(EXIT_FAILURE);
+  }
 
   if(argc < 2) ntx_usage(EXIT_FAILURE);
   if(!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
     ntx_usage(EXIT_SUCCESS);
+  stats_start(argv[1], stats);
+  out_start(format, fields);
 
   /* Change to/create our root directory. */
   ntx_homedir(TAGS_DIR, REFS_DIR, NOTES_DIR, NULL);
@@ -674,12 +1502,40 @@ int main(int argc, char **argv)
     if(!strcmp(argv[1], "add")    &&    argc >= 3) ntx_add(argv+2);
     else if(!strcmp(argv[1], "edit") && argc >= 3) ntx_edit(argv+2);
     else if(!strcmp(argv[1], "list") && argc >= 2) ntx_list(argv+2, argc - 2);
-    else if(!strcmp(argv[1], "put") &&  argc == 3) ntx_put(argv[2]);
+    else if(!strcmp(argv[1], "count"))             ntx_count(argv+2, argc - 2);
+    else if(!strcmp(argv[1], "facets"))            ntx_facets(argv+2, argc - 2);
+    else if(!strcmp(argv[1], "find") && argc >= 3) ntx_search(argv+2, argc - 2);
+    else if(!strcmp(argv[1], "put") &&  argc >= 3) ntx_put(argv+2);
+    else if(!strcmp(argv[1], "related") && (argc == 3 || argc == 4))
+                       ntx_related(argv[2], argc == 4 ? atoi(argv[3]) : 0);
+    else if(!strcmp(argv[1], "log") &&  argc == 3) ntx_log(argv[2]);
     else if(!strcmp(argv[1], "rm")  &&  argc == 3) ntx_del(argv+2);
     else if(!strcmp(argv[1], "tag") &&  argc > 3)  ntx_retag(argv[2], argv+3);
     else if(!strcmp(argv[1], "tag") && (argc == 2 || argc == 3))
                                                    ntx_tags(argv[2]);
+    else if(!strcmp(argv[1], "tag-rename") && argc == 4)
+                                       ntx_merge(argv+2, 1, argv[3], 1);
+    else if(!strcmp(argv[1], "tag-merge") && argc >= 4)
+                                       ntx_merge(argv+2, argc-3, argv[argc-1], 0);
+    else if(!strcmp(argv[1], "retag") && argc >= 5 &&
+            !strcmp(argv[2], "--where"))     ntx_bulktag(argv+3, argc-3);
+    else if(!strcmp(argv[1], "view") && argc == 2)  view_list();
+    else if(!strcmp(argv[1], "view") && argc >= 5 &&
+            !strcmp(argv[2], "create"))      view_create(argv[3], argv+4, argc-4);
+    else if(!strcmp(argv[1], "view") && argc == 4 &&
+            !strcmp(argv[2], "drop"))        view_drop(argv[3]);
+    else if(!strcmp(argv[1], "reindex") && argc == 2) ntx_reindex();
+    else if(!strcmp(argv[1], "train") && argc == 2)  ntx_train(0);
+    else if(!strcmp(argv[1], "train") && argc == 3 &&
+            !strcmp(argv[2], "--none"))            ntx_train(1);
+    else if(!strcmp(argv[1], "fsck") && argc == 2)  ntx_fsck(0);
+    else if(!strcmp(argv[1], "fsck") && argc == 3 &&
+            !strcmp(argv[2], "--repair"))          ntx_fsck(1);
     else ntx_usage(EXIT_FAILURE);
+
+    /* Record the checksums of whatever was written. */
+    manifest_flush();
+    out_end();
   } catch(exc) {
     switch(exc.type) {
       case E_FIOERR:   fclose(exc.value);
@@ -697,5 +1553,6 @@ int main(int argc, char **argv)
       case E_USER:     die("Unknown exception caught.");
     }
   }
+  sched_done();
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,210 @@
+#ifndef NTX__H
+#define NTX__H
+
+/* Buffer size definitions. */
+#define FILE_MAX      (FILENAME_MAX+1)
+#define BUFFER_MAX     8192
+
+/* ID: Four hexidecimal digits. */
+#define ID_LENGTH      4
+
+/* Single character seperator. */
+#define SEP_LENGTH     1
+
+/* Maximum summary length to read. */
+#define SUMMARY_LENGTH 58 
+
+/* "\n\0" line terminator. */
+#define PADDING_LENGTH 2    
+
+#define SUMREC_LENGTH  (ID_LENGTH + SEP_LENGTH + SUMMARY_LENGTH + PADDING_LENGTH)
+#define SUMBASE_LENGTH (ID_LENGTH + SEP_LENGTH + PADDING_LENGTH)
+#define SUMMARY_OFFSET (ID_LENGTH + SEP_LENGTH)
+
+/* Segments of logs and packs are named by eight hex digits, in order. */
+#define SEGMENT_LENGTH 8
+
+
+/* Default (_one character_) separators, defined in ntx.c. */
+extern const char  ID_SEP;
+extern const char *FIELD_SEP;
+
+/* Files larger than this, compressed, are read a line at a time rather *
+ * than whole; 0 if there is no limit. Set by --memory, in ntx.c.       */
+extern unsigned long ntx_budget;
+
+
+/* Builtin Subdirectories. */
+#define TAGS_DIR   "tags"
+#define REFS_DIR   "refs"
+#define NOTES_DIR  "notes"
+#define INDEX_FILE "index"
+#define MANIFEST_FILE "manifest"
+#define CACHE_DIR  "cache"
+#define TIMES_DIR  "times"
+#define FILTERS_DIR "filters"
+#define PACKS_DIR  "packs"
+#define DICTS_DIR  "dicts"
+#define HISTORY_DIR "history"
+#define VIEWS_DIR  "views"
+#define RELATED_DIR "related"
+#define GRAMS_DIR  "grams"
+
+
+/* Prototypes of system-dependent functions. */
+void ntx_editor(char *file);
+void ntx_homedir(char *sub, ...);
+long int ntx_flen(char *file);
+long int ntx_ftime(char *file);
+long int ntx_fcopy(FILE *in, long int off, long int len, FILE *out);
+void ntx_fhint(FILE *f, long int off, long int len);
+int ntx_mkdir(char *dir);
+
+typedef void * n_dir;
+n_dir ntx_dopen(char *dir);
+char *ntx_dread(n_dir dir);
+void ntx_dclose(n_dir dir);
+
+
+/* Shared helpers, defined in ntx.c. */
+void die(const char *fmt, ...);
+int ntx_isid(char *id);
+void ntx_tagname(char *tag);
+char *strrtok(char *string, char **state, const char *delim);
+char **strtokens(char *str, const char *delim);
+void ntx_summary(char *file, char *buf);
+void ntx_fmtsummary(char *file, char *buf);
+unsigned long *ntx_segments(char *dir, unsigned int *count);
+char *ntx_buffer(char *file);
+int ntx_streams(char *file);
+char *ntx_getl(gzFile *f, char *file, char **buf, unsigned int *size);
+char *ntx_tagstolist(char *id, char **tags);
+int ntx_replace(char *file, char *id, char *fix);
+char *ntx_find(char *file, char *id);
+void ntx_append(char *file, char *str);
+unsigned int ntx_lines(char *buf, char *file);
+char *ntx_select(char **tags, unsigned int tagc);
+
+/* Checksums of the derived files, in manifest.c. */
+void ntx_checksum(char *file, unsigned long off,
+                  unsigned long *crc, unsigned long *len);
+int manifest_lookup(char *file, unsigned long *crc, unsigned long *len);
+char *manifest_next(void);
+void manifest_record(char *file, unsigned long crc, unsigned long len);
+void manifest_drop(char *file);
+void manifest_clear(void);
+void manifest_update(char *file);
+void manifest_append(char *file);
+void manifest_flush(void);
+
+/* Cached results of ntx list, in cache.c. */
+#define CACHE_ENTRIES 64
+
+char *cache_key(char **tags, unsigned int tagc);
+char *cache_lookup(char *key);
+void cache_store(char *key, char *result);
+int cache_index(void);
+void cache_keepindex(char *buf);
+void cache_dropindex(void);
+
+/* The text of the notes, in pack.c; Each is named by its NOTES_DIR path. */
+int note_exists(char *file);
+char *note_read(char *file, unsigned int *len);
+FILE *note_open(char *file, unsigned long *off, unsigned long *len);
+void note_prefetch(char *file);
+void note_summary(char *file, char *buf);
+long int note_ftime(char *file);
+void note_checkout(char *file);
+int note_store(char *file);
+int note_remove(char *file);
+unsigned short *note_ids(unsigned int *count);
+void pack_compact(void);
+
+/* Earlier versions of the notes, in history.c. */
+void history_record(char *id, char *old, unsigned int olen,
+                    char *body, unsigned int len);
+void history_drop(char *id);
+char *history_read(char *id, unsigned int rev, unsigned int *len);
+void history_log(char *id);
+void history_compact(void);
+
+/* Bloom filters of the tag files, in filter.c. */
+struct filter {
+  char tag[FILE_MAX];  /* The path of the tag file. */
+  unsigned char *map;
+  unsigned long crc, len, bits;
+  unsigned int count;
+  int valid;           /* Loaded, and current with the tag file. */
+};
+
+struct filter *filter_begin(char *tag);
+void filter_add(struct filter *f, unsigned int id);
+void filter_end(struct filter *f, char *id);
+void filter_free(struct filter *f);
+int filter_test(struct filter *f, unsigned int id);
+int filter_disjoint(struct filter **fs, unsigned int n);
+void filter_write_ids(char *tag, unsigned short *ids, unsigned int count);
+
+/* Formatted output, in output.c. */
+enum FORMAT { FMT_TEXT = 0, FMT_JSON, FMT_NDJSON, FMT_NUL };
+
+#define FIELD_TAGS  1
+#define FIELD_TIMES 2
+
+void out_start(char *fmt, char *flds);
+void out_begin(void);
+void out_end(void);
+void out_flush(void);
+void out_write(const char *buf, unsigned int len);
+void out_note(char *line, unsigned int len);
+void out_notes(char *buf);
+void out_tag(char *name);
+void out_count(unsigned int count, char *tag);
+int out_plain(void);
+void out_file(char *id, FILE *in, unsigned long off, unsigned long len);
+void out_body(char *id, char *body, unsigned int len);
+
+/* Timestamps of the notes, in times.c. */
+struct stamp {
+  char id[ID_LENGTH + 1];
+  long int created, modified; /* Seconds since the epoch. */
+};
+
+void times_walk(int (*fn)(struct stamp *, void *), void *arg);
+void times_record(char *id, int created);
+void times_drop(char *id);
+void times_load(struct stamp *stamps);
+void times_write(struct stamp *stamps, unsigned int count);
+
+/* Saved intersections of tags, in view.c. */
+void view_create(char *name, char **tags, unsigned int tagc);
+void view_drop(char *name);
+void view_list(void);
+int view_file(char *name, char *file);
+void view_update(char *desc, char **old, char **new);
+void view_refresh(char **tags, unsigned int n);
+
+/* Signatures of the notes, for finding those alike, in related.c. */
+int related_exists(void);
+void related_update(char *id, char **tags, int text);
+void related_drop(char *id);
+void related_build(void);
+void related_rebuild(void);
+void ntx_related(char *id, unsigned int top);
+
+/* Trigrams of the summaries, for ntx find, in grams.c. */
+void grams_add(char *line);
+void grams_build(void);
+void grams_rebuild(void);
+void ntx_search(char **args, unsigned int argc);
+
+/* Commands implemented outside of ntx.c. */
+void ntx_reindex(void);
+void ntx_merge(char **from, unsigned int n, char *to, int fresh);
+void ntx_bulktag(char **args, unsigned int argc);
+void ntx_count(char **tags, unsigned int tagc);
+void ntx_facets(char **tags, unsigned int tagc);
+void ntx_train(int none);
+void ntx_fsck(int repair);
+
+#endif
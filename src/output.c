@@ -0,0 +1,342 @@
+/*
+ * Output of list, tag and put, in the format chosen with --format.
+ *
+ *   text    Lines as they are stored; "id\tsummary" for notes.
+ *   nul     The same records, terminated by '\0' rather than newlines.
+ *   ndjson  One JSON value per line.
+ *   json    A single JSON array of those values.
+ *
+ * --fields=tags,times adds the tags and timestamps of each note listed,
+ * as further tab-separated columns in the text formats. Each refs bucket
+ * and the log of timestamps is read at most once, when first needed.
+ *
+ * Everything is gathered into one large buffer, which is written out in
+ * a single call whenever it fills, and when ntx exits; Only the text of
+ * notes put as text skips it, being copied to STDOUT by the kernel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "ntx.h"
+
+#define OUT_BUFFER (256 * 1024)
+
+static char obuf[OUT_BUFFER];
+static unsigned int olen = 0, items = 0, begun = 0;
+static enum FORMAT format = FMT_TEXT;
+static unsigned int fields = 0;
+
+/* The fields of notes, loaded on first use. */
+static char *refs[256], **tagsof = NULL;
+static struct stamp *stamps = NULL;
+
+
+void out_flush(void)
+{
+  if(olen) fwrite(obuf, 1, olen, stdout);
+  olen = 0;
+  fflush(stdout);
+}
+
+void out_write(const char *buf, unsigned int len)
+{
+  if(olen + len > OUT_BUFFER) {
+    if(olen) fwrite(obuf, 1, olen, stdout);
+    olen = 0;
+  }
+  if(len > OUT_BUFFER) fwrite(buf, 1, len, stdout);
+  else {
+    memcpy(obuf + olen, buf, len);
+    olen += len;
+  }
+}
+
+static void out_puts(const char *str)
+{
+  out_write(str, strlen(str));
+}
+
+/* Write a string as JSON, quoted and escaped. */
+static void out_json(const char *str, unsigned int len)
+{
+  char esc[8];
+  const char *run;
+
+  out_write("\"", 1);
+  for(run = str; len--; str++) {
+    unsigned char c = *str;
+
+    if(c >= 0x20 && c != '"' && c != '\\') continue;
+    out_write(run, str - run);
+    run = str + 1;
+
+    switch(c) {
+      case '"':  out_write("\\\"", 2); break;
+      case '\\': out_write("\\\\", 2); break;
+      case '\n': out_write("\\n", 2);  break;
+      case '\t': out_write("\\t", 2);  break;
+      default:
+        seprintf(esc, sizeof(esc), "\\u%04x", c);
+        out_write(esc, 6);
+    }
+  }
+  out_write(run, str - run);
+  out_write("\"", 1);
+}
+
+/* Separate the values of a JSON array, or terminate the records of others. */
+static void out_next(void)
+{
+  if(format == FMT_JSON) out_puts(items ? ",\n" : "[\n");
+  items++;
+}
+
+static void out_term(void)
+{
+  if(format == FMT_NDJSON || format == FMT_TEXT) out_write("\n", 1);
+  else if(format == FMT_NUL) out_write("", 1);
+}
+
+/* Choose the format, and fields, from the global options. */
+void out_start(char *fmt, char *flds)
+{
+  char *tok, *state;
+
+  if(!fmt || !strcmp(fmt, "text")) format = FMT_TEXT;
+  else if(!strcmp(fmt, "json"))    format = FMT_JSON;
+  else if(!strcmp(fmt, "ndjson"))  format = FMT_NDJSON;
+  else if(!strcmp(fmt, "nul"))     format = FMT_NUL;
+  else die("Unknown format %s.", fmt);
+
+  for(tok = flds ? strrtok(flds, &state, ",") : NULL; tok;
+      tok = strrtok(NULL, &state, ",")) {
+    if(!strcmp(tok, "tags"))       fields |= FIELD_TAGS;
+    else if(!strcmp(tok, "times")) fields |= FIELD_TIMES;
+    else die("Unknown field %s.", tok);
+  }
+}
+
+/* Begin the output of list, tag or put. */
+void out_begin(void)
+{
+  begun = 1;
+}
+
+/* Terminate the output; A JSON array is written even if it is empty. */
+void out_end(void)
+{
+  if(format == FMT_JSON && begun) out_puts(items ? "\n]\n" : "[]\n");
+  out_flush();
+}
+
+/* Find the tags of a note, loading its refs bucket if necessary. Like *
+ * the stamps, each is kept for the life of the process, so is checked *
+ * whole before it is set, and owned by no try block.                  */
+static char *out_tagsof(unsigned int id)
+{
+  char file[FILE_MAX], *buf, **t, *line, *end;
+  exception_t exc;
+
+  if(!tagsof) {
+    t = alloc(65536 * sizeof(char *));
+    memset(t, 0, 65536 * sizeof(char *));
+    memset(refs, 0, sizeof(refs));
+    disown(t);
+    tagsof = t;
+  }
+
+  if(!refs[id >> 8]) {
+    seprintf(file, FILE_MAX, REFS_DIR"/%02x", id >> 8);
+    try buf = ntx_buffer(file);
+    catch(exc) {
+      if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+      buf = strdupe("");
+    }
+
+    for(line = buf; *line; line = end + 1)
+      if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+    disown(buf);
+    refs[id >> 8] = buf;
+
+    for(line = buf; *line; line = end + 1) {
+      end = strchr(line, '\n');
+      *end = '\0';
+      if(end - line >= SUMMARY_OFFSET && line[ID_LENGTH] == ID_SEP)
+        tagsof[strtol(line, NULL, 16) & 0xffff] = line + SUMMARY_OFFSET;
+    }
+  }
+  return tagsof[id];
+}
+
+/* The stamps are kept for the life of the process, so are only set once *
+ * loaded whole, and owned by no try block.                             */
+static struct stamp *out_stamp(unsigned int id)
+{
+  struct stamp *s;
+
+  if(!stamps) {
+    s = alloc(65536 * sizeof(struct stamp));
+    memset(s, 0, 65536 * sizeof(struct stamp));
+    times_load(s);
+    disown(s);
+    stamps = s;
+  }
+  return stamps[id].id[0] ? stamps + id : NULL;
+}
+
+/* Write a note from its line, "id\tsummary", with its optional fields. */
+void out_note(char *line, unsigned int len)
+{
+  char num[48], *tags = NULL, *tag, *end;
+  struct stamp *s = NULL;
+  unsigned int id;
+
+  if(len && line[len - 1] == '\n') len--;
+  if(len < SUMMARY_OFFSET) return;
+
+  if(format == FMT_TEXT && !fields) {
+    out_write(line, len);
+    out_write("\n", 1);
+    return;
+  }
+
+  id = strtol(line, NULL, 16) & 0xffff;
+  if(fields & FIELD_TAGS)  tags = out_tagsof(id);
+  if(fields & FIELD_TIMES) s = out_stamp(id);
+
+  out_next();
+  if(format == FMT_TEXT || format == FMT_NUL) {
+    out_write(line, len);
+    if(fields & FIELD_TAGS) {
+      out_write("\t", 1);
+      if(tags) out_puts(tags);
+    }
+    if(fields & FIELD_TIMES) {
+      seprintf(num, sizeof(num), "\t%ld\t%ld",
+               s ? s->created : 0, s ? s->modified : 0);
+      out_puts(num);
+    }
+    out_term();
+    return;
+  }
+
+  out_puts("{\"id\":");
+  out_json(line, ID_LENGTH);
+  out_puts(",\"summary\":");
+  out_json(line + SUMMARY_OFFSET, len - SUMMARY_OFFSET);
+
+  if(fields & FIELD_TAGS) {
+    out_puts(",\"tags\":[");
+    for(tag = tags; tag && *tag; tag = *end ? end + 1 : end) {
+      if(!(end = strchr(tag, *FIELD_SEP))) end = tag + strlen(tag);
+      if(tag != tags) out_write(",", 1);
+      out_json(tag, end - tag);
+    }
+    out_write("]", 1);
+  }
+  if(fields & FIELD_TIMES) {
+    if(s) seprintf(num, sizeof(num), ",\"created\":%ld,\"modified\":%ld",
+                   s->created, s->modified);
+    else strcpy(num, ",\"created\":null,\"modified\":null");
+    out_puts(num);
+  }
+  out_write("}", 1);
+  out_term();
+}
+
+/* Write every line of a buffer as a note. */
+void out_notes(char *buf)
+{
+  char *end;
+
+  if(format == FMT_TEXT && !fields) {
+    out_puts(buf);
+    return;
+  }
+  for(; *buf; buf = end + 1) {
+    if(!(end = strchr(buf, '\n'))) end = buf + strlen(buf) - 1;
+    out_note(buf, end - buf + 1);
+  }
+}
+
+/* Write the name of a tag. */
+void out_tag(char *name)
+{
+  out_next();
+  if(format == FMT_JSON || format == FMT_NDJSON) out_json(name, strlen(name));
+  else out_puts(name);
+  out_term();
+}
+
+/* Write a count of notes, and the tag it is of if 'tag' is given; As *
+ * JSON, those of tags make an array, and a lone count an object.     */
+void out_count(unsigned int count, char *tag)
+{
+  char num[32];
+
+  if(tag) out_next();
+  if(format == FMT_JSON || format == FMT_NDJSON) {
+    out_write("{", 1);
+    if(tag) {
+      out_puts("\"tag\":");
+      out_json(tag, strlen(tag));
+      out_write(",", 1);
+    }
+    seprintf(num, sizeof(num), "\"count\":%u}", count);
+  }
+  else seprintf(num, sizeof(num), tag ? "%u\t" : "%u", count);
+  out_puts(num);
+  if(tag && format != FMT_JSON && format != FMT_NDJSON) out_puts(tag);
+
+  if(!tag && format == FMT_JSON) out_write("\n", 1);
+  else out_term();
+}
+
+/* Whether notes are written just as they are stored. */
+int out_plain(void)
+{
+  return format == FMT_TEXT && !fields;
+}
+
+/* Write the text of a note from 'len' bytes of a file at 'off'; As text, *
+ * it is copied straight from the file, without passing through ntx.      */
+void out_file(char *id, FILE *in, unsigned long off, unsigned long len)
+{
+  char *body;
+
+  if(format == FMT_TEXT) {
+    if(olen) fwrite(obuf, 1, olen, stdout);
+    olen = 0;
+    if(ntx_fcopy(in, off, len, stdout) != (long)len) throw(E_FIOERR, in);
+    return;
+  }
+
+  body = alloc(len + 1);
+  if(fseek(in, off, SEEK_SET) != 0 || fread(body, 1, len, in) != len)
+    throw(E_FIOERR, in);
+  out_body(id, body, len);
+  release(body);
+}
+
+/* Write the whole text of a note. */
+void out_body(char *id, char *body, unsigned int len)
+{
+  if(format == FMT_TEXT) {
+    out_write(body, len);
+    return;
+  }
+
+  out_next();
+  if(format == FMT_NUL) out_write(body, len);
+  else {
+    out_puts("{\"id\":");
+    out_json(id, strlen(id));
+    out_puts(",\"body\":");
+    out_json(body, len);
+    out_write("}", 1);
+  }
+  out_term();
+}
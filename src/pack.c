@@ -0,0 +1,595 @@
+/*
+ * The text of the notes, packed into segments rather than a file apiece.
+ *
+ * Each version of a note is appended to the newest segment of PACKS_DIR,
+ * a plain file which is left once it reaches PACK_SEGMENT bytes, and a
+ * line of its ID, segment, offset and length is appended to PACK_MAP; A
+ * line of just the ID and '-' removes the note. The last line for a note
+ * is the current one, so reading a note costs a single seek and read.
+ *
+ * Notes are still edited as files in NOTES_DIR, which are then packed and
+ * removed; Notes found there which were never packed, as written by an
+ * older ntx, are read in place. ntx reindex compacts the packs, copying
+ * only the current version of each note, and packs any loose notes.
+ *
+ * Once ntx train has written a dictionary to DICTS_DIR, notes are packed
+ * as raw deflate streams primed with the newest dictionary, whenever that
+ * makes them smaller; Their lines in PACK_MAP then go on to give the
+ * dictionary and the length of the note itself. An empty dictionary
+ * turns compression back off. Compaction repacks every note with the
+ * newest dictionary, so the older ones can be removed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "except.h"
+#include "exc_io.h"
+#include "stats.h"
+#include "ntx.h"
+
+#define PACK_MAP     PACKS_DIR"/map"
+
+/* Size at which a segment is complete. */
+#define PACK_SEGMENT (4 * 1024 * 1024)
+
+/* Notes shorter than this are never worth compressing. */
+#define PACK_DEFLATE_MIN 32
+
+struct body { /* Where the current version of a note is packed. */
+  long int seg;  /* -1 if the note isn't packed. */
+  unsigned long off, len;
+  long int dict; /* -1 if it is stored as it is. */
+  unsigned long size;
+};
+
+struct dict {
+  long int n;
+  char *buf;
+  unsigned int len;
+};
+
+static struct body *map = NULL;
+static struct dict *dicts = NULL;
+static unsigned int ndicts = 0;
+static long int newest = -2; /* -2 until looked for, -1 if there is none. */
+
+/* Read the rest of an open file. */
+static char *pack_slurp(FILE *f, unsigned int *len)
+{
+  unsigned int size = BUFFER_MAX, n;
+  char *body = alloc(size);
+
+  *len = 0;
+  while((n = fread(body + *len, 1, size - *len - 1, f)) > 0)
+    if((*len += n) == size - 1) body = ralloc(body, size *= 2);
+  if(ferror(f)) throw(E_FIOERR, f);
+  STAT(ST_RAW_READ, *len);
+
+  body[*len] = '\0';
+  return body;
+}
+
+/* Find a dictionary, loading it if necessary. */
+static struct dict *pack_dict(long int n)
+{
+  char file[FILE_MAX];
+  struct dict *d;
+  unsigned int i;
+  FILE *f;
+
+  for(i = 0; i < ndicts; i++) if(dicts[i].n == n) return dicts + i;
+
+  /* Kept for the life of the process, so owned by no try block. */
+  seprintf(file, FILE_MAX, DICTS_DIR"/%08lx", n);
+  if(!(d = realloc(dicts, (ndicts + 1) * sizeof(struct dict))))
+    throw(E_NOMEM, NULL);
+  dicts = d;
+  f = raw_open(file, "rb");
+  dicts[ndicts].n   = n;
+  dicts[ndicts].buf = pack_slurp(f, &dicts[ndicts].len);
+  disown(dicts[ndicts].buf);
+  release(f);
+  return dicts + ndicts++;
+}
+
+/* The dictionary to pack notes with, or NULL if they are stored as is. */
+static struct dict *pack_newest(void)
+{
+  unsigned long *ds;
+  unsigned int count;
+  struct dict *d;
+
+  if(newest == -2) {
+    ds = ntx_segments(DICTS_DIR, &count);
+    newest = count ? (long)ds[count - 1] : -1;
+    release(ds);
+  }
+  if(newest == -1) return NULL;
+  d = pack_dict(newest);
+  return d->len ? d : NULL;
+}
+
+/* Read the map, once; It must be loaded before any worker thread reads. *
+ * Like the dictionaries it is kept for the life of the process, and so   *
+ * is only set once whole, and owned by no try block.                     */
+static void pack_load(void)
+{
+  char *buf = NULL, *line, *end;
+  unsigned long seg, off, len, dict, size;
+  struct body *m;
+  exception_t exc;
+  unsigned int i;
+  int n;
+
+  m = alloc(65536 * sizeof(struct body));
+  for(i = 0; i < 65536; i++) m[i].seg = m[i].dict = -1;
+
+  try buf = ntx_buffer(PACK_MAP);
+  catch(exc) if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+
+  for(line = buf; line && *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, PACK_MAP);
+    *end = '\0';
+    if(end - line < SUMMARY_OFFSET || line[ID_LENGTH] != ID_SEP) continue;
+    i = strtol(line, NULL, 16) & 0xffff;
+
+    if(line[SUMMARY_OFFSET] == '-') m[i].seg = -1;
+    else if((n = sscanf(line + SUMMARY_OFFSET, "%lx\t%lu\t%lu\t%lx\t%lu",
+                        &seg, &off, &len, &dict, &size)) == 3 || n == 5) {
+      m[i].seg  = seg;
+      m[i].off  = off;
+      m[i].len  = len;
+      m[i].dict = n == 5 ? (long)dict : -1;
+      m[i].size = n == 5 ? size : len;
+    }
+  }
+  if(buf) release(buf);
+
+  /* Workers may read notes, but only the main thread loads dictionaries. */
+  for(i = 0; i < 65536; i++) if(m[i].dict != -1) pack_dict(m[i].dict);
+
+  disown(m);
+  map = m;
+}
+
+/* Find where a note, named by its NOTES_DIR path, is packed. */
+static struct body *pack_find(char *file)
+{
+  char *id = file + strlen(NOTES_DIR) + 1;
+  struct body *b;
+
+  if(!map) pack_load();
+  if(!ntx_isid(id)) return NULL;
+  b = map + strtol(id, NULL, 16);
+  return b->seg == -1 ? NULL : b;
+}
+
+/* Inflate the start of a compressed note, to fill 'out'. */
+static void pack_inflate(struct body *b, char *file, char *in,
+                         char *out, unsigned long want)
+{
+  struct dict *d = pack_dict(b->dict);
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if(inflateInit2(&z, -MAX_WBITS) != Z_OK) throw(E_NOMEM, NULL);
+  inflateSetDictionary(&z, (Bytef*)d->buf, d->len);
+
+  z.next_in   = (Bytef*)in;
+  z.avail_in  = b->len;
+  z.next_out  = (Bytef*)out;
+  z.avail_out = want;
+  ret = inflate(&z, Z_SYNC_FLUSH);
+  inflateEnd(&z);
+
+  /* Only the whole of a note need reach the end of its stream. */
+  if(z.avail_out != 0 || (ret != Z_STREAM_END &&
+     (want == b->size || (ret != Z_OK && ret != Z_BUF_ERROR))))
+    throw(E_INVAL, file);
+}
+
+/* Deflate a note with a dictionary; Returns 0 unless that makes it smaller. */
+static int pack_deflate(struct dict *d, char *body, unsigned int len,
+                        char *out, unsigned int *olen)
+{
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                  MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw(E_NOMEM, NULL);
+  deflateSetDictionary(&z, (Bytef*)d->buf, d->len);
+
+  z.next_in   = (Bytef*)body;
+  z.avail_in  = len;
+  z.next_out  = (Bytef*)out;
+  z.avail_out = len - 1;
+  ret = deflate(&z, Z_FINISH);
+  deflateEnd(&z);
+
+  *olen = len - 1 - z.avail_out;
+  return ret == Z_STREAM_END;
+}
+
+/* Open a packed note, positioned at its start. */
+static FILE *pack_open(struct body *b)
+{
+  char seg[FILE_MAX];
+  FILE *f;
+
+  seprintf(seg, FILE_MAX, PACKS_DIR"/%08lx", b->seg);
+  f = raw_open(seg, "rb");
+  setvbuf(f, NULL, _IONBF, 0); /* Read only what was asked for. */
+  if(fseek(f, b->off, SEEK_SET) != 0) throw(E_FIOERR, f);
+  return f;
+}
+
+/* Read at most the first 'want' bytes of a packed note, NUL-terminated. */
+static char *pack_get(struct body *b, char *file, unsigned long want,
+                      unsigned int *len)
+{
+  unsigned long n;
+  char *raw, *body;
+  FILE *f;
+
+  if(want > b->size) want = b->size;
+  n = b->dict == -1 ? want : b->len;
+
+  f = pack_open(b);
+  raw = alloc(n + 1);
+  if(fread(raw, 1, n, f) != n) throw(E_FIOERR, f);
+  release(f);
+  STAT(ST_RAW_READ, n);
+
+  if(b->dict == -1) body = raw;
+  else {
+    body = alloc(want + 1);
+    pack_inflate(b, file, raw, body, want);
+    release(raw);
+  }
+
+  *len = want;
+  body[want] = '\0';
+  return body;
+}
+
+int note_exists(char *file)
+{
+  exception_t exc;
+
+  if(pack_find(file)) return 1;
+  try ntx_flen(file);
+  catch(exc) return 0;
+  return 1;
+}
+
+/* Read the whole of a note, NUL-terminated. */
+char *note_read(char *file, unsigned int *len)
+{
+  struct body *b = pack_find(file);
+  char *body;
+  FILE *f;
+
+  if(!b) {
+    f = raw_open(file, "rb");
+    body = pack_slurp(f, len);
+    release(f);
+    return body;
+  }
+
+  return pack_get(b, file, b->size, len);
+}
+
+/* Open the file holding a note, if it is stored there as it is, and *
+ * give where its text is within it; NULL if it is compressed.        */
+FILE *note_open(char *file, unsigned long *off, unsigned long *len)
+{
+  struct body *b = pack_find(file);
+  FILE *f;
+
+  if(!b) {
+    f = raw_open(file, "rb");
+    *off = 0;
+    *len = ntx_flen(file);
+    return f;
+  }
+  if(b->dict != -1) return NULL;
+
+  f = pack_open(b);
+  *off = b->off;
+  *len = b->size;
+  return f;
+}
+
+/* Start reading a note ahead of note_open or note_read, if it exists. */
+void note_prefetch(char *file)
+{
+  struct body *b = pack_find(file);
+  exception_t exc;
+  FILE *f = NULL;
+
+  try f = b ? pack_open(b) : raw_open(file, "rb");
+  catch(exc) return;
+  ntx_fhint(f, b ? b->off : 0, b ? b->len : 0);
+  release(f);
+}
+
+/* 'buf' should be SUMMARY_LENGTH + PADDING_LENGTH bytes long. */
+void note_summary(char *file, char *buf)
+{
+  struct body *b = pack_find(file);
+  unsigned int n;
+  char *head, *end;
+
+  if(!b) {
+    ntx_summary(file, buf);
+    return;
+  }
+
+  /* Read no more than the summary, as fgets would. */
+  head = pack_get(b, file, SUMMARY_LENGTH + PADDING_LENGTH - 1, &n);
+  memcpy(buf, head, n + 1);
+  release(head);
+  if((end = strchr(buf, '\n'))) end[1] = '\0';
+  ntx_fmtsummary(file, buf);
+}
+
+long int note_ftime(char *file)
+{
+  struct body *b = pack_find(file);
+  char seg[FILE_MAX];
+
+  if(!b) return ntx_ftime(file);
+  seprintf(seg, FILE_MAX, PACKS_DIR"/%08lx", b->seg);
+  return ntx_ftime(seg);
+}
+
+/* Write a packed note out to its file in NOTES_DIR, to be edited. */
+void note_checkout(char *file)
+{
+  unsigned int len;
+  char *body;
+  FILE *f;
+
+  if(!pack_find(file)) return; /* It is already a file. */
+  body = note_read(file, &len);
+
+  f = raw_open(file, "wb");
+  if(fwrite(body, 1, len, f) != len || fflush(f) != 0) throw(E_FIOERR, f);
+  release(f);
+  release(body);
+}
+
+/* Prepare a note to be packed; 'b' is filled in with how it is stored, *
+ * and the buffer to write is returned, which may be 'body' itself.     */
+static char *pack_encode(struct dict *d, char *body, unsigned int len,
+                         struct body *b)
+{
+  unsigned int olen;
+  char *out;
+
+  b->dict = -1;
+  b->len  = b->size = len;
+  if(!d || len < PACK_DEFLATE_MIN) return body;
+
+  out = alloc(len);
+  if(!pack_deflate(d, body, len, out, &olen)) {
+    release(out);
+    return body;
+  }
+  b->dict = d->n;
+  b->len  = olen;
+  return out;
+}
+
+/* Format the line of PACK_MAP for a note. */
+static unsigned int pack_line(char *line, unsigned int id, struct body *b)
+{
+  if(b->dict == -1)
+    return seprintf(line, SUMREC_LENGTH, "%04x%c%08lx\t%lu\t%lu\n",
+                    id, ID_SEP, b->seg, b->off, b->len);
+  return seprintf(line, SUMREC_LENGTH, "%04x%c%08lx\t%lu\t%lu\t%08lx\t%lu\n",
+                  id, ID_SEP, b->seg, b->off, b->len, b->dict, b->size);
+}
+
+/* Append a note to the newest segment, and record where it went. */
+static void pack_append(char *id, char *body, unsigned int len)
+{
+  char seg[FILE_MAX], line[SUMREC_LENGTH], *out;
+  unsigned long *segs, last;
+  unsigned int count, n = strtol(id, NULL, 16);
+  struct body b;
+  FILE *f;
+
+  if(ntx_mkdir(PACKS_DIR) != 0) throw(E_FACCESS, PACKS_DIR);
+  segs = ntx_segments(PACKS_DIR, &count);
+  last = count ? segs[count - 1] : 0;
+  release(segs);
+
+  seprintf(seg, FILE_MAX, PACKS_DIR"/%08lx", last);
+  if(count && ntx_flen(seg) >= PACK_SEGMENT)
+    seprintf(seg, FILE_MAX, PACKS_DIR"/%08lx", ++last);
+
+  out = pack_encode(pack_newest(), body, len, &b);
+  f = raw_open(seg, "ab");
+  if(fseek(f, 0, SEEK_END) != 0) throw(E_FIOERR, f);
+  b.seg = last;
+  b.off = ftell(f);
+  if(fwrite(out, 1, b.len, f) != b.len || fflush(f) != 0) throw(E_FIOERR, f);
+  release(f);
+  if(out != body) release(out);
+
+  /* Only once the text is written is it found by the map. */
+  pack_line(line, n, &b);
+  ntx_append(PACK_MAP, line);
+  map[n] = b;
+}
+
+/* Pack the file of a note, which has just been written, and remove it. *
+ * A note which hasn't changed isn't packed again, nor given a revision; *
+ * Returns whether it had.                                               */
+int note_store(char *file)
+{
+  struct body *b = pack_find(file);
+  char *id = file + strlen(NOTES_DIR) + 1, *body, *old = NULL;
+  unsigned int len, olen = 0;
+  int same = 0;
+  FILE *f;
+
+  f = raw_open(file, "rb");
+  body = pack_slurp(f, &len);
+  release(f);
+
+  if(b) {
+    old = note_read(file, &olen);
+    same = olen == len && memcmp(old, body, len) == 0;
+  }
+
+  if(!same) {
+    pack_append(id, body, len);
+    history_record(id, old, olen, body, len);
+  }
+  if(old) release(old);
+  release(body);
+  remove(file);
+  return !same;
+}
+
+int note_remove(char *file)
+{
+  struct body *b = pack_find(file);
+  char line[SUMREC_LENGTH];
+
+  history_drop(file + strlen(NOTES_DIR) + 1);
+  if(!b) return remove(file);
+
+  seprintf(line, SUMREC_LENGTH, "%s%c-\n", file + strlen(NOTES_DIR) + 1, ID_SEP);
+  ntx_append(PACK_MAP, line);
+  b->seg = -1;
+  remove(file); /* Any copy left from an edit. */
+  return 0;
+}
+
+/* List the ID of every note, packed or not, in order. */
+unsigned short *note_ids(unsigned int *count)
+{
+  unsigned char *has = alloc(65536);
+  unsigned short *ids;
+  unsigned int i;
+  char *name;
+  n_dir dir;
+
+  if(!map) pack_load();
+  for(i = 0; i < 65536; i++) has[i] = map[i].seg != -1;
+
+  dir = ntx_dopen(NOTES_DIR);
+  while((name = ntx_dread(dir)))
+    if(ntx_isid(name)) has[strtol(name, NULL, 16)] = 1;
+  ntx_dclose(dir);
+
+  for(i = *count = 0; i < 65536; i++) *count += has[i];
+  ids = alloc((*count ? *count : 1) * sizeof(unsigned short));
+  for(i = *count = 0; i < 65536; i++) if(has[i]) ids[(*count)++] = i;
+
+  release(has);
+  return ids;
+}
+
+/* Rewrite the packs with only the current version of each note, packing *
+ * any loose notes too, with the newest dictionary. Loose notes which     *
+ * can't be read are left as they are.                                    */
+void pack_compact(void)
+{
+  char file[FILE_MAX], seg[FILE_MAX], line[SUMREC_LENGTH], *body, *out;
+  unsigned long *segs, *ds, next;
+  unsigned int count, nsegs, nds, len, i;
+  unsigned short *ids;
+  unsigned char *loose;
+  struct dict *d;
+  exception_t exc;
+  struct body b;
+  gzFile *m;
+  FILE *f = NULL;
+
+  if(ntx_mkdir(PACKS_DIR) != 0) throw(E_FACCESS, PACKS_DIR);
+  ids  = note_ids(&count);
+  segs = ntx_segments(PACKS_DIR, &nsegs);
+  next = nsegs ? segs[nsegs - 1] + 1 : 0;
+  newest = -2;
+  d = pack_newest();
+
+  loose = alloc(65536);
+  memset(loose, 0, 65536);
+  m = gzf_open(PACK_MAP".new", "w");
+  b.off = 0;
+
+  for(i = 0; i < count; i++) {
+    seprintf(file, FILE_MAX, NOTES_DIR"/%04x", ids[i]);
+    if(!pack_find(file)) loose[ids[i]] = 1;
+    try body = note_read(file, &len);
+    catch(exc) {
+      if(!loose[ids[i]]) throw(exc.type, exc.value);
+      loose[ids[i]] = 0;
+      continue;
+    }
+
+    if(!f || b.off >= PACK_SEGMENT) {
+      if(f) release(f);
+      seprintf(seg, FILE_MAX, PACKS_DIR"/%08lx", next++);
+      f = raw_open(seg, "wb");
+      b.off = 0;
+    }
+
+    out = pack_encode(d, body, len, &b);
+    if(fwrite(out, 1, b.len, f) != b.len) throw(E_FIOERR, f);
+    if(out != body) release(out);
+    release(body);
+
+    b.seg = next - 1;
+    gzf_write(m, line, pack_line(line, ids[i], &b));
+    b.off += b.len;
+  }
+  if(f) {
+    if(fflush(f) != 0) throw(E_FIOERR, f);
+    release(f);
+  }
+  release(m);
+
+  if(rename(PACK_MAP".new", PACK_MAP) != 0) throw(E_FACCESS, PACK_MAP);
+  manifest_update(PACK_MAP);
+
+  /* Everything is now in the new segments, so drop the old, along with *
+   * every dictionary but the newest.                                    */
+  for(i = 0; i < nsegs; i++) {
+    seprintf(seg, FILE_MAX, PACKS_DIR"/%08lx", segs[i]);
+    remove(seg);
+  }
+  for(i = 0; i < 65536; i++) {
+    if(!loose[i]) continue;
+    seprintf(file, FILE_MAX, NOTES_DIR"/%04x", i);
+    remove(file);
+  }
+  ds = ntx_segments(DICTS_DIR, &nds);
+  for(i = 0; i + 1 < nds; i++) {
+    seprintf(file, FILE_MAX, DICTS_DIR"/%08lx", ds[i]);
+    remove(file);
+  }
+
+  /* Forget the old map, and the dictionaries it used. */
+  for(i = 0; i < ndicts; i++) free(dicts[i].buf);
+  free(dicts);
+  dicts  = NULL;
+  ndicts = 0;
+  newest = -2;
+  free(map);
+  map = NULL;
+
+  release(ds);
+  release(loose);
+  release(segs);
+  release(ids);
+}
@@ -0,0 +1,369 @@
+/*
+ * ntx reindex: Rebuild the index, tags and refs from the notes themselves.
+ *
+ * Summaries are recomputed from the notes, and the tags of each note are
+ * taken from the existing backreferences, as those are the only record of
+ * them; If a note is named on several lines, it keeps the tags of each.
+ * Every derived file is then written once, sorted by ID, into a temporary
+ * file which replaces the original when complete. Finally, the packs are
+ * compacted to the current version of each note, and the history to the
+ * revisions of the notes which remain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "except.h"
+#include "exc_io.h"
+#include "hash_table.h"
+#include "sched.h"
+#include "stats.h"
+#include "ntx.h"
+
+/* Number of notes to summarize per task. */
+#define SUMMARY_GRAIN 64
+
+struct note {
+  char id[ID_LENGTH + 1];
+  char summary[SUMMARY_LENGTH + PADDING_LENGTH];
+  enum EXCEPTION_TYPE err;
+  unsigned int tagi, tagc; /* Offset and count of its tags in 'tagv'. */
+};
+
+struct bucket { /* A refs file, loaded on a worker thread. */
+  char path[FILE_MAX];
+  char *buf;
+  exception_t exc;
+};
+
+struct tagout { /* The notes of a single tag, by index into the notes. */
+  char *name;
+  unsigned int *notes;
+  unsigned int count, size;
+};
+
+struct output { /* A derived file, and the lines to write to it. */
+  char path[FILE_MAX];
+  struct tagout *tag; /* Tag to write, or NULL for the index or refs. */
+  unsigned int first, last;
+  unsigned long crc, len;
+  exception_t exc;
+};
+
+static struct note *notes;
+static char **tagv;
+
+unsigned long hash_tag(void *v)
+{
+  return hasht_hash(((struct tagout*)v)->name,
+                    strlen(((struct tagout*)v)->name), 0);
+}
+
+unsigned long hash_tagname(void *v)
+{
+  return hasht_hash((char*)v, strlen((char*)v), 0);
+}
+
+int cmp_tag(void *a, void *b)
+{
+  return strcmp(((struct tagout*)a)->name, ((struct tagout*)b)->name);
+}
+
+int cmp_tagname(void *a, void *b)
+{
+  return strcmp(((struct tagout*)a)->name, (char*)b);
+}
+
+void ntx_freetag(void *v)
+{
+  free(((struct tagout*)v)->notes);
+  free(v);
+}
+
+void ntx_loadrefs(void *v)
+{
+  struct bucket *b = v;
+
+  b->buf = NULL;
+  b->exc.type = E_NONE;
+
+  try {
+    b->buf = ntx_buffer(b->path);
+    disown(b->buf);
+  } catch(b->exc) b->buf = NULL;
+}
+
+void ntx_summarize(void *v, unsigned int lo, unsigned int hi)
+{
+  char file[FILE_MAX];
+  exception_t exc;
+
+  for(; lo < hi; lo++) {
+    notes[lo].err = E_NONE;
+    try {
+      seprintf(file, FILE_MAX, NOTES_DIR"/%s", notes[lo].id);
+      note_summary(file, notes[lo].summary);
+    } catch(exc) notes[lo].err = exc.type;
+  }
+}
+
+void ntx_writeout(void *v)
+{
+  struct output *o = v;
+  char tmp[FILE_MAX], line[SUMREC_LENGTH];
+  unsigned int i, len;
+  char **tag;
+  gzFile *f;
+
+  o->exc.type = E_NONE;
+
+  try {
+    seprintf(tmp, FILE_MAX, "%s.new", o->path);
+    f = gzf_open(tmp, "w");
+
+    for(i = o->first; i < o->last; i++) {
+      struct note *n = notes + (o->tag ? o->tag->notes[i] : i);
+
+      if(o->tag || !strcmp(o->path, INDEX_FILE)) {
+        len = seprintf(line, SUMREC_LENGTH, "%s%c%s",
+                       n->id, ID_SEP, n->summary);
+        gzf_write(f, line, len);
+      } else { /* A refs bucket; Write the tags of each note. */
+        gzf_write(f, n->id, ID_LENGTH);
+        gzf_write(f, (char*)&ID_SEP, SEP_LENGTH);
+        for(tag = tagv + n->tagi; tag < tagv + n->tagi + n->tagc; tag++) {
+          gzf_putl(f, *tag);
+          gzf_putl(f, (char*)FIELD_SEP);
+        }
+        gzf_write(f, "\n", 1);
+      }
+    }
+
+    release(f);
+    if(rename(tmp, o->path) != 0) throw(E_FACCESS, o->path);
+    ntx_checksum(o->path, 0, &o->crc, &o->len);
+  } catch(o->exc) remove(tmp);
+}
+
+/* Remove any derived file in 'dir' which wasn't just rewritten. */
+void ntx_prune(char *dir, hash_t *keep, unsigned int *buckets)
+{
+  char file[FILE_MAX], *name;
+  n_dir d = ntx_dopen(dir);
+
+  while((name = ntx_dread(d))) {
+    if(name[0] == '.') continue;
+    if(keep ? hasht_get(keep, name) != NULL
+            : (strlen(name) == 2 && strspn(name, "0123456789abcdef") == 2 &&
+               buckets[strtol(name, NULL, 16)]))
+      continue;
+
+    seprintf(file, FILE_MAX, "%s/%s", dir, name);
+    remove(file);
+  }
+  ntx_dclose(d);
+}
+
+void ntx_reindex(void)
+{
+  struct bucket *refs;
+  struct output *outs;
+  struct tagout *t;
+  struct stamp *stamps;
+  hash_t *tags;
+  char file[FILE_MAX], *line, *end, *state;
+  char *tok;
+  unsigned int *found, buckets[256];
+  unsigned short *ids;
+  unsigned int count = 0, ntok = 0, tsize = 1024;
+  unsigned int nouts, ntags, i, j, k;
+
+  /* Find every note, packed or not, in order. */
+  stats_begin(PH_LOAD);
+  ids = note_ids(&count);
+  notes = alloc((count ? count : 1) * sizeof(struct note));
+  for(i = 0; i < count; i++) {
+    seprintf(notes[i].id, ID_LENGTH + 1, "%04x", ids[i]);
+    notes[i].tagi = 0;
+    notes[i].tagc = 0;
+  }
+  release(ids);
+
+  /* Summarize the notes while loading every refs bucket. */
+  refs = alloc(256 * sizeof(struct bucket));
+  for(i = 0; i < 256; i++)
+    seprintf(refs[i].path, FILE_MAX, REFS_DIR"/%02x", i);
+  sched_for(0, count, SUMMARY_GRAIN, ntx_summarize, NULL);
+  sched_each(ntx_loadrefs, refs, sizeof(struct bucket), 256);
+  stats_end(PH_LOAD);
+
+  /* The refs are the only record of tags, so keep whatever we can read. */
+  tagv  = alloc(tsize * sizeof(char *));
+  found = alloc(65536 * sizeof(unsigned int));
+  memset(found, 0, 65536 * sizeof(unsigned int));
+  for(i = 0; i < count; i++) found[strtol(notes[i].id, NULL, 16)] = i + 1;
+
+  for(i = 0; i < 256; i++) {
+    if(refs[i].buf) resource(refs[i].buf, free);
+    if(refs[i].exc.type == E_NONE || refs[i].exc.type == E_FACCESS) continue;
+    fprintf(stderr, "WARNING: %s is unreadable; Its notes lose their tags.\n",
+            refs[i].path);
+  }
+
+  for(i = 0; i < 256; i++) {
+    for(line = refs[i].buf; line && *line; line = end) {
+      if((end = strchr(line, '\n'))) *end++ = '\0';
+      else end = line + strlen(line);
+
+      if(strlen(line) < SUMMARY_OFFSET || line[ID_LENGTH] != ID_SEP) continue;
+      line[ID_LENGTH] = '\0';
+      if(!ntx_isid(line) || !(j = found[strtol(line, NULL, 16)])) continue;
+      /* Keep each distinct tag of the note, from every line naming it; *
+       * Earlier tags are moved along to keep them all together.        */
+      if(notes[j - 1].tagi + notes[j - 1].tagc != ntok) {
+        for(k = 0; k < notes[j - 1].tagc; k++) {
+          if(ntok == tsize) tagv = ralloc(tagv, (tsize *= 2) * sizeof(char *));
+          tagv[ntok++] = tagv[notes[j - 1].tagi + k];
+        }
+        notes[j - 1].tagi = ntok - notes[j - 1].tagc;
+      }
+      for(tok = strrtok(line + SUMMARY_OFFSET, &state, FIELD_SEP);
+          tok != NULL;
+          tok = strrtok(NULL, &state, FIELD_SEP)) {
+        for(k = notes[j - 1].tagi; k < ntok && strcmp(tagv[k], tok); k++);
+        if(k < ntok) continue;
+
+        if(ntok == tsize) tagv = ralloc(tagv, (tsize *= 2) * sizeof(char *));
+        tagv[ntok++] = tok;
+      }
+      notes[j - 1].tagc = ntok - notes[j - 1].tagi;
+    }
+  }
+
+  /* Drop notes which can't be summarized, and group the rest by tag. */
+  tags = hasht_init(64, ntx_freetag, hash_tag, hash_tagname,
+                    cmp_tag, cmp_tagname);
+  if(!tags) throw(E_NOMEM, NULL);
+  resource(tags, (resource_handler)hasht_free);
+  memset(buckets, 0, sizeof(buckets));
+
+  for(i = j = 0; i < count; i++) {
+    if(notes[i].err != E_NONE) {
+      fprintf(stderr, "WARNING: Note %s is %s; It has been left out.\n",
+              notes[i].id, notes[i].err == E_INVAL ? "empty" : "unreadable");
+      continue;
+    }
+    notes[j] = notes[i];
+
+    /* Untagged notes are still written to the refs, so rm can find them. */
+    for(k = notes[j].tagi; k < notes[j].tagi + notes[j].tagc; k++) {
+      if(!(t = hasht_get(tags, tagv[k]))) {
+        if(!(t = calloc(1, sizeof(struct tagout)))) throw(E_NOMEM, NULL);
+        t->name = tagv[k];
+        hasht_add(tags, t);
+      }
+      if(t->count == t->size) {
+        unsigned int *grown;
+
+        t->size = t->size ? t->size * 2 : 16;
+        if(!(grown = realloc(t->notes, t->size * sizeof(unsigned int))))
+          throw(E_NOMEM, NULL);
+        t->notes = grown;
+      }
+      t->notes[t->count++] = j;
+    }
+    buckets[strtol(notes[j].id, NULL, 16) >> 8]++;
+    j++;
+  }
+  count = j;
+
+  /* One output per tag, per refs bucket, and for the index. */
+  ntags = tags->used;
+  outs = alloc((ntags + 257) * sizeof(struct output));
+  for(nouts = 0; (t = hasht_next(tags)); nouts++) {
+    seprintf(outs[nouts].path, FILE_MAX, TAGS_DIR"/%s", t->name);
+    outs[nouts].tag   = t;
+    outs[nouts].first = 0;
+    outs[nouts].last  = t->count;
+  }
+
+  for(i = j = 0; i < 256; j += buckets[i++]) {
+    if(!buckets[i]) continue;
+    seprintf(outs[nouts].path, FILE_MAX, REFS_DIR"/%02x", i);
+    outs[nouts].tag   = NULL;
+    outs[nouts].first = j;
+    outs[nouts++].last = j + buckets[i];
+  }
+
+  cache_dropindex();
+  seprintf(outs[nouts].path, FILE_MAX, INDEX_FILE);
+  outs[nouts].tag   = NULL;
+  outs[nouts].first = 0;
+  outs[nouts++].last = count;
+
+  stats_begin(PH_OUTPUT);
+  sched_each(ntx_writeout, outs, sizeof(struct output), nouts);
+  stats_end(PH_OUTPUT);
+  for(i = 0; i < nouts; i++)
+    if(outs[i].exc.type != E_NONE) throw(outs[i].exc.type, outs[i].exc.value);
+
+  /* Every derived file has been rewritten, so record them all afresh. */
+  manifest_clear();
+  for(i = 0; i < nouts; i++)
+    manifest_record(outs[i].path, outs[i].crc, outs[i].len);
+
+  /* Rebuild the filter of each tag, now that its checksum is known. */
+  if(ntx_mkdir(FILTERS_DIR) != 0) throw(E_FACCESS, FILTERS_DIR);
+  ids = alloc(65536 * sizeof(unsigned short));
+  for(i = 0; i < nouts && outs[i].tag; i++) {
+    t = outs[i].tag;
+    for(k = 0; k < t->count; k++)
+      ids[k] = strtol(notes[t->notes[k]].id, NULL, 16);
+    filter_write_ids(t->name, ids, t->count);
+  }
+  release(ids);
+
+  /* Compact the timestamps to one line per note. Notes which never had *
+   * one are given the time at which their file was last modified. As  *
+   * the notes are sorted by ID, each stamp only ever moves down over   *
+   * those already taken.                                               */
+  stamps = alloc(65536 * sizeof(struct stamp));
+  memset(stamps, 0, 65536 * sizeof(struct stamp));
+  times_load(stamps);
+  for(i = 0; i < count; i++) {
+    struct stamp *s = stamps + strtol(notes[i].id, NULL, 16);
+
+    if(!s->id[0]) {
+      strcpy(s->id, notes[i].id);
+      seprintf(file, FILE_MAX, NOTES_DIR"/%s", notes[i].id);
+      s->created = s->modified = note_ftime(file);
+    }
+    stamps[i] = *s;
+  }
+  times_write(stamps, count);
+  release(stamps);
+
+  /* Now that every note has its time, pack them afresh. */
+  pack_compact();
+  history_compact();
+
+  /* Finally, remove the files of tags and buckets which are now empty. */
+  ntx_prune(TAGS_DIR, tags, NULL);
+  ntx_prune(FILTERS_DIR, tags, NULL);
+  ntx_prune(REFS_DIR, NULL, buckets);
+  view_refresh(NULL, 0);
+  related_rebuild();
+  grams_rebuild();
+
+  printf("Reindexed %u notes with %u tags.\n", count, ntags);
+
+  stats_table(tags, "tags");
+  release(outs);
+  release(tags);
+  release(found);
+  release(tagv);
+  for(i = 0; i < 256; i++) if(refs[i].buf) release(refs[i].buf);
+  release(refs);
+  release(notes);
+}
@@ -0,0 +1,497 @@
+/*
+ * ntx related: Suggest the notes most like one, by their tags and text.
+ *
+ * Each note has a MinHash signature of RELATED_SIG values, the first half
+ * over its tags and the second over the shingles of its text (each run of
+ * RELATED_WORDS words), so that the fraction of values two notes share in
+ * each half estimates how alike their tags, and their text, are. The
+ * signatures are kept a line per note in RELATED_DIR/s<xx>, bucketed by
+ * ID as the refs are.
+ *
+ * Each half is cut into bands of RELATED_ROWS values, and the hash of each
+ * band is kept with the note's ID in RELATED_DIR/b<yy>, by its low byte.
+ * Notes which share any band are the candidates for a note, and only they
+ * are compared, so a lookup reads a few small files whatever the number
+ * of notes.
+ *
+ * The signatures are built by the first ntx related, and from then on kept
+ * up to date by add, edit, tag, rm, tag-rename, tag-merge and retag
+ * --where; A change of tags only rehashes the tags, and an edit the text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "except.h"
+#include "exc_io.h"
+#include "hash_table.h"
+#include "ntx.h"
+
+/* Values per signature, half for the tags and half for the text. */
+#define RELATED_SIG   32
+#define RELATED_HALF  (RELATED_SIG / 2)
+
+/* Values per band; A pair sharing 60% of a half likely share a band. */
+#define RELATED_ROWS  4
+#define RELATED_BANDS (RELATED_SIG / RELATED_ROWS)
+
+/* Words per shingle of the text. */
+#define RELATED_WORDS 3
+
+/* Notes suggested, unless told otherwise. */
+#define RELATED_TOP   10
+
+#define RELATED_LINE  (ID_LENGTH + 1 + RELATED_SIG * 8 + 2)
+#define RELATED_NONE  0xffffffffUL
+
+/* Spread the bits of a hash, as MurmurHash3 finishes one. */
+static unsigned long related_mix(unsigned long h)
+{
+  h &= 0xffffffffUL;
+  h = ((h ^ (h >> 16)) * 0x85ebca6bUL) & 0xffffffffUL;
+  h = ((h ^ (h >> 13)) * 0xc2b2ae35UL) & 0xffffffffUL;
+  return h ^ (h >> 16);
+}
+
+/* Keep the least of each of the hashes of a feature. */
+static void related_feature(unsigned long *half, unsigned long f)
+{
+  unsigned long h;
+  unsigned int k;
+
+  for(k = 0; k < RELATED_HALF; k++)
+    if((h = related_mix(f + (k + 1) * 0x9e3779b9UL)) < half[k]) half[k] = h;
+}
+
+static void related_tags(char **tags, unsigned long *half)
+{
+  unsigned int k;
+
+  for(k = 0; k < RELATED_HALF; k++) half[k] = RELATED_NONE;
+  for(; tags && *tags; tags++)
+    related_feature(half, hasht_hash(*tags, strlen(*tags), 0));
+}
+
+/* Hash each run of words of the text, ignoring case and punctuation. */
+static void related_text(char *body, unsigned long *half)
+{
+  unsigned long words[RELATED_WORDS], f;
+  unsigned int k, n = 0;
+  char word[64];
+
+  for(k = 0; k < RELATED_HALF; k++) half[k] = RELATED_NONE;
+  while(*body) {
+    for(; *body && !isalnum((unsigned char)*body); body++);
+    for(k = 0; *body && isalnum((unsigned char)*body); body++)
+      if(k < sizeof(word)) word[k++] = tolower((unsigned char)*body);
+    if(!k) break;
+
+    memmove(words, words + 1, (RELATED_WORDS - 1) * sizeof(unsigned long));
+    words[RELATED_WORDS - 1] = hasht_hash(word, k, 0);
+    if(++n < RELATED_WORDS) continue;
+
+    for(f = 0, k = 0; k < RELATED_WORDS; k++) f = related_mix(f ^ words[k]);
+    related_feature(half, f);
+  }
+
+  /* A note too short for a whole shingle is its words. */
+  for(k = 0; n < RELATED_WORDS && k < n; k++)
+    related_feature(half, words[RELATED_WORDS - 1 - k]);
+}
+
+/* The hash of band 'b' of a signature; 0 if that half is empty. */
+static unsigned long related_band(unsigned long *sig, unsigned int b)
+{
+  unsigned long h = b;
+  unsigned int k;
+
+  if(sig[(b * RELATED_ROWS / RELATED_HALF) * RELATED_HALF] == RELATED_NONE)
+    return 0;
+  for(k = 0; k < RELATED_ROWS; k++)
+    h = related_mix(h * 31 + sig[b * RELATED_ROWS + k]);
+  return h ? h : 1;
+}
+
+/* The fraction of the values which two signatures share, in each half *
+ * which either has, averaged.                                         */
+static double related_score(unsigned long *a, unsigned long *b)
+{
+  unsigned int h, k, same;
+  double score = 0;
+
+  for(h = 0; h < RELATED_SIG; h += RELATED_HALF) {
+    if(a[h] == RELATED_NONE && b[h] == RELATED_NONE) continue;
+    for(k = same = 0; k < RELATED_HALF; k++) same += a[h + k] == b[h + k];
+    score += (double)same / RELATED_HALF;
+  }
+  return score / 2;
+}
+
+/* Check whether the signatures have been built. */
+int related_exists(void)
+{
+  exception_t exc;
+  n_dir dir;
+
+  try dir = ntx_dopen(RELATED_DIR);
+  catch(exc) return 0;
+  ntx_dclose(dir);
+  return 1;
+}
+
+static unsigned int related_format(char *line, unsigned int id,
+                                   unsigned long *sig)
+{
+  unsigned int k, len;
+
+  len = seprintf(line, RELATED_LINE, "%04x%c", id, ID_SEP);
+  for(k = 0; k < RELATED_SIG; k++)
+    len += seprintf(line + len, RELATED_LINE - len, "%08lx", sig[k]);
+  line[len++] = '\n';
+  line[len] = '\0';
+  return len;
+}
+
+/* Parse the signature from a line of a bucket; Returns 0 if malformed. */
+static int related_parse(char *line, unsigned long *sig)
+{
+  char hex[9];
+  unsigned int k;
+
+  if(strlen(line) < SUMMARY_OFFSET + RELATED_SIG * 8) return 0;
+  for(hex[8] = '\0', k = 0; k < RELATED_SIG; k++) {
+    memcpy(hex, line + SUMMARY_OFFSET + k * 8, 8);
+    sig[k] = strtoul(hex, NULL, 16);
+  }
+  return 1;
+}
+
+/* Rewrite a file without the lines of the note 'id', then with 'lines'. */
+static void related_rewrite(char *file, char *id, char *lines)
+{
+  char *buf = NULL, *line, *end;
+  unsigned int written = 0;
+  exception_t exc;
+  gzFile *out;
+
+  try buf = ntx_buffer(file);
+  catch(exc) if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+
+  out = gzf_open(file, "w");
+  for(line = buf; line && *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+    if(strncmp(line, id, ID_LENGTH))
+      written += gzf_write(out, line, end - line + 1);
+  }
+  if(*lines) written += gzf_putl(out, lines);
+  release(out);
+  if(buf) release(buf);
+
+  if(written == 0) remove(file);
+  manifest_update(file);
+}
+
+/* Replace the signature 'old' of a note (NULL if it had none) with 'sig' *
+ * (NULL to forget it), in its bucket and in the files of its bands.      */
+static void related_store(char *id, unsigned long *old, unsigned long *sig)
+{
+  char file[FILE_MAX], line[RELATED_LINE], lines[RELATED_BANDS * 16 + 1];
+  unsigned long keys[2 * RELATED_BANDS];
+  unsigned int b, k, len;
+
+  if(sig) related_format(line, strtol(id, NULL, 16), sig);
+  else *line = '\0';
+  seprintf(file, FILE_MAX, RELATED_DIR"/s%.2s", id);
+  related_rewrite(file, id, line);
+
+  /* Each file of the old and new bands is rewritten once. */
+  for(b = 0; b < RELATED_BANDS; b++) {
+    keys[b] = old ? related_band(old, b) : 0;
+    keys[RELATED_BANDS + b] = sig ? related_band(sig, b) : 0;
+  }
+  for(b = 0; b < 2 * RELATED_BANDS; b++) {
+    if(!keys[b]) continue;
+    for(k = 0; k < b && (!keys[k] || (keys[k] & 0xff) != (keys[b] & 0xff)); k++);
+    if(k < b) continue;
+
+    for(len = 0, k = RELATED_BANDS; k < 2 * RELATED_BANDS; k++)
+      if(keys[k] && (keys[k] & 0xff) == (keys[b] & 0xff))
+        len += seprintf(lines + len, sizeof(lines) - len, "%s%c%08lx\n",
+                        id, ID_SEP, keys[k]);
+    lines[len] = '\0';
+    seprintf(file, FILE_MAX, RELATED_DIR"/b%02lx", keys[b] & 0xff);
+    related_rewrite(file, id, lines);
+  }
+}
+
+/* Read the signature of a note; Returns 0 if it has none. */
+static int related_load(char *id, unsigned long *sig)
+{
+  char file[FILE_MAX], *line;
+  exception_t exc;
+  int found;
+
+  seprintf(file, FILE_MAX, RELATED_DIR"/s%.2s", id);
+  try line = ntx_find(file, id);
+  catch(exc) {
+    if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+    return 0;
+  }
+  if(!line) return 0;
+  found = related_parse(line, sig);
+  release(line);
+  return found;
+}
+
+/* Bring the signature of a note up to date, with its tags if 'tags' is *
+ * given and its text if 'text' is set; Either is read afresh if the    *
+ * note had no signature.                                               */
+void related_update(char *id, char **tags, int text)
+{
+  char file[FILE_MAX], *buf, *body, **tagv;
+  unsigned long old[RELATED_SIG], sig[RELATED_SIG];
+  unsigned int len;
+  int had;
+
+  if(!related_exists()) return;
+  had = related_load(id, old);
+  if(had) memcpy(sig, old, sizeof(sig));
+
+  if(tags) related_tags(tags, sig);
+  else if(!had) {
+    seprintf(file, FILE_MAX, REFS_DIR"/%.2s", id);
+    if(!(buf = ntx_find(file, id))) return;
+    tagv = strtokens(buf + SUMMARY_OFFSET, FIELD_SEP);
+    related_tags(tagv, sig);
+    release(tagv);
+    release(buf);
+  }
+
+  if(text || !had) {
+    seprintf(file, FILE_MAX, NOTES_DIR"/%s", id);
+    body = note_read(file, &len);
+    related_text(body, sig + RELATED_HALF);
+    release(body);
+  }
+
+  related_store(id, had ? old : NULL, sig);
+}
+
+/* Forget the signature of a note which has been removed. */
+void related_drop(char *id)
+{
+  unsigned long old[RELATED_SIG];
+
+  if(related_exists() && related_load(id, old)) related_store(id, old, NULL);
+}
+
+struct bandent { /* A band of a note, for sorting by file. */
+  unsigned long key;
+  unsigned short id;
+};
+
+static int related_sortband(const void *a, const void *b)
+{
+  const struct bandent *x = a, *y = b;
+
+  if((x->key & 0xff) != (y->key & 0xff))
+    return (x->key & 0xff) < (y->key & 0xff) ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+/* Write the signature of every note afresh. */
+void related_build(void)
+{
+  char file[FILE_MAX], refs[FILE_MAX], note[FILE_MAX], line[RELATED_LINE];
+  char id[ID_LENGTH + 1], *buf, *body, **tagv;
+  unsigned long *sigs;
+  unsigned short *ids;
+  unsigned int count, i, b, n, len;
+  struct bandent *bands;
+  exception_t exc;
+  gzFile *out;
+
+  if(ntx_mkdir(RELATED_DIR) != 0) throw(E_FACCESS, RELATED_DIR);
+  ids  = note_ids(&count);
+  sigs = alloc((count ? count : 1) * RELATED_SIG * sizeof(unsigned long));
+  bands = alloc((count ? count : 1) * RELATED_BANDS * sizeof(struct bandent));
+
+  /* Sign each note, writing each bucket of signatures as it fills. */
+  for(i = n = 0, out = NULL; i < count; i++) {
+    if(!out || (ids[i] >> 8) != (ids[i - 1] >> 8)) {
+      if(out) {
+        release(out);
+        manifest_update(file);
+      }
+      seprintf(file, FILE_MAX, RELATED_DIR"/s%02x", ids[i] >> 8);
+      out = gzf_open(file, "w");
+    }
+
+    seprintf(id, ID_LENGTH + 1, "%04x", ids[i]);
+    seprintf(refs, FILE_MAX, REFS_DIR"/%.2s", id);
+    try buf = ntx_find(refs, id);
+    catch(exc) buf = NULL;
+    tagv = buf ? strtokens(buf + SUMMARY_OFFSET, FIELD_SEP) : NULL;
+    related_tags(tagv, sigs + i * RELATED_SIG);
+    if(tagv) release(tagv);
+    if(buf) release(buf);
+
+    seprintf(note, FILE_MAX, NOTES_DIR"/%s", id);
+    try {
+      body = note_read(note, &len);
+      related_text(body, sigs + i * RELATED_SIG + RELATED_HALF);
+      release(body);
+    } catch(exc) related_text("", sigs + i * RELATED_SIG + RELATED_HALF);
+
+    len = related_format(line, ids[i], sigs + i * RELATED_SIG);
+    gzf_write(out, line, len);
+    for(b = 0; b < RELATED_BANDS; b++)
+      if((bands[n].key = related_band(sigs + i * RELATED_SIG, b)))
+        bands[n++].id = ids[i];
+  }
+  if(out) {
+    release(out);
+    manifest_update(file);
+  }
+
+  /* Then the bands, a file at a time. */
+  qsort(bands, n, sizeof(struct bandent), related_sortband);
+  for(i = 0, out = NULL; i < n; i++) {
+    if(!out || (bands[i].key & 0xff) != (bands[i - 1].key & 0xff)) {
+      if(out) {
+        release(out);
+        manifest_update(file);
+      }
+      seprintf(file, FILE_MAX, RELATED_DIR"/b%02lx", bands[i].key & 0xff);
+      out = gzf_open(file, "w");
+    }
+    len = seprintf(line, RELATED_LINE, "%04x%c%08lx\n",
+                   bands[i].id, ID_SEP, bands[i].key);
+    gzf_write(out, line, len);
+  }
+  if(out) {
+    release(out);
+    manifest_update(file);
+  }
+
+  release(bands);
+  release(sigs);
+  release(ids);
+}
+
+/* Rebuild the signatures if they have been built before, as ntx reindex *
+ * does; Buckets of signatures and bands left empty are removed.         */
+void related_rebuild(void)
+{
+  char file[FILE_MAX];
+  unsigned int i;
+
+  if(!related_exists()) return;
+  for(i = 0; i < 256; i++) {
+    seprintf(file, FILE_MAX, RELATED_DIR"/s%02x", i);
+    remove(file);
+    manifest_update(file);
+    seprintf(file, FILE_MAX, RELATED_DIR"/b%02x", i);
+    remove(file);
+    manifest_update(file);
+  }
+  related_build();
+}
+
+struct match {
+  unsigned int id;
+  double score;
+};
+
+static int related_sortmatch(const void *a, const void *b)
+{
+  const struct match *x = a, *y = b;
+
+  if(x->score != y->score) return x->score < y->score ? 1 : -1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+/* List the (at most 'top') notes most like the note 'id'. */
+void ntx_related(char *id, unsigned int top)
+{
+  char file[FILE_MAX], *buf, *line, *end, *out;
+  unsigned long sig[RELATED_SIG], other[RELATED_SIG], keys[RELATED_BANDS], key;
+  unsigned char *cand, buckets[256], files[256];
+  unsigned int b, i, n = 0, self = strtol(id, NULL, 16) & 0xffff, c;
+  struct match *matches;
+  exception_t exc;
+
+  if(!ntx_isid(id)) die("Invalid note %s.", id);
+  if(!related_exists()) related_build();
+  if(!related_load(id, sig))
+    die("Unable to locate note %s in "RELATED_DIR"/s%.2s.", id, id);
+  if(!top) top = RELATED_TOP;
+
+  /* Collect the notes which share a band, from each file of the bands. */
+  cand = alloc(65536 / 8);
+  memset(cand, 0, 65536 / 8);
+  memset(buckets, 0, sizeof(buckets));
+  memset(files, 0, sizeof(files));
+  for(b = 0; b < RELATED_BANDS; b++)
+    if((keys[b] = related_band(sig, b))) files[keys[b] & 0xff] = 1;
+
+  for(i = 0; i < 256; i++) {
+    if(!files[i]) continue;
+    seprintf(file, FILE_MAX, RELATED_DIR"/b%02x", i);
+    try buf = ntx_buffer(file);
+    catch(exc) {
+      if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+      continue;
+    }
+    for(line = buf; *line; line = end + 1) {
+      if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+      key = strtoul(line + SUMMARY_OFFSET, NULL, 16);
+      for(b = 0; b < RELATED_BANDS && keys[b] != key; b++);
+      if(b == RELATED_BANDS) continue;
+
+      c = strtol(line, NULL, 16) & 0xffff;
+      if(c == self || cand[c / 8] & (1 << (c % 8))) continue;
+      cand[c / 8] |= 1 << (c % 8);
+      buckets[c >> 8] = 1;
+      n++;
+    }
+    release(buf);
+  }
+
+  /* Score each candidate against the note, a bucket of them at a time. */
+  matches = alloc((n ? n : 1) * sizeof(struct match));
+  for(i = n = 0; i < 256; i++) {
+    if(!buckets[i]) continue;
+    seprintf(file, FILE_MAX, RELATED_DIR"/s%02x", i);
+    buf = ntx_buffer(file);
+    for(line = buf; *line; line = end + 1) {
+      if(!(end = strchr(line, '\n'))) throw(E_INVAL, file);
+      *end = '\0';
+      c = strtol(line, NULL, 16) & 0xffff;
+      if(!(cand[c / 8] & (1 << (c % 8))) || !related_parse(line, other))
+        continue;
+      matches[n].id = c;
+      matches[n++].score = related_score(sig, other);
+    }
+    release(buf);
+  }
+  qsort(matches, n, sizeof(struct match), related_sortmatch);
+
+  /* List them as ntx list would, with their summaries. */
+  if(n > top) n = top;
+  out = alloc(n * SUMREC_LENGTH + 1);
+  for(i = 0, line = out; i < n; i++) {
+    seprintf(file, FILE_MAX, NOTES_DIR"/%04x", matches[i].id);
+    seprintf(line, SUMREC_LENGTH, "%04x%c", matches[i].id, ID_SEP);
+    note_summary(file, line + SUMMARY_OFFSET);
+    line += strlen(line);
+  }
+  *line = '\0';
+
+  out_begin();
+  out_notes(out);
+  release(out);
+  release(matches);
+  release(cand);
+}
@@ -0,0 +1,359 @@
+/*
+ * Work-stealing task scheduler for the bulk operations of ntx.
+ *
+ * Every thread of the pool, the main thread included, owns a deque of
+ * tasks. A thread pushes and pops tasks at the tail of its own deque,
+ * and when that runs dry it steals from the head of another's, so that
+ * the oldest (and typically largest) pieces of work are the ones which
+ * move between threads. Tasks are run inside a try block; The first
+ * exception thrown by a task of a group is rethrown by sched_join on
+ * the joining thread, once every task of the group has finished.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "sched.h"
+#include "stats.h"
+
+/* Prototypes of system-dependent functions. */
+unsigned int ntx_ncpu(void);
+void *ntx_tstart(void (*fn)(void *), void *arg);
+void ntx_tjoin(void *thread);
+
+void *ntx_mnew(void);
+void ntx_mfree(void *monitor);
+void ntx_mlock(void *monitor);
+void ntx_munlock(void *monitor);
+void ntx_mwait(void *monitor);
+void ntx_mwake(void *monitor);
+
+/* Initial number of slots in each deque; Always a power of two. */
+#define DEQUE_SZ 64
+
+struct task {
+  void (*fn)(void *);
+  void *arg;
+  tgroup_t *group;
+};
+
+struct deque { /* 'head' and 'tail' only ever increase; Mask to index. */
+  void *lock;
+  struct task **tasks;
+  unsigned int head, tail, size;
+};
+
+struct pool {
+  unsigned int workers;
+  struct deque *deques;
+  void **threads;
+
+  /* Guards 'queued', 'stop' and the pending count of every group. */
+  void *idle;
+  int queued, stop;
+};
+
+static struct pool *pool = NULL;
+static THREAD_LOCAL unsigned int self = 0; /* Our deque; 0 is the main thread. */
+
+
+static void deque_push(struct deque *d, struct task *t)
+{
+  ntx_mlock(d->lock);
+  if(d->tail - d->head == d->size) { /* Full; Unwrap into a larger array. */
+    struct task **tasks = malloc(2 * d->size * sizeof(struct task *));
+    unsigned int i;
+
+    if(!tasks) {
+      ntx_munlock(d->lock);
+      throw(E_NOMEM, NULL);
+    }
+
+    for(i = 0; i < d->size; i++)
+      tasks[i] = d->tasks[(d->head + i) & (d->size - 1)];
+    free(d->tasks);
+    d->tasks = tasks;
+    d->head  = 0;
+    d->tail  = d->size;
+    d->size *= 2;
+  }
+  d->tasks[d->tail++ & (d->size - 1)] = t;
+  ntx_munlock(d->lock);
+}
+
+static struct task *deque_pop(struct deque *d)
+{
+  struct task *t = NULL;
+
+  ntx_mlock(d->lock);
+  if(d->tail != d->head) t = d->tasks[--d->tail & (d->size - 1)];
+  ntx_munlock(d->lock);
+  return t;
+}
+
+static struct task *deque_steal(struct deque *d)
+{
+  struct task *t = NULL;
+
+  ntx_mlock(d->lock);
+  if(d->tail != d->head) t = d->tasks[d->head++ & (d->size - 1)];
+  ntx_munlock(d->lock);
+  return t;
+}
+
+/* Take a task from our own deque, or failing that, from someone else's. */
+static struct task *sched_take(void)
+{
+  struct task *t = deque_pop(pool->deques + self);
+  unsigned int i;
+
+  for(i = 1; !t && i < pool->workers; i++)
+    t = deque_steal(pool->deques + (self + i) % pool->workers);
+
+  if(t) {
+    ntx_mlock(pool->idle);
+    pool->queued--;
+    ntx_munlock(pool->idle);
+  }
+  return t;
+}
+
+static void sched_run(struct task *t)
+{
+  tgroup_t *group = t->group;
+  exception_t exc;
+
+  try t->fn(t->arg);
+  catch(exc) {
+    ntx_mlock(pool->idle);
+    if(group->exc.type == E_NONE) group->exc = exc;
+    ntx_munlock(pool->idle);
+  }
+  free(t);
+  if(self) stats_merge(); /* Before the joiner can report the totals. */
+
+  ntx_mlock(pool->idle);
+  if(--group->pending == 0) ntx_mwake(pool->idle);
+  ntx_munlock(pool->idle);
+}
+
+static void sched_work(void *d)
+{
+  struct task *t;
+
+  self = (struct deque *)d - pool->deques;
+
+  while(1) {
+    if((t = sched_take())) {
+      sched_run(t);
+      continue;
+    }
+
+    ntx_mlock(pool->idle);
+    while(pool->queued <= 0 && !pool->stop) ntx_mwait(pool->idle);
+    if(pool->stop) {
+      ntx_munlock(pool->idle);
+      return;
+    }
+    ntx_munlock(pool->idle);
+  }
+}
+
+/* The number of threads to use, from NTX_THREADS or the processor count. */
+unsigned int sched_jobs(void)
+{
+  char *env = getenv("NTX_THREADS");
+  int jobs;
+
+  if(env && (jobs = atoi(env)) > 0) return jobs;
+  return ntx_ncpu();
+}
+
+/* Start the pool on first use. If threads can't be started, the tasks  *
+ * of their deques are simply left for the remaining threads to steal.  */
+static void sched_start(void)
+{
+  unsigned int i, n = sched_jobs();
+
+  if(!(pool = calloc(1, sizeof(struct pool))) ||
+     !(pool->deques = calloc(n, sizeof(struct deque))) ||
+     !(pool->threads = calloc(n, sizeof(void *))) ||
+     !(pool->idle = ntx_mnew()))
+    throw(E_NOMEM, NULL);
+
+  for(i = 0; i < n; i++) {
+    pool->deques[i].size = DEQUE_SZ;
+    if(!(pool->deques[i].lock = ntx_mnew()) ||
+       !(pool->deques[i].tasks = malloc(DEQUE_SZ * sizeof(struct task *))))
+      throw(E_NOMEM, NULL);
+  }
+
+  pool->workers = n;
+  for(i = 1; i < n; i++)
+    pool->threads[i] = ntx_tstart(sched_work, pool->deques + i);
+}
+
+/* Stop and join the worker threads, if any were started. */
+void sched_done(void)
+{
+  unsigned int i;
+
+  if(!pool) return;
+
+  ntx_mlock(pool->idle);
+  pool->stop = 1;
+  ntx_mwake(pool->idle);
+  ntx_munlock(pool->idle);
+
+  for(i = 0; i < pool->workers; i++) {
+    if(pool->threads[i]) ntx_tjoin(pool->threads[i]);
+    ntx_mfree(pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+
+  ntx_mfree(pool->idle);
+  free(pool->threads);
+  free(pool->deques);
+  free(pool);
+  pool = NULL;
+}
+
+/* Queue fn(arg) as part of 'group'. Every group spawned into _must_ be *
+ * joined before it goes out of scope, even when unwinding.             */
+void sched_spawn(tgroup_t *group, void (*fn)(void *), void *arg)
+{
+  struct task *t;
+  exception_t exc;
+
+  if(!pool) sched_start();
+  if(!(t = malloc(sizeof(struct task)))) throw(E_NOMEM, NULL);
+
+  t->fn    = fn;
+  t->arg   = arg;
+  t->group = group;
+
+  ntx_mlock(pool->idle);
+  group->pending++;
+  ntx_munlock(pool->idle);
+
+  try deque_push(pool->deques + self, t);
+  catch(exc) {
+    free(t);
+    ntx_mlock(pool->idle);
+    group->pending--;
+    ntx_munlock(pool->idle);
+    throw(exc.type, exc.value);
+  }
+
+  ntx_mlock(pool->idle);
+  pool->queued++;
+  ntx_mwake(pool->idle);
+  ntx_munlock(pool->idle);
+}
+
+/* Wait for every task in 'group', running queued tasks in the meantime. */
+void sched_join(tgroup_t *group)
+{
+  exception_t exc;
+  struct task *t;
+  int done;
+
+  if(!pool) return;
+
+  while(1) {
+    if((t = sched_take())) {
+      sched_run(t);
+      continue;
+    }
+
+    ntx_mlock(pool->idle);
+    while(group->pending && pool->queued <= 0) ntx_mwait(pool->idle);
+    done = !group->pending;
+    ntx_munlock(pool->idle);
+    if(done) break;
+  }
+
+  if((exc = group->exc).type != E_NONE) {
+    group->exc.type = E_NONE;
+    throw(exc.type, exc.value);
+  }
+}
+
+
+/* Parallel iteration over ranges, by recursive halving. */
+
+struct range {
+  void (*fn)(void *, unsigned int, unsigned int);
+  void *arg;
+  unsigned int lo, hi, grain;
+  tgroup_t *group;
+};
+
+static void sched_range(void *v)
+{
+  struct range r = *(struct range *)v, *right;
+
+  free(v);
+  while(r.hi - r.lo > r.grain) { /* Split off the upper half for thieves. */
+    if(!(right = malloc(sizeof(struct range)))) throw(E_NOMEM, NULL);
+    *right    = r;
+    right->lo = r.lo + (r.hi - r.lo) / 2;
+    r.hi      = right->lo;
+    sched_spawn(r.group, sched_range, right);
+  }
+  r.fn(r.arg, r.lo, r.hi);
+}
+
+/* Call fn(arg, lo, hi) over subranges of [lo, hi) no larger than 'grain'. */
+void sched_for(unsigned int lo, unsigned int hi, unsigned int grain,
+               void (*fn)(void *, unsigned int, unsigned int), void *arg)
+{
+  tgroup_t group = TGROUP_INIT;
+  struct range *r;
+  exception_t exc;
+
+  if(hi <= lo) return;
+  if(!(r = malloc(sizeof(struct range)))) throw(E_NOMEM, NULL);
+
+  r->fn    = fn;
+  r->arg   = arg;
+  r->lo    = lo;
+  r->hi    = hi;
+  r->grain = grain ? grain : 1;
+  r->group = &group;
+
+  /* Run the first piece ourselves; The rest must finish before we return. */
+  if(!pool) sched_start();
+  try sched_range(r);
+  catch(exc) {
+    ntx_mlock(pool->idle);
+    if(group.exc.type == E_NONE) group.exc = exc;
+    ntx_munlock(pool->idle);
+  }
+  sched_join(&group);
+}
+
+struct each {
+  void (*fn)(void *);
+  char *items;
+  unsigned int size;
+};
+
+static void sched_item(void *v, unsigned int lo, unsigned int hi)
+{
+  struct each *e = v;
+
+  for(; lo < hi; lo++) e->fn(e->items + lo * e->size);
+}
+
+/* Call fn on each of 'count' items of 'size' bytes, one task per item. */
+void sched_each(void (*fn)(void *), void *items, unsigned int size,
+                unsigned int count)
+{
+  struct each e;
+
+  e.fn    = fn;
+  e.items = items;
+  e.size  = size;
+  sched_for(0, count, 1, sched_item, &e);
+}
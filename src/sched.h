@@ -0,0 +1,26 @@
+#ifndef SCHED__H
+#define SCHED__H
+
+#include "except.h"
+
+/* A set of spawned tasks which may be waited on together. Initialize *
+ * it with TGROUP_INIT, or by zeroing it, before spawning into it.    */
+typedef struct {
+  unsigned int pending;
+  exception_t exc;
+} tgroup_t;
+
+#define TGROUP_INIT {0, {E_NONE, NULL}}
+
+unsigned int sched_jobs(void);
+void sched_done(void);
+
+void sched_spawn(tgroup_t *group, void (*fn)(void *), void *arg);
+void sched_join(tgroup_t *group);
+
+void sched_for(unsigned int lo, unsigned int hi, unsigned int grain,
+               void (*fn)(void *, unsigned int, unsigned int), void *arg);
+void sched_each(void (*fn)(void *), void *items, unsigned int size,
+                unsigned int count);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Performance statistics for a single run of ntx, enabled by --stats
+ * (a summary on stderr) or NTX_STATS=<file> (a JSON line appended to it).
+ *
+ * Each thread counts into its own copy of stats_count, and workers add
+ * theirs to the totals after every task, so no counter is ever shared.
+ * While disabled, every STAT() is a single test of stats_on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "stats.h"
+
+/* Prototypes of system-dependent functions. */
+double ntx_clock(void);
+void *ntx_mnew(void);
+void ntx_mlock(void *monitor);
+void ntx_munlock(void *monitor);
+
+int stats_on = 0;
+THREAD_LOCAL unsigned long stats_count[ST_COUNTERS];
+
+static const char *counter_names[ST_COUNTERS] = {
+  "files_opened", "raw_read", "gz_read", "gz_in", "gz_written", "gz_out",
+  "gz_members", "allocs", "alloc_bytes", "hash_probes", "rehashes",
+  "filtered"
+};
+
+static const char *phase_names[PH_PHASES] = {
+  "load", "intersect", "output", "update"
+};
+
+static unsigned long totals[ST_COUNTERS];
+static double phases[PH_PHASES], begun[PH_PHASES], started;
+static char *command;
+static FILE *json = NULL;
+static int print;
+static void *lock;
+
+/* A gzip file open for writing; Its growth is measured when closed. */
+struct gzwrite {
+  void *f;
+  char *path;
+  long int start;
+  struct gzwrite *next;
+};
+
+static THREAD_LOCAL struct gzwrite *writes = NULL;
+
+
+/* Open the file for NTX_STATS now, as it may be relative to the *
+ * working directory, which ntx leaves for its root directory.    */
+void stats_start(char *cmd, int stderr_summary)
+{
+  char *file = getenv("NTX_STATS");
+
+  if(file && *file && !(json = fopen(file, "a")))
+    fprintf(stderr, "WARNING: Unable to open %s for statistics.\n", file);
+  print = stderr_summary;
+  if(!print && !json) return;
+  if(!(lock = ntx_mnew())) return;
+
+  command  = cmd;
+  started  = ntx_clock();
+  stats_on = 1;
+}
+
+void stats_begin(enum STAT_PHASE p)
+{
+  if(stats_on) begun[p] = ntx_clock();
+}
+
+void stats_end(enum STAT_PHASE p)
+{
+  if(stats_on) phases[p] += ntx_clock() - begun[p];
+}
+
+/* Add the counts of this thread to the totals. */
+void stats_merge(void)
+{
+  unsigned int i;
+
+  if(!stats_on) return;
+  ntx_mlock(lock);
+  for(i = 0; i < ST_COUNTERS; i++) totals[i] += stats_count[i];
+  ntx_munlock(lock);
+  memset(stats_count, 0, sizeof(stats_count));
+}
+
+/* The size of a file, or 0 if it can't be read; This never throws. */
+static long int stats_flen(char *path)
+{
+  FILE *f = fopen(path, "rb");
+  long int len = 0;
+
+  if(!f) return 0;
+  if(fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) < 0) len = 0;
+  fclose(f);
+  return len;
+}
+
+void stats_gzopen(void *f, char *file, char *mode)
+{
+  struct gzwrite *w;
+
+  STAT(ST_FOPEN, 1);
+  if(!stats_on || !strpbrk(mode, "wa")) return;
+  STAT(ST_GZ_MEMBERS, 1);
+
+  if(!(w = malloc(sizeof(struct gzwrite)))) return;
+  if(!(w->path = strdup(file))) {
+    free(w);
+    return;
+  }
+  w->f     = f;
+  w->start = (*mode == 'a') ? stats_flen(file) : 0;
+  w->next  = writes;
+  writes   = w;
+}
+
+/* Count a closed gzip file; 'offset' is how far it was read, if it was. */
+void stats_gzclose(void *f, long int offset)
+{
+  struct gzwrite *w, **last;
+
+  if(!stats_on) return;
+  for(last = &writes; (w = *last); last = &w->next) {
+    if(w->f != f) continue;
+
+    STAT(ST_GZ_OUT, stats_flen(w->path) - w->start);
+    *last = w->next;
+    free(w->path);
+    free(w);
+    return;
+  }
+  if(offset > 0) STAT(ST_GZ_IN, offset);
+}
+
+/* Describe the shape of a hash table in the --stats summary. */
+void stats_table(hash_t *table, const char *name)
+{
+  if(stats_on && print) hasht_print(table, stderr, name);
+}
+
+/* Write a string as JSON, quoted and escaped. */
+static void stats_quote(FILE *f, const char *str)
+{
+  unsigned char c;
+
+  fputc('"', f);
+  for(; (c = *str); str++) {
+    if(c == '"' || c == '\\') fprintf(f, "\\%c", c);
+    else if(c < 0x20) fprintf(f, "\\u%04x", c);
+    else fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+void stats_report(void)
+{
+  unsigned int i;
+  double wall;
+
+  if(!stats_on) return;
+  stats_merge();
+  wall = ntx_clock() - started;
+
+  if(print) {
+    fprintf(stderr, "ntx %s: %.3f ms\n", command, wall * 1000);
+    for(i = 0; i < PH_PHASES; i++)
+      if(phases[i] > 0)
+        fprintf(stderr, "  %-14s %12.3f ms\n", phase_names[i],
+                phases[i] * 1000);
+    for(i = 0; i < ST_COUNTERS; i++)
+      fprintf(stderr, "  %-14s %12lu\n", counter_names[i], totals[i]);
+  }
+
+  if(json) {
+    fputs("{\"cmd\":", json);
+    stats_quote(json, command);
+    fprintf(json, ",\"wall_ms\":%.3f", wall * 1000);
+    for(i = 0; i < PH_PHASES; i++)
+      fprintf(json, ",\"%s_ms\":%.3f", phase_names[i], phases[i] * 1000);
+    for(i = 0; i < ST_COUNTERS; i++)
+      fprintf(json, ",\"%s\":%lu", counter_names[i], totals[i]);
+    fputs("}\n", json);
+    fclose(json);
+  }
+}
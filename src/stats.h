@@ -0,0 +1,49 @@
+#ifndef STATS__H
+#define STATS__H
+
+#include "except.h"
+#include "hash_table.h"
+
+/* Counters kept while statistics are enabled. */
+enum STAT_COUNTER {
+  ST_FOPEN = 0,  /* Files opened.                        */
+  ST_RAW_READ,   /* Bytes read from plain files.         */
+  ST_GZ_READ,    /* Bytes inflated from gzip files.      */
+  ST_GZ_IN,      /* Compressed bytes read.               */
+  ST_GZ_WRITTEN, /* Bytes deflated into gzip files.      */
+  ST_GZ_OUT,     /* Compressed bytes written.            */
+  ST_GZ_MEMBERS, /* Gzip members written.                */
+  ST_ALLOCS,     /* Calls to alloc, ralloc and strdupe.  */
+  ST_ALLOC_BYTES,
+  ST_PROBES,     /* Hash table slots examined.           */
+  ST_REHASHES,
+  ST_FILTERED,   /* Notes ruled out by Bloom filters.    */
+  ST_COUNTERS
+};
+
+/* Phases of a command, timed on the main thread. */
+enum STAT_PHASE {
+  PH_LOAD = 0,
+  PH_INTERSECT,
+  PH_OUTPUT,
+  PH_UPDATE,
+  PH_PHASES
+};
+
+extern int stats_on;
+extern THREAD_LOCAL unsigned long stats_count[ST_COUNTERS];
+
+/* Costs a single test of stats_on while statistics are disabled. */
+#define STAT(c, n) do { if(stats_on) stats_count[c] += (n); } while(0)
+
+void stats_start(char *cmd, int stderr_summary);
+void stats_begin(enum STAT_PHASE p);
+void stats_end(enum STAT_PHASE p);
+void stats_merge(void);
+void stats_report(void);
+void stats_table(hash_t *table, const char *name);
+
+void stats_gzopen(void *f, char *file, char *mode);
+void stats_gzclose(void *f, long int offset);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Timestamps of the notes, kept as a log in time order for ntx list.
+ *
+ * Whenever a note is added or edited, a line of its ID, creation time and
+ * modification time (in seconds since the epoch) is appended to the newest
+ * segment of TIMES_DIR; Once that reaches TIMES_SEGMENT bytes, another is
+ * started. Removing a note appends a line of its ID and a dash instead.
+ * The latest line for a note is the current one, so reading the segments
+ * backwards gives the notes newest first, and a query for recent notes
+ * need only read the newest segments. ntx reindex compacts the log to a
+ * single line for each note.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "except.h"
+#include "exc_io.h"
+#include "ntx.h"
+
+/* Compressed size at which a segment is complete. */
+#define TIMES_SEGMENT 65536
+
+/* Lines per segment when reindex rewrites the log. */
+#define TIMES_LINES   4096
+
+/* Parse a line of the log; Returns 0 if it is malformed, and -1 if it *
+ * records that the note was removed.                                   */
+static int times_parse(char *line, struct stamp *s)
+{
+  char *end;
+
+  if(strlen(line) < SUMMARY_OFFSET || line[ID_LENGTH] != ID_SEP) return 0;
+  strncpy(s->id, line, ID_LENGTH);
+  s->id[ID_LENGTH] = '\0';
+  if(!ntx_isid(s->id)) return 0;
+  if(!strcmp(line + SUMMARY_OFFSET, "-")) return -1;
+
+  s->created = strtol(line + SUMMARY_OFFSET, &end, 10);
+  if(*end != ID_SEP) return 0;
+  s->modified = strtol(end + 1, &end, 10);
+  return *end == '\0';
+}
+
+/* Call fn with the current stamp of each note, newest first, until it *
+ * returns 0. Notes which have since been removed are skipped, but a   *
+ * log written before removals were recorded may still name some.      */
+void times_walk(int (*fn)(struct stamp *, void *), void *arg)
+{
+  char file[FILE_MAX], *buf, *line, *end;
+  unsigned char *seen = alloc(65536 / 8);
+  unsigned long *segs;
+  unsigned int count, id, go = 1;
+  struct stamp s;
+  int kind;
+
+  memset(seen, 0, 65536 / 8);
+  segs = ntx_segments(TIMES_DIR, &count);
+
+  while(go && count--) {
+    seprintf(file, FILE_MAX, TIMES_DIR"/%08lx", segs[count]);
+    buf = ntx_buffer(file);
+
+    /* Visit the lines from the last; Each is cut off at its newline. */
+    for(end = buf + strlen(buf); go && end > buf; end = line) {
+      if(end[-1] == '\n') *--end = '\0';
+      for(line = end; line > buf && line[-1] != '\n'; line--);
+      if(!(kind = times_parse(line, &s))) continue;
+
+      id = strtol(s.id, NULL, 16);
+      if(seen[id / 8] & (1 << (id % 8))) continue;
+      seen[id / 8] |= 1 << (id % 8);
+      if(kind > 0) go = fn(&s, arg);
+    }
+    release(buf);
+  }
+
+  release(segs);
+  release(seen);
+}
+
+static int times_find(struct stamp *s, void *arg)
+{
+  if(strcmp(s->id, ((struct stamp*)arg)->id)) return 1;
+  ((struct stamp*)arg)->created = s->created;
+  return 0;
+}
+
+/* Append a line to the newest segment of the log. */
+static void times_append(char *line)
+{
+  char file[FILE_MAX];
+  unsigned long *segs, last;
+  unsigned int count;
+
+  if(ntx_mkdir(TIMES_DIR) != 0) throw(E_FACCESS, TIMES_DIR);
+  segs = ntx_segments(TIMES_DIR, &count);
+  last = count ? segs[count - 1] : 0;
+  release(segs);
+
+  seprintf(file, FILE_MAX, TIMES_DIR"/%08lx", last);
+  if(count && ntx_flen(file) >= TIMES_SEGMENT)
+    seprintf(file, FILE_MAX, TIMES_DIR"/%08lx", last + 1);
+  ntx_append(file, line);
+}
+
+/* Record that a note has just been created, or modified. */
+void times_record(char *id, int created)
+{
+  char line[SUMREC_LENGTH];
+  struct stamp s;
+
+  /* A modified note keeps its creation time; 0 if it was never recorded. */
+  strcpy(s.id, id);
+  s.created = s.modified = time(NULL);
+  if(!created) {
+    s.created = 0;
+    times_walk(times_find, &s);
+  }
+
+  seprintf(line, SUMREC_LENGTH, "%s%c%ld%c%ld\n",
+           s.id, ID_SEP, s.created, ID_SEP, s.modified);
+  times_append(line);
+}
+
+/* Record that a note has been removed, so that it is no longer walked. */
+void times_drop(char *id)
+{
+  char line[SUMREC_LENGTH];
+
+  seprintf(line, SUMREC_LENGTH, "%s%c-\n", id, ID_SEP);
+  times_append(line);
+}
+
+static int times_collect(struct stamp *s, void *arg)
+{
+  ((struct stamp*)arg)[strtol(s->id, NULL, 16)] = *s;
+  return 1;
+}
+
+/* Fill in the current stamp of every note, indexed by ID. Notes without *
+ * one are left as they were.                                            */
+void times_load(struct stamp *stamps)
+{
+  times_walk(times_collect, stamps);
+}
+
+static int times_sortstamp(const void *a, const void *b)
+{
+  const struct stamp *x = a, *y = b;
+
+  if(x->modified != y->modified) return (x->modified > y->modified) ? 1 : -1;
+  return strcmp(x->id, y->id);
+}
+
+/* Replace the log with the given stamps, which are sorted in place. */
+void times_write(struct stamp *stamps, unsigned int count)
+{
+  char file[FILE_MAX], line[SUMREC_LENGTH];
+  unsigned long *segs;
+  unsigned int i, n, len;
+  gzFile *f = NULL;
+
+  if(ntx_mkdir(TIMES_DIR) != 0) throw(E_FACCESS, TIMES_DIR);
+  qsort(stamps, count, sizeof(struct stamp), times_sortstamp);
+
+  /* Write the new segments after the old, then remove the old. */
+  segs = ntx_segments(TIMES_DIR, &n);
+  for(i = 0; i < count; i++) {
+    if(i % TIMES_LINES == 0) {
+      if(f) {
+        release(f);
+        manifest_update(file);
+      }
+      seprintf(file, FILE_MAX, TIMES_DIR"/%08lx",
+               (n ? segs[n - 1] + 1 : 0) + i / TIMES_LINES);
+      f = gzf_open(file, "w");
+    }
+    len = seprintf(line, SUMREC_LENGTH, "%s%c%ld%c%ld\n", stamps[i].id, ID_SEP,
+                   stamps[i].created, ID_SEP, stamps[i].modified);
+    gzf_write(f, line, len);
+  }
+  if(f) {
+    release(f);
+    manifest_update(file);
+  }
+
+  while(n--) {
+    seprintf(file, FILE_MAX, TIMES_DIR"/%08lx", segs[n]);
+    remove(file);
+    manifest_drop(file);
+  }
+  release(segs);
+}
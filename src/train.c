@@ -0,0 +1,170 @@
+/*
+ * ntx train: Build a dictionary to compress the notes with.
+ *
+ * zlib primes a stream with at most a window of preset dictionary, so the
+ * dictionary is made of whole lines found in more than one note, as the
+ * repeated parts of notes (templates, stack traces, logs) are repeated a
+ * line at a time. Lines are ranked by the bytes they could save, and the
+ * best are put last, as deflate finds the nearest matches most cheaply.
+ * The notes are then repacked with the new dictionary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "hash_table.h"
+#include "ntx.h"
+
+/* The size of the deflate window, which a dictionary can't usefully exceed. */
+#define DICT_MAX    32768
+
+/* At most this many notes are read, spread evenly over the store. */
+#define DICT_SAMPLE 4096
+
+/* Shorter lines are cheaper to find nearby than in the dictionary. */
+#define DICT_LINE_MIN 8
+#define DICT_LINE_MAX 512
+
+struct dline { /* A distinct line, and the number of notes it is found in. */
+  char *line;
+  unsigned int len, notes, last;
+};
+
+static unsigned long hash_dline(void *v)
+{
+  return hasht_hash(((struct dline*)v)->line, ((struct dline*)v)->len, 0);
+}
+
+static int cmp_dline(void *a, void *b)
+{
+  struct dline *x = a, *y = b;
+  return x->len != y->len || memcmp(x->line, y->line, x->len);
+}
+
+static void free_dline(void *v)
+{
+  free(((struct dline*)v)->line);
+  free(v);
+}
+
+/* The bytes which each line could save beyond its own copy. */
+static int ntx_sortdline(const void *a, const void *b)
+{
+  const struct dline *x = *(struct dline**)a, *y = *(struct dline**)b;
+  unsigned long sx = (x->notes - 1) * x->len, sy = (y->notes - 1) * y->len;
+  return (sx < sy) - (sx > sy);
+}
+
+/* The total size of the segments of the packs. */
+static unsigned long ntx_packsize(void)
+{
+  char file[FILE_MAX];
+  unsigned long *segs, total = 0;
+  unsigned int count, i;
+
+  segs = ntx_segments(PACKS_DIR, &count);
+  for(i = 0; i < count; i++) {
+    seprintf(file, FILE_MAX, PACKS_DIR"/%08lx", segs[i]);
+    total += ntx_flen(file);
+  }
+  release(segs);
+  return total;
+}
+
+/* Count the distinct lines of a note, once for each note they're in. */
+static void ntx_countlines(hash_t *lines, char *body, unsigned int note)
+{
+  struct dline key, *d;
+  char *end;
+
+  for(; *body; body = *end ? end + 1 : end) {
+    if(!(end = strchr(body, '\n'))) end = body + strlen(body);
+    key.line = body;
+    key.len  = end - body + (*end == '\n');
+    if(key.len < DICT_LINE_MIN || key.len > DICT_LINE_MAX) continue;
+
+    if(!(d = hasht_get(lines, &key))) {
+      if(!(d = malloc(sizeof(struct dline))) || !(d->line = malloc(key.len)))
+        throw(E_NOMEM, NULL);
+      memcpy(d->line, key.line, key.len);
+      d->len   = key.len;
+      d->notes = 0;
+      d->last  = note;
+      hasht_add(lines, d);
+    } else if(d->last == note) continue;
+
+    d->notes++;
+    d->last = note;
+  }
+}
+
+void ntx_train(int none)
+{
+  char file[FILE_MAX], *body, *dict;
+  unsigned long *ds, before, after;
+  unsigned int count, nds, len, i, n, size = 0, step;
+  unsigned short *ids;
+  struct dline **ranked, *d;
+  hash_t *lines;
+  exception_t exc;
+  FILE *f;
+
+  before = ntx_packsize();
+  ids = note_ids(&count);
+  dict = alloc(DICT_MAX);
+
+  if(!none) {
+    lines = hasht_init(1024, free_dline, hash_dline, hash_dline,
+                       cmp_dline, cmp_dline);
+    if(!lines) throw(E_NOMEM, NULL);
+    resource(lines, (resource_handler)hasht_free);
+
+    step = count > DICT_SAMPLE ? count / DICT_SAMPLE : 1;
+    for(i = 0; i < count; i += step) {
+      seprintf(file, FILE_MAX, NOTES_DIR"/%04x", ids[i]);
+      try body = note_read(file, &len);
+      catch(exc) continue; /* Compaction will report it, if it matters. */
+      ntx_countlines(lines, body, i + 1);
+      release(body);
+    }
+
+    /* Take the best lines which fit, then write them best last. */
+    ranked = alloc((lines->used ? lines->used : 1) * sizeof(struct dline *));
+    for(n = 0; (d = hasht_next(lines)); )
+      if(d->notes > 1) ranked[n++] = d;
+    qsort(ranked, n, sizeof(struct dline *), ntx_sortdline);
+
+    for(i = len = 0; i < n; i++)
+      if(size + ranked[i]->len <= DICT_MAX) {
+        size += ranked[i]->len;
+        ranked[len++] = ranked[i];
+      }
+    for(size = 0; len-- > 0; size += ranked[len]->len)
+      memcpy(dict + size, ranked[len]->line, ranked[len]->len);
+
+    release(ranked);
+    release(lines);
+    if(!size) die("No lines are repeated between notes; Nothing was trained.");
+  }
+
+  /* Write the dictionary after the others, then repack with it. */
+  if(ntx_mkdir(DICTS_DIR) != 0) throw(E_FACCESS, DICTS_DIR);
+  ds = ntx_segments(DICTS_DIR, &nds);
+  seprintf(file, FILE_MAX, DICTS_DIR"/%08lx", nds ? ds[nds - 1] + 1 : 0);
+  release(ds);
+
+  f = raw_open(file, "wb");
+  if(fwrite(dict, 1, size, f) != size || fflush(f) != 0) throw(E_FIOERR, f);
+  release(f);
+  release(dict);
+  release(ids);
+
+  pack_compact();
+  after = ntx_packsize();
+
+  if(none) printf("Stopped compressing %u notes; ", count);
+  else printf("Trained a dictionary of %u bytes from %u notes; ", size, count);
+  printf("They take %lu bytes, from %lu.\n", after, before);
+}
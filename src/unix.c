@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* For splice and copy_file_range. */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -5,16 +9,41 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 #include "except.h"
 #include "exc_io.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+/* Opening, stat and reading through io_uring arrived with Linux 5.6. */
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define NTX_URING
+#endif
+#endif
+
 #define NTX_DIR     ".ntx"
 #define BUFFER_LEN  8096
 #define FILE_MAX    (FILENAME_MAX+1)
 
+/* Most to ask the kernel to copy at once. */
+#define COPY_CHUNK  (1L << 30)
+
+/* Entries in the submission queue; Files are read half as many at once. */
+#define URING_DEPTH 128
+
 /* Prototypes of utility functions. */
 void die(char *fmt, ...);
+long int ntx_fcopy(FILE *in, long int off, long int len, FILE *out);
+int ntx_freadv(char **files, unsigned int n, char **bufs, long int *lens);
 
 /* System-dependent functions for POSIX. */
 void ntx_editor(char *file)
@@ -29,11 +58,10 @@ void ntx_editor(char *file)
       else waitpid(child, NULL, 0);
     } else die("The environment variable EDITOR is unset.\n");
   } else {
-    FILE *f = raw_open(file, "w");
-    char buffer[BUFFER_LEN];
+    FILE *f = raw_open(file, "wb");
 
     /* Copy data from stdin to the target file. */
-    while(fgets(buffer, BUFFER_LEN, stdin)) fputs(buffer, f);
+    if(ntx_fcopy(stdin, -1, -1, f) == -1) throw(E_FIOERR, f);
     release(f);
   }
 }
@@ -67,6 +95,315 @@ long int ntx_flen(char *file)
   return tmp.st_size;
 }
 
+long int ntx_ftime(char *file)
+{
+  struct stat tmp;
+  if(stat(file, &tmp) != 0) throw(E_FACCESS, file);
+  return tmp.st_mtime;
+}
+
+/* Copy with whichever call the kernel supports for these files; Each is *
+ * given up on for the rest of the copy once it is refused outright.     */
+#ifdef __linux__
+static ssize_t ntx_kcopy(int in, int out, size_t len, int *how)
+{
+  ssize_t n = -1;
+
+  for(; *how < 3; (*how)++) {
+    switch(*how) {
+      case 0: n = copy_file_range(in, NULL, out, NULL, len, 0); break;
+      case 1: n = sendfile(out, in, NULL, len); break;
+      case 2: n = splice(in, NULL, out, NULL, len, SPLICE_F_MORE); break;
+    }
+    if(n >= 0 || (errno != EINVAL && errno != EXDEV && errno != ENOSYS &&
+                  errno != EBADF && errno != EOPNOTSUPP && errno != ESPIPE))
+      return n;
+  }
+  return -1;
+}
+#endif
+
+long int ntx_fcopy(FILE *in, long int off, long int len, FILE *out)
+{
+  int ifd = fileno(in), ofd = fileno(out), how = 0;
+  char buffer[BUFFER_LEN];
+  long int done = 0;
+  ssize_t n, w;
+  size_t want;
+
+  if(fflush(out) != 0) return -1;
+  if(off != -1 && lseek(ifd, off, SEEK_SET) == -1) return -1;
+
+  while(len == -1 || done < len) {
+    want = (len == -1 || len - done > COPY_CHUNK) ? COPY_CHUNK : len - done;
+#ifdef __linux__
+    if(how < 3) {
+      if((n = ntx_kcopy(ifd, ofd, want, &how)) == 0) break;
+      if(n > 0) {
+        done += n;
+        continue;
+      }
+      if(how < 3 && errno == EINTR) continue;
+      if(how < 3) return -1;
+    }
+#endif
+
+    /* Otherwise, through a buffer. */
+    if(want > BUFFER_LEN) want = BUFFER_LEN;
+    if((n = read(ifd, buffer, want)) <= 0) {
+      if(n < 0 && errno == EINTR) continue;
+      if(n < 0) return -1;
+      break;
+    }
+    for(w = 0; w < n; ) {
+      ssize_t m = write(ofd, buffer + w, n - w);
+      if(m < 0 && errno == EINTR) continue;
+      if(m < 0) return -1;
+      w += m;
+    }
+    done += n;
+  }
+  return done;
+}
+
+void ntx_fhint(FILE *f, long int off, long int len)
+{
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fileno(f), off, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+#ifdef NTX_URING
+struct ntx_ring {
+  int fd;
+  unsigned int entries;
+  unsigned int *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *rings;
+  size_t rlen, slen;
+};
+
+static int ntx_rsetup(struct ntx_ring *r)
+{
+  struct io_uring_params p;
+  char *base;
+
+  memset(&p, 0, sizeof(p));
+  if((r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)) < 0) return -1;
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(r->fd);
+    return -1;
+  }
+
+  /* Both rings share one mapping, and the entries have another. */
+  r->rlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  if(p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > r->rlen)
+    r->rlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->slen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->rings = mmap(NULL, r->rlen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->rings == MAP_FAILED) {
+    close(r->fd);
+    return -1;
+  }
+  r->sqes = mmap(NULL, r->slen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED) {
+    munmap(r->rings, r->rlen);
+    close(r->fd);
+    return -1;
+  }
+
+  base = r->rings;
+  r->entries  = p.sq_entries;
+  r->sq_tail  = (unsigned int*)(base + p.sq_off.tail);
+  r->sq_mask  = (unsigned int*)(base + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int*)(base + p.sq_off.array);
+  r->cq_head  = (unsigned int*)(base + p.cq_off.head);
+  r->cq_tail  = (unsigned int*)(base + p.cq_off.tail);
+  r->cq_mask  = (unsigned int*)(base + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+  return 0;
+}
+
+static void ntx_rfree(struct ntx_ring *r)
+{
+  munmap(r->sqes, r->slen);
+  munmap(r->rings, r->rlen);
+  close(r->fd);
+}
+
+/* Queue an operation, to be identified in 'res' by 'n'. */
+static struct io_uring_sqe *ntx_rqueue(struct ntx_ring *r, int op, int fd,
+                                       unsigned int n)
+{
+  unsigned int tail = *r->sq_tail, i = tail & *r->sq_mask;
+  struct io_uring_sqe *s = r->sqes + i;
+
+  memset(s, 0, sizeof(*s));
+  s->opcode    = op;
+  s->fd        = fd;
+  s->user_data = n;
+  r->sq_array[i] = i;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return s;
+}
+
+/* Submit 'count' queued operations, and wait for every one of them. On  *
+ * failure, still wait for those submitted, so that none is left reading *
+ * into a buffer; The results of any never submitted are left untouched. */
+static int ntx_rrun(struct ntx_ring *r, unsigned int count, int *res)
+{
+  unsigned int submitted = 0, done = 0, head;
+  struct io_uring_cqe *c;
+  int ret, failed = 0;
+
+  while(done < (failed ? submitted : count)) {
+    ret = syscall(__NR_io_uring_enter, r->fd, failed ? 0 : count - submitted,
+                  1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(ret < 0) {
+      if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      if(failed) break;
+      failed = 1;
+      continue;
+    }
+    if(!failed) submitted += ret;
+
+    head = *r->cq_head;
+    for(; head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE); head++) {
+      c = r->cqes + (head & *r->cq_mask);
+      res[c->user_data] = c->res;
+      done++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return failed ? -1 : 0;
+}
+
+/* Read a batch of files: Each is opened and measured at once, then read *
+ * at once. Returns -1, with every file of the batch closed and freed,   *
+ * if the kernel doesn't know the operations or the ring fails.          */
+static int ntx_rbatch(struct ntx_ring *r, char **files, unsigned int n,
+                      char **bufs, long int *lens)
+{
+  struct statx st[URING_DEPTH / 2];
+  int res[URING_DEPTH], fds[URING_DEPTH / 2];
+  struct io_uring_sqe *s;
+  unsigned int i, m;
+  ssize_t got;
+  char *more, byte;
+
+  for(i = 0; i < n; i++) {
+    res[2 * i] = res[2 * i + 1] = -ECANCELED;
+    s = ntx_rqueue(r, IORING_OP_OPENAT, AT_FDCWD, 2 * i);
+    s->addr       = (unsigned long)files[i];
+    s->open_flags = O_RDONLY | O_CLOEXEC;
+    s = ntx_rqueue(r, IORING_OP_STATX, AT_FDCWD, 2 * i + 1);
+    s->addr = (unsigned long)files[i];
+    s->len  = STATX_SIZE;
+    s->off  = (unsigned long)(st + i);
+  }
+  m = ntx_rrun(r, 2 * n, res) != 0;
+  for(i = 0; i < n && !m; i++)
+    m = res[2 * i] == -EINVAL || res[2 * i + 1] == -EINVAL;
+  if(m) {
+    for(i = 0; i < n; i++) if(res[2 * i] >= 0) close(res[2 * i]);
+    return -1;
+  }
+
+  for(i = m = 0; i < n; i++) {
+    fds[i]  = res[2 * i];
+    bufs[i] = NULL;
+    lens[i] = -1;
+    if(fds[i] < 0) continue;
+    if(res[2 * i + 1] < 0 || !(bufs[i] = malloc(st[i].stx_size + 1))) {
+      close(fds[i]);
+      fds[i] = -1;
+      continue;
+    }
+    s = ntx_rqueue(r, IORING_OP_READ, fds[i], i);
+    s->addr = (unsigned long)bufs[i];
+    s->len  = st[i].stx_size;
+    m++;
+  }
+  if(ntx_rrun(r, m, res) != 0) {
+    for(i = 0; i < n; i++) {
+      if(fds[i] >= 0) close(fds[i]);
+      free(bufs[i]);
+    }
+    return -1;
+  }
+
+  for(i = 0; i < n; i++) {
+    if(fds[i] < 0) continue;
+    lens[i] = res[i];
+
+    /* Finish a short read, then read whatever was added since the file *
+     * was measured, as a plain read would; The buffer is only grown if  *
+     * a byte past the end shows that the file has grown.                */
+    while(lens[i] >= 0) {
+      if(lens[i] == (long)st[i].stx_size) {
+        if((got = pread(fds[i], &byte, 1, lens[i])) <= 0) {
+          if(got < 0) lens[i] = -1;
+          break;
+        }
+        if(!(more = realloc(bufs[i], 2 * st[i].stx_size + BUFFER_LEN + 1))) {
+          lens[i] = -1;
+          break;
+        }
+        bufs[i] = more;
+        bufs[i][lens[i]++] = byte;
+        st[i].stx_size = 2 * st[i].stx_size + BUFFER_LEN;
+        continue;
+      }
+      got = pread(fds[i], bufs[i] + lens[i], st[i].stx_size - lens[i],
+                  lens[i]);
+      if(got < 0) lens[i] = -1;
+      else if(got == 0) break;
+      else lens[i] += got;
+    }
+    close(fds[i]);
+
+    if(lens[i] < 0) {
+      free(bufs[i]);
+      bufs[i] = NULL;
+    } else bufs[i][lens[i]] = '\0';
+  }
+  return 0;
+}
+#endif
+
+int ntx_freadv(char **files, unsigned int n, char **bufs, long int *lens)
+{
+#ifdef NTX_URING
+  struct ntx_ring r;
+  unsigned int i, k;
+  char *env = getenv("NTX_URING");
+
+  if((env && !strcmp(env, "0")) || ntx_rsetup(&r) != 0) return -1;
+  for(i = 0; i < n; i += k) {
+    k = (n - i < r.entries / 2) ? n - i : r.entries / 2;
+    if(k > URING_DEPTH / 2) k = URING_DEPTH / 2;
+    if(ntx_rbatch(&r, files + i, k, bufs + i, lens + i) != 0) {
+      while(i--) free(bufs[i]);
+      ntx_rfree(&r);
+      return -1;
+    }
+  }
+  ntx_rfree(&r);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int ntx_mkdir(char *dir)
+{
+  return (mkdir(dir, S_IRWXU) == 0 || errno == EEXIST) ? 0 : -1;
+}
+
 DIR *ntx_dopen(char *dir)
 {
   DIR *d = opendir(dir);
@@ -86,3 +423,101 @@ void ntx_dclose(DIR *dir)
 {
   closedir(dir);
 }
+
+double ntx_clock(void)
+{
+  struct timespec ts;
+
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned int ntx_ncpu(void)
+{
+  long int n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (unsigned int)n : 1;
+}
+
+struct ntx_thread {
+  pthread_t id;
+  void (*fn)(void *);
+  void *arg;
+};
+
+static void *ntx_trun(void *t)
+{
+  /* Clean up anything the thread left in its own resource list. */
+  ((struct ntx_thread*)t)->fn(((struct ntx_thread*)t)->arg);
+  release_all();
+  return NULL;
+}
+
+void *ntx_tstart(void (*fn)(void *), void *arg)
+{
+  struct ntx_thread *t = malloc(sizeof(struct ntx_thread));
+
+  if(!t) return NULL;
+  t->fn  = fn;
+  t->arg = arg;
+  if(pthread_create(&t->id, NULL, ntx_trun, t) != 0) {
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+void ntx_tjoin(void *t)
+{
+  pthread_join(((struct ntx_thread*)t)->id, NULL);
+  free(t);
+}
+
+struct ntx_monitor {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+void *ntx_mnew(void)
+{
+  struct ntx_monitor *m = malloc(sizeof(struct ntx_monitor));
+
+  if(!m) return NULL;
+  if(pthread_mutex_init(&m->lock, NULL) != 0) {
+    free(m);
+    return NULL;
+  }
+  if(pthread_cond_init(&m->wake, NULL) != 0) {
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+    return NULL;
+  }
+  return m;
+}
+
+void ntx_mfree(void *m)
+{
+  pthread_cond_destroy(&((struct ntx_monitor*)m)->wake);
+  pthread_mutex_destroy(&((struct ntx_monitor*)m)->lock);
+  free(m);
+}
+
+void ntx_mlock(void *m)
+{
+  pthread_mutex_lock(&((struct ntx_monitor*)m)->lock);
+}
+
+void ntx_munlock(void *m)
+{
+  pthread_mutex_unlock(&((struct ntx_monitor*)m)->lock);
+}
+
+void ntx_mwait(void *m)
+{
+  pthread_cond_wait(&((struct ntx_monitor*)m)->wake,
+                    &((struct ntx_monitor*)m)->lock);
+}
+
+void ntx_mwake(void *m)
+{
+  pthread_cond_broadcast(&((struct ntx_monitor*)m)->wake);
+}
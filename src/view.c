@@ -0,0 +1,263 @@
+/*
+ * Views: Saved intersections of tags, kept as posting lists of their own.
+ *
+ * VIEWS_MAP has a line of the name and tags of each view, and each view
+ * has a file of VIEWS_DIR holding the notes with all of its tags, just as
+ * a tag file does, so that ntx list @name is a single read. Each change
+ * to the tags of one note is checked against the views, and a view is
+ * only written when the note joins or leaves it, or has a new summary.
+ * Commands which retag many notes at once rebuild the views which name
+ * any of those tags instead, and ntx reindex rebuilds every view.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "except.h"
+#include "exc_io.h"
+#include "ntx.h"
+
+#define VIEWS_MAP VIEWS_DIR"/map"
+
+struct view {
+  char *name;
+  char **tags; /* NULL terminated. */
+};
+
+/* Read every view, whose strings are held in 'buf'; NULL if none exist. */
+static struct view *view_load(char **buf, unsigned int *count)
+{
+  struct view *views;
+  char *line, *end, *tab;
+  unsigned int size = 8;
+  exception_t exc;
+
+  *count = 0;
+  try *buf = ntx_buffer(VIEWS_MAP);
+  catch(exc) {
+    if(exc.type != E_FACCESS) throw(exc.type, exc.value);
+    return NULL;
+  }
+
+  views = alloc(size * sizeof(struct view));
+  for(line = *buf; *line; line = end + 1) {
+    if(!(end = strchr(line, '\n'))) throw(E_INVAL, VIEWS_MAP);
+    *end = '\0';
+    if(!(tab = strchr(line, ID_SEP))) throw(E_INVAL, VIEWS_MAP);
+    *tab = '\0';
+
+    if(*count == size) views = ralloc(views, (size *= 2) * sizeof(struct view));
+    views[*count].name = line;
+    views[(*count)++].tags = strtokens(tab + 1, FIELD_SEP);
+  }
+  return views;
+}
+
+static void view_free(struct view *views, unsigned int count, char *buf)
+{
+  while(count--) release(views[count].tags);
+  release(views);
+  release(buf);
+}
+
+/* Whether every one of 'tags' is in 'have', which may be NULL. */
+static int view_match(char **tags, char **have)
+{
+  char **t, **h;
+
+  if(!have) return 0;
+  for(t = tags; *t; t++) {
+    for(h = have; *h && strcmp(*t, *h); h++);
+    if(!*h) return 0;
+  }
+  return 1;
+}
+
+/* Write the notes of a view afresh; Returns how many it has. */
+static unsigned int view_build(struct view *v)
+{
+  char file[FILE_MAX], *result = NULL;
+  unsigned int tagc, count = 0;
+  exception_t exc;
+  gzFile *out;
+  int missing = 0;
+
+  /* A view of a tag which has no notes has none either. */
+  for(tagc = 0; v->tags[tagc]; tagc++) {
+    seprintf(file, FILE_MAX, TAGS_DIR"/%s", v->tags[tagc]);
+    try ntx_flen(file);
+    catch(exc) missing = 1;
+  }
+  if(!missing) result = ntx_select(v->tags, tagc);
+
+  seprintf(file, FILE_MAX, VIEWS_DIR"/%s", v->name);
+  if(result && *result) {
+    count = ntx_lines(result, file);
+    out = gzf_open(file, "w");
+    gzf_write(out, result, strlen(result));
+    release(out);
+  } else remove(file);
+  manifest_update(file);
+
+  if(result) release(result);
+  return count;
+}
+
+/* Rewrite VIEWS_MAP without the view 'name', then with it as 'tags' if *
+ * they are given. The map is removed once it has no views.             */
+static void view_savemap(char *name, char **tags)
+{
+  struct view *views;
+  char *buf, **t;
+  unsigned int count, i, written = 0;
+  gzFile *out;
+
+  views = view_load(&buf, &count);
+  if(ntx_mkdir(VIEWS_DIR) != 0) throw(E_FACCESS, VIEWS_DIR);
+  out = gzf_open(VIEWS_MAP".new", "w");
+
+  for(i = 0; i < count; i++) {
+    if(!strcmp(views[i].name, name)) continue;
+    written += gzf_putl(out, views[i].name);
+    gzf_putl(out, "\t");
+    for(t = views[i].tags; *t; t++) {
+      gzf_putl(out, *t);
+      gzf_putl(out, (char*)FIELD_SEP);
+    }
+    gzf_putl(out, "\n");
+  }
+  if(tags) {
+    written += gzf_putl(out, name);
+    gzf_putl(out, "\t");
+    for(t = tags; *t; t++) {
+      gzf_putl(out, *t);
+      gzf_putl(out, (char*)FIELD_SEP);
+    }
+    gzf_putl(out, "\n");
+  }
+  release(out);
+  if(views) view_free(views, count, buf);
+
+  if(rename(VIEWS_MAP".new", VIEWS_MAP) != 0) throw(E_FACCESS, VIEWS_MAP);
+  if(written == 0) remove(VIEWS_MAP);
+  manifest_update(VIEWS_MAP);
+}
+
+/* Whether the view 'name' is defined. */
+static int view_exists(char *name)
+{
+  struct view *views;
+  unsigned int count, i;
+  char *buf;
+
+  if(!(views = view_load(&buf, &count))) return 0;
+  for(i = 0; i < count && strcmp(views[i].name, name); i++);
+  view_free(views, count, buf);
+  return i < count;
+}
+
+/* Save the intersection of 'tags' as the view 'name', replacing any view *
+ * of that name.                                                          */
+void view_create(char *name, char **tags, unsigned int tagc)
+{
+  struct view v;
+  char **t;
+
+  if(!*name || strchr(name, '/') || strchr(name, ID_SEP) ||
+     !strcmp(name, "map") || strstr(name, ".new"))
+    die("Invalid view name %s.", name);
+  if(tagc > 127) die("Too many (more than 127) tags.");
+  for(t = tags; *t; t++)
+    if(!**t || strchr(*t, ID_SEP) || strchr(*t, *FIELD_SEP))
+      die("Invalid tag %s.", *t);
+
+  view_savemap(name, tags);
+  v.name = name;
+  v.tags = tags;
+  printf("Saved the view @%s, of %u notes.\n", name, view_build(&v));
+}
+
+void view_drop(char *name)
+{
+  char file[FILE_MAX];
+
+  if(!view_exists(name)) die("There is no view @%s.", name);
+  view_savemap(name, NULL);
+  seprintf(file, FILE_MAX, VIEWS_DIR"/%s", name);
+  remove(file);
+  manifest_update(file);
+}
+
+/* Print the name and tags of each view. */
+void view_list(void)
+{
+  struct view *views;
+  unsigned int count, i;
+  char *buf, **t;
+
+  if(!(views = view_load(&buf, &count))) return;
+  for(i = 0; i < count; i++) {
+    printf("@%s", views[i].name);
+    for(t = views[i].tags; *t; t++) printf(" %s", *t);
+    putchar('\n');
+  }
+  view_free(views, count, buf);
+}
+
+/* Fill in the file of the view 'name'; Returns 0 if it has no notes. */
+int view_file(char *name, char *file)
+{
+  exception_t exc;
+  int found = 1;
+
+  seprintf(file, FILE_MAX, VIEWS_DIR"/%s", name);
+  try ntx_flen(file);
+  catch(exc) found = 0;
+  if(!found && !view_exists(name)) die("There is no view @%s.", name);
+  return found;
+}
+
+/* Bring the views up to date with a note which had the tags 'old' and now *
+ * has 'new' (either NULL if it has none), with the line 'desc' of its ID  *
+ * and summary. A view which keeps the note is only rewritten if 'old' is *
+ * 'new', as ntx edit passes when the summary has changed.                 */
+void view_update(char *desc, char **old, char **new)
+{
+  struct view *views;
+  char file[FILE_MAX], *buf;
+  unsigned int count, i;
+  int was, now;
+
+  if(!(views = view_load(&buf, &count))) return;
+  for(i = 0; i < count; i++) {
+    was = view_match(views[i].tags, old);
+    now = view_match(views[i].tags, new);
+    if(!was && !now) continue;
+
+    seprintf(file, FILE_MAX, VIEWS_DIR"/%s", views[i].name);
+    if(!was) ntx_append(file, desc);
+    else if(!now) ntx_replace(file, desc, NULL);
+    else if(old == new) ntx_replace(file, desc, desc);
+  }
+  view_free(views, count, buf);
+}
+
+/* Rebuild the views which name any of the 'n' tags, or every view if *
+ * 'tags' is NULL.                                                    */
+void view_refresh(char **tags, unsigned int n)
+{
+  struct view *views;
+  unsigned int count, i, k;
+  char *buf, **t;
+
+  if(!(views = view_load(&buf, &count))) return;
+  for(i = 0; i < count; i++) {
+    for(t = views[i].tags; tags && *t; t++) {
+      for(k = 0; k < n && strcmp(*t, tags[k]); k++);
+      if(k < n) break;
+    }
+    if(!tags || *t) view_build(views + i);
+  }
+  view_free(views, count, buf);
+  if(!tags) manifest_update(VIEWS_MAP);
+}
@@ -6,8 +6,14 @@
 #include <io.h>
 #include <fcntl.h>
 #include <process.h>
+#include <direct.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "except.h"
 
 #define NTX_DIR "ntx"
+#define BUFFER_LEN 8192
 #define FILE_MAX (FILENAME_MAX+1)
 
 /* Prototypes of utility functions. */
@@ -45,6 +51,138 @@ void ntx_homedir(char *sub, ...)
   va_end(args);
 }
 
+long int ntx_fcopy(FILE *in, long int off, long int len, FILE *out)
+{
+  char buffer[BUFFER_LEN];
+  long int done = 0;
+  size_t n, want;
+
+  if(off != -1 && fseek(in, off, SEEK_SET) != 0) return -1;
+  while(len == -1 || done < len) {
+    want = (len == -1 || len - done > BUFFER_LEN) ? BUFFER_LEN : len - done;
+    if(!(n = fread(buffer, 1, want, in))) break;
+    if(fwrite(buffer, 1, n, out) != n) return -1;
+    done += n;
+  }
+  return (ferror(in) || fflush(out) != 0) ? -1 : done;
+}
+
+void ntx_fhint(FILE *f, long int off, long int len)
+{
+  /* No hints; Windows reads ahead sequential access by itself. */
+}
+
+int ntx_freadv(char **files, unsigned int n, char **bufs, long int *lens)
+{
+  return -1; /* The core reads them on its worker threads instead. */
+}
+
+double ntx_clock(void)
+{
+  LARGE_INTEGER now, freq;
+
+  if(!QueryPerformanceCounter(&now) || !QueryPerformanceFrequency(&freq))
+    return 0;
+  return (double)now.QuadPart / freq.QuadPart;
+}
+
+unsigned int ntx_ncpu(void)
+{
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+}
+
+struct ntx_thread {
+  HANDLE id;
+  void (*fn)(void *);
+  void *arg;
+};
+
+static DWORD WINAPI ntx_trun(LPVOID t)
+{
+  /* Clean up anything the thread left in its own resource list. */
+  ((struct ntx_thread*)t)->fn(((struct ntx_thread*)t)->arg);
+  release_all();
+  return 0;
+}
+
+void *ntx_tstart(void (*fn)(void *), void *arg)
+{
+  struct ntx_thread *t = malloc(sizeof(struct ntx_thread));
+
+  if(!t) return NULL;
+  t->fn  = fn;
+  t->arg = arg;
+  if(!(t->id = CreateThread(NULL, 0, ntx_trun, t, 0, NULL))) {
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+void ntx_tjoin(void *t)
+{
+  WaitForSingleObject(((struct ntx_thread*)t)->id, INFINITE);
+  CloseHandle(((struct ntx_thread*)t)->id);
+  free(t);
+}
+
+struct ntx_monitor {
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake;
+};
+
+void *ntx_mnew(void)
+{
+  struct ntx_monitor *m = malloc(sizeof(struct ntx_monitor));
+
+  if(!m) return NULL;
+  InitializeCriticalSection(&m->lock);
+  InitializeConditionVariable(&m->wake);
+  return m;
+}
+
+void ntx_mfree(void *m)
+{
+  DeleteCriticalSection(&((struct ntx_monitor*)m)->lock);
+  free(m);
+}
+
+void ntx_mlock(void *m)
+{
+  EnterCriticalSection(&((struct ntx_monitor*)m)->lock);
+}
+
+void ntx_munlock(void *m)
+{
+  LeaveCriticalSection(&((struct ntx_monitor*)m)->lock);
+}
+
+void ntx_mwait(void *m)
+{
+  SleepConditionVariableCS(&((struct ntx_monitor*)m)->wake,
+                           &((struct ntx_monitor*)m)->lock, INFINITE);
+}
+
+void ntx_mwake(void *m)
+{
+  WakeAllConditionVariable(&((struct ntx_monitor*)m)->wake);
+}
+
+long int ntx_ftime(char *file)
+{
+  struct _stat tmp;
+  if(_stat(file, &tmp) != 0) throw(E_FACCESS, file);
+  return (long int)tmp.st_mtime;
+}
+
+int ntx_mkdir(char *dir)
+{
+  return (_mkdir(dir) == 0 || errno == EEXIST) ? 0 : -1;
+}
+
 long int ntx_flen(char *file)
 {
   int fd = _open(file, _O_RDONLY);
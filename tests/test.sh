@@ -224,6 +224,157 @@ assert del-4c "$TAGS" "*pacman*"
 assert del-4d "$TAGS" "*COW*"
 assert del-4e "$TAGS" "*unix*"
 
+# Test rebuilding the derived files, which are then sorted by ID.
+rm $NTXROOT/index $NTXROOT/tags/todo
+$NTX reindex > /dev/null
+SORTED=`echo "$Bi$TAB$Bv
+$Ci$TAB$Cv" | sort`
+assert reindex-1 "`$NTX list`" "$SORTED"
+assert reindex-2 "`$NTX list todo`" "$SORTED"
+assert reindex-3 "`$NTX tag $Ci`" "pacman
+todo
+COW
+unix"
+
+# Test checking the notes, then repairing an interrupted retag.
+assert fsck-1 "`$NTX fsck`" ""
+$NTX tag $Bi ntx
+echo "$Bi$TAB$Bv" | gzip >> $NTXROOT/tags/todo
+$NTX fsck > /dev/null
+assert fsck-2 "$?" "1"
+$NTX fsck --repair > /dev/null
+assert fsck-3 "`$NTX fsck`" ""
+assert fsck-4 "`$NTX tag $Bi`" "ntx
+todo"
+
+# Test that statistics go to stderr, leaving the output alone.
+assert stats-1 "`$NTX --stats list todo 2> /dev/null`" "`$NTX list todo`"
+assert stats-2 "`NTX_STATS=/dev/stdout $NTX tag $Bi | grep -c files_opened`" "1"
+
+# Test that cached intersections are dropped once one of their tags changes.
+assert cache-1 "`$NTX list todo unix`" "$Ci$TAB$Cv"
+assert cache-2 "`$NTX list unix todo`" "$Ci$TAB$Cv"
+$NTX tag $Bi todo unix
+assert cache-3 "`$NTX list todo unix | sort`" "$SORTED"
+
+# Test listing by time; Each note was stamped when it was added or edited.
+assert time-1 "`$NTX list --since @0 todo unix | sort`" "$SORTED"
+assert time-2 "`$NTX list --until @0 todo unix`" ""
+assert time-3 "`$NTX list --limit 1 --reverse | wc -l`" "1"
+assert time-3b "`$NTX list --limit -1 2>&1`" "ERROR: Invalid limit -1."
+
+# Test listing by time once the newest note has been removed.
+ed_write "$A"
+Ei=`_ntx $EDIT add gone | cut -b 1-4`
+$NTX rm $Ei
+assert time-4 "`$NTX list --limit 5 | sort`" "$SORTED"
+
+# Test that an edit which changes nothing leaves the note where it was.
+NEWEST=`$NTX list --limit 1`
+EDITOR=true $NTX edit `$NTX list --limit 1 --reverse | cut -f 1` > /dev/null
+assert time-5 "`$NTX list --limit 1`" "$NEWEST"
+
+# Test the machine-readable output formats.
+assert format-1 "`$NTX --format=ndjson list todo unix | wc -l`" "2"
+assert format-2 "`$NTX --format=json tag $Ci | tr -d '\n' | tr '[]' '()'`" '("pacman","todo","COW","unix")'
+assert format-3 "`$NTX --format=nul list todo | tr '\0' '\n' | sort`" "$SORTED"
+
+# Test that the filters follow their tags, and are ignored once stale.
+assert filter-1 "`ls $NTXROOT/filters | grep -c '^unix$'`" "1"
+$NTX tag $Bi todo
+assert filter-2 "`NTX_CACHE=0 $NTX list todo unix`" "$Ci$TAB$Cv"
+echo "$Bi$TAB$Bv" | gzip >> $NTXROOT/tags/unix
+assert filter-3 "`NTX_CACHE=0 $NTX list todo unix | sort`" "$SORTED"
+
+# Test that notes are packed, and that reindex packs any loose notes.
+assert pack-1 "`ls $NTXROOT/notes`" ""
+echo "Loose" > $NTXROOT/notes/0000
+assert pack-2 "`$NTX put 0000`" "Loose"
+$NTX reindex > /dev/null
+assert pack-3 "`ls $NTXROOT/notes``$NTX put 0000`" "Loose"
+
+# Test that notes read back the same once compressed, and once not.
+ed_write "$C"
+Di=`_ntx $EDIT add dict | cut -b 1-4`
+$NTX train > /dev/null
+assert dict-1 "`$NTX put $Di`" "$C"
+assert dict-2 "`$NTX put $Ci`" "$C"
+$NTX train --none > /dev/null
+assert dict-3 "`$NTX put $Ci`" "$C"
+
+# Test that each version of an edited note can be read back.
+ed_write "$A"
+_ntx $EDIT edit $Di > /dev/null
+assert history-1 "`$NTX log $Di | cut -f 1 | tr '\n' ' '`" "$Di@2 $Di@1 "
+assert history-2 "`$NTX put $Di@1`" "$C"
+assert history-3 "`$NTX put $Di@2`" "$A"
+
+# Test putting several notes at once, and adding a NUL byte from stdin.
+assert put-1 "`$NTX put $Ci $Di@2`" "$C
+$A"
+Ni=`printf 'nul\0byte\n' | $NTX add nul | cut -b 1-4`
+assert put-2 "`$NTX put $Ni | tr '\0' '-'`" "nul-byte"
+
+# Test that streaming files under --memory gives the same results.
+assert memory-1 "`$NTX --memory=1 list todo unix`" "`$NTX list todo unix`"
+$NTX --memory=1 tag $Ni nul streamed
+assert memory-2 "`$NTX --memory=1 list streamed`" "`$NTX list nul`"
+assert memory-3 "`$NTX --memory=1 tag $Ni`" "nul
+streamed"
+
+# Test renaming a tag, then merging it with another into a third.
+$NTX tag-rename streamed flowed > /dev/null
+assert tag-rename "`$NTX tag $Ni`" "nul
+flowed"
+$NTX tag-merge nul flowed dense > /dev/null
+assert tag-merge "`$NTX tag $Ni``$NTX list dense | wc -l`" "dense1"
+assert tagname "`$NTX tag $Ni --dense 2>&1`" "ERROR: Invalid tag --dense."
+
+# Test adding and removing tags of every note with some tags at once.
+$NTX retag --where dense +sparse -dense > /dev/null
+assert bulktag-1 "`$NTX tag $Ni`" "sparse"
+assert bulktag-2 "`$NTX retag --where todo unix +todo`" "Changed the tags of 0 notes."
+
+# Test that a view follows the notes which join and leave its tags.
+$NTX view create sv sparse nul > /dev/null
+assert view-1 "`$NTX list @sv`" "`$NTX list sparse nul`"
+$NTX tag $Ni sparse > /dev/null
+assert view-2 "`$NTX list @sv`" ""
+$NTX tag $Ni sparse nul > /dev/null
+assert view-3 "`$NTX list @sv`" "`$NTX list sparse`"
+
+# Test counting the notes of some tags, and the other tags they have.
+assert count-1 "`$NTX count todo`" "`$NTX list todo | wc -l`"
+assert facets-1 "`$NTX facets sparse`" "1${TAB}nul"
+assert facets-2 "`$NTX --format=ndjson facets sparse`" '{"tag":"nul","count":1}'
+
+# Test that a note like another is suggested, and no longer once it is removed.
+Ri=`printf 'alpha beta gamma delta\n' | $NTX add greek | cut -b 1-4`
+Si=`printf 'alpha beta gamma epsilon\n' | $NTX add greek | cut -b 1-4`
+assert related-1 "`$NTX related $Ri | cut -f 1`" "$Si"
+$NTX rm $Si
+assert related-2 "`$NTX related $Ri`" ""
+
+# Test finding notes by their summaries, exactly and within an edit.
+assert find-1 "`$NTX find 'ALPHA beta'`" "$Ri${TAB}alpha beta gamma delta"
+assert find-2 "`$NTX find --fuzzy gamma-delta greek`" "$Ri${TAB}alpha beta gamma delta"
+assert find-3 "`$NTX find --fuzzy gamma-delta todo`" ""
+
+# Test that an intersection checked against the refs follows them where
+# they disagree with the tags, and that fsck --repair reconciles the two.
+$NTX tag $Ri greek todo
+REFS=$NTXROOT/refs/`echo $Ri | cut -b 1-2`
+gzip -dc $REFS | sed "s/^$Ri$TAB.*/$Ri${TAB}greek;/" | gzip > $REFS.new
+mv $REFS.new $REFS
+assert byrefs-1 "`NTX_CACHE=0 $NTX list greek todo`" ""
+$NTX fsck --repair > /dev/null
+assert byrefs-2 "`NTX_CACHE=0 $NTX list greek todo`" "$Ri${TAB}alpha beta gamma delta"
+
+# Test that a note is suggested once merging its tag makes it like another.
+Ti=`printf 'alpha beta gamma epsilon\n' | $NTX add latin todo | cut -b 1-4`
+$NTX tag-merge latin greek > /dev/null
+assert related-3 "`$NTX related $Ri | cut -f 1`" "$Ti"
+
 # Clean up after ourselves.
 rm -r $NTXROOT
 rm $EDIT